@@ -0,0 +1,18 @@
+#version 330 core
+
+// Running average of the frames of AccumulationBuffer
+
+in vec2 v_uv;
+
+out vec4 FragColor;
+
+uniform sampler2D u_texture; // new frame
+uniform sampler2D u_history;
+uniform float u_weight; // 1 / frames in the average
+
+void main()
+{
+    // The first frame does not read the history, it is undefined after a resize
+    vec4 frame = texture(u_texture, v_uv);
+    FragColor = u_weight >= 1.0 ? frame : mix(texture(u_history, v_uv), frame, u_weight);
+}
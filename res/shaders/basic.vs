@@ -6,8 +6,8 @@ in vec4 a_color;
 in vec2 a_uv;
 
 uniform mat4 u_model;
-uniform mat4 u_viewprojection;
-uniform vec3 u_camera_position;
+
+#include "include/frame.glsl"
 
 //this will store the color for the pixel shader
 out vec3 v_position;
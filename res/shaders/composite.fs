@@ -0,0 +1,14 @@
+#version 330 core
+
+// Premultiplied color with coverage in alpha, drawn with glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA)
+
+in vec2 v_uv;
+
+out vec4 FragColor;
+
+uniform sampler2D u_texture;
+
+void main()
+{
+    FragColor = texture(u_texture, v_uv);
+}
@@ -0,0 +1,9 @@
+// Camera and scene, filled once per frame by Application::render
+layout(std140) uniform Frame {
+    mat4 u_viewprojection;
+    mat4 u_inv_viewprojection;
+    vec3 u_camera_position;
+    float u_frame_padding;
+    vec4 u_ambient_light;
+    vec4 u_background_color;
+};
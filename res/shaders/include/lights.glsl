@@ -0,0 +1,15 @@
+// Every light of the scene (see LightBuffer), position.w: radius (0 reaches everything), color: rgb * intensity
+#define MAX_LIGHTS 16
+struct sLight { vec4 position; vec4 color; };
+layout(std140) uniform Lights { sLight u_lights[MAX_LIGHTS]; };
+uniform int u_num_lights; // the ones that reach this node
+uniform int u_light_indices[MAX_LIGHTS];
+
+// Smooth window, reaches zero at the radius so culled lights do not pop
+float lightFalloff(vec4 light, vec3 position)
+{
+    if (light.w <= 0.0) return 1.0;
+    float x = length(light.xyz - position) / light.w;
+    float w = clamp(1.0 - x * x * x * x, 0.0, 1.0);
+    return w * w;
+}
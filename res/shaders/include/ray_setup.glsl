@@ -0,0 +1,36 @@
+// Needs u_model, u_inv_model, u_box_min and u_box_max declared before it
+#include "scene_depth.glsl"
+
+// Ray setup (see RaySetup): local positions where the view ray enters and leaves the proxy geometry,
+// w = 1 where it was rasterized. Drawn as a full screen pass, so rays that start inside the volume work too
+uniform sampler2D u_ray_entry;
+uniform sampler2D u_ray_exit;
+
+// Local space ray of this pixel, false when it misses the volume or starts behind an opaque surface.
+// Also writes the depth of the entry point, used when the volumes are composited over the scene, unless
+// RAY_SETUP_NO_DEPTH is defined before the include (passes that trim the ray further write it themselves)
+bool setupRay(out vec3 rayOriginLoc, out vec3 rayDirLoc, out float tEntry, out float tExit)
+{
+    vec2 uv = gl_FragCoord.xy / u_viewport_size;
+    ivec2 texel = ivec2(uv * vec2(textureSize(u_ray_exit, 0)));
+
+    vec4 exitPoint = texelFetch(u_ray_exit, texel, 0);
+    if (exitPoint.w == 0.0)
+        return false;
+
+    rayOriginLoc = (u_inv_model * vec4(u_camera_position, 1.0)).xyz;
+    rayDirLoc = normalize(exitPoint.xyz - rayOriginLoc);
+    tExit = min(dot(exitPoint.xyz - rayOriginLoc, rayDirLoc), opaqueDistance(uv, rayOriginLoc, rayDirLoc));
+
+    // Front faces behind the camera are clipped, the ray starts at the eye
+    vec4 entryPoint = texelFetch(u_ray_entry, texel, 0);
+    bool inside = all(greaterThan(rayOriginLoc, u_box_min)) && all(lessThan(rayOriginLoc, u_box_max));
+    tEntry = (inside || entryPoint.w == 0.0) ? 0.0 : dot(entryPoint.xyz - rayOriginLoc, rayDirLoc);
+
+#ifndef RAY_SETUP_NO_DEPTH
+    vec4 clip = u_viewprojection * u_model * vec4(rayOriginLoc + rayDirLoc * tEntry, 1.0);
+    gl_FragDepth = tEntry > 0.0 ? clip.z / clip.w * 0.5 + 0.5 : 0.0;
+#endif
+
+    return tEntry < tExit;
+}
@@ -0,0 +1,8 @@
+#include "volume_material.glsl"
+#include "stepping.glsl"
+
+// Adaptive step with the parameters of the Material block
+float nextStep(float extinction, float prevExtinction, float dt)
+{
+    return adaptiveStep(extinction, prevExtinction, dt, u_step_length, u_max_step_scale);
+}
@@ -0,0 +1,18 @@
+// Needs u_inv_model declared before it
+#include "frame.glsl"
+
+// Opaque scene (Application::scene_fbo), rays stop at its surface
+uniform sampler2D u_scene_depth;
+uniform vec2 u_viewport_size; // of the target the volume is drawn to
+
+// Distance along the local space ray to the opaque surface behind this fragment
+float opaqueDistance(vec2 uv, vec3 rayOriginLoc, vec3 rayDirLoc)
+{
+    float depth = texture(u_scene_depth, uv).r;
+    if (depth >= 1.0)
+        return 1e30;
+
+    vec4 world = u_inv_viewprojection * vec4(vec3(uv, depth) * 2.0 - 1.0, 1.0);
+    vec3 local = (u_inv_model * vec4(world.xyz / world.w, 1.0)).xyz;
+    return dot(local - rayOriginLoc, rayDirLoc);
+}
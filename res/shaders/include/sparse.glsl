@@ -0,0 +1,49 @@
+// Needs u_box_min and u_box_max declared before it
+#include "intersect.glsl"
+
+#ifdef SPARSE_GRID
+// Sparse VDB grid (see SparseVolume): root table -> internal nodes (4^3 leaves) -> leaves (8^3 voxels)
+uniform usamplerBuffer u_sparse_root;
+uniform usamplerBuffer u_sparse_internal;
+uniform samplerBuffer u_sparse_leaves;
+uniform ivec3 u_sparse_dims;
+uniform ivec3 u_sparse_root_dims;
+
+const uint SPARSE_EMPTY = 0xFFFFFFFFu;
+
+// Density at a local point. "skip" returns the size in voxels of the empty node around the point (0 if it is active)
+float sampleSparse(vec3 point, out float skip)
+{
+    vec3 voxel = (point - u_box_min) / (u_box_max - u_box_min) * vec3(u_sparse_dims);
+    ivec3 ijk = clamp(ivec3(floor(voxel)), ivec3(0), u_sparse_dims - 1);
+
+    ivec3 node = ijk / 32;
+    uint internal = texelFetch(u_sparse_root, node.x + (node.y + node.z * u_sparse_root_dims.y) * u_sparse_root_dims.x).r;
+    if (internal == SPARSE_EMPTY) {
+        skip = 32.0;
+        return 0.0;
+    }
+
+    ivec3 child = (ijk / 8) % 4;
+    int c = child.x + child.y * 4 + child.z * 16;
+    int base = int(internal) * 66;
+    uint mask = texelFetch(u_sparse_internal, base + c / 32).r;
+    if ((mask & (1u << uint(c % 32))) == 0u) {
+        skip = 8.0;
+        return 0.0;
+    }
+
+    int leaf = int(texelFetch(u_sparse_internal, base + 2 + c).r);
+    ivec3 v = ijk % 8;
+    skip = 0.0;
+    return texelFetch(u_sparse_leaves, leaf * 512 + v.x + v.y * 8 + v.z * 64).r;
+}
+
+// Ray distance from point to the exit of the empty node of "size" voxels that contains it
+float sparseNodeExit(vec3 point, vec3 rayDir, float size)
+{
+    vec3 voxelSize = (u_box_max - u_box_min) / vec3(u_sparse_dims);
+    vec3 nodeMin = u_box_min + floor((point - u_box_min) / (voxelSize * size)) * voxelSize * size;
+    return intersectAABB(point, rayDir, nodeMin, nodeMin + voxelSize * size).y;
+}
+#endif
@@ -0,0 +1,28 @@
+// Adaptive stepping (see VolumeMaterial::quality), step after a sample: up to maxStepScale * stepLength
+// where the extinction is flat along the ray, stepLength where it changes
+float adaptiveStep(float extinction, float prevExtinction, float dt, float stepLength, float maxStepScale)
+{
+    float change = abs(extinction - prevExtinction) * stepLength;
+    float scale = mix(maxStepScale, 1.0, clamp(change * 20.0, 0.0, 1.0));
+
+    // Grow gradually, so a thin feature after a flat region is not stepped over
+    return min(stepLength * scale, dt * 2.0);
+}
+
+#ifdef JITTER
+// Per pixel offset of the first sample in [0, 1): blue noise shifted along the golden ratio
+// sequence every accumulated frame, so the fixed step grid turns into noise that averages out
+uniform sampler2D u_blue_noise;
+uniform float u_frame_offset;
+
+float rayOffset()
+{
+    ivec2 texel = ivec2(gl_FragCoord.xy) % textureSize(u_blue_noise, 0);
+    return fract(texelFetch(u_blue_noise, texel, 0).r + u_frame_offset);
+}
+#else
+float rayOffset()
+{
+    return 0.5;
+}
+#endif
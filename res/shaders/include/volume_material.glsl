@@ -0,0 +1,13 @@
+// Material parameters, uploaded by VolumeMaterial::setUniforms when they change
+layout(std140) uniform Material {
+    vec4 u_color;
+    vec3 u_box_min;
+    float u_absorption_coefficient;
+    vec3 u_box_max;
+    float u_scattering_coefficient;
+    float u_step_length;
+    float noise_scale;
+    float g_value;
+    float u_min_transmittance;
+    float u_max_step_scale;
+};
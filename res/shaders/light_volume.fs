@@ -0,0 +1,107 @@
+#version 330 core
+
+// Variant defines, same as the volume shaders (see VolumeMaterial::getShaderMacros())
+#ifndef VOLUME_TYPE
+#define VOLUME_TYPE 0
+#endif
+
+// Light transmittance volume: one slice per draw, each texel marches toward the light
+// exactly like the secondary rays of volume_emission_scattering.fs
+
+in vec2 v_uv;
+
+out vec4 FragColor;
+
+uniform float u_absorption_coefficient;
+uniform float u_scattering_coefficient;
+uniform float u_step_length;
+uniform float noise_scale;
+uniform sampler3D u_noise_texture;
+uniform vec3 u_box_min;
+uniform vec3 u_box_max;
+
+uniform vec3 u_local_light_position;
+
+uniform sampler3D u_texture;
+
+uniform float u_slice; // z of this slice in texture space
+
+#include "include/intersect.glsl"
+#include "include/sparse.glsl"
+
+#if VOLUME_TYPE == 1 && !defined(BAKED_NOISE)
+#include "include/snoise.glsl"
+#endif
+
+#if VOLUME_TYPE == 1
+float getAbsorption(vec3 point)
+{
+#ifdef BAKED_NOISE
+    float noise = texture(u_noise_texture, (point - u_box_min) / (u_box_max - u_box_min)).r;
+#else
+    float noise = snoise(point * noise_scale);
+#endif
+    return max(0.0, noise);
+}
+#endif
+
+float getDensity(vec3 point, out float skip)
+{
+    skip = 0.0;
+#if VOLUME_TYPE == 0
+    return 1.0;
+#elif VOLUME_TYPE == 1
+    return getAbsorption(point);
+#elif defined(SPARSE_GRID)
+    return sampleSparse(point, skip);
+#else
+    return texture(u_texture, (point - u_box_min) / (u_box_max - u_box_min)).r;
+#endif
+}
+
+void main()
+{
+    vec3 point = u_box_min + vec3(v_uv, u_slice) * (u_box_max - u_box_min);
+
+    vec3 lightDir = normalize(u_local_light_position - point);
+    float dt = u_step_length;
+
+    // Offset to avoid self-intersection
+    vec3 offsetPoint = point + lightDir * dt;
+
+    vec2 lightIntersection = intersectAABB(offsetPoint, lightDir, u_box_min, u_box_max);
+    float tLightEntry = lightIntersection.x;
+    float tLightExit = lightIntersection.y;
+    float lightTransmittance = 1.0;
+
+    if (tLightEntry < tLightExit) {
+        float tLight = tLightEntry + 0.5 * dt;
+        int Nlight = int((tLightExit - tLightEntry) / dt);
+        float accumulatedOpticalThickness = 0.0;
+
+        for (int j = 0; j < Nlight; ++j)
+        {
+            vec3 lightPoint = offsetPoint + tLight * lightDir;
+
+            float skip;
+            float lightDensity = getDensity(lightPoint, skip);
+
+#ifdef SPARSE_GRID
+            // Empty node of a sparse grid: jump to the first sample past it
+            if (skip > 0.0) {
+                int steps = max(int(ceil(sparseNodeExit(lightPoint, lightDir, skip) / dt)), 1);
+                j += steps - 1;
+                tLight += float(steps) * dt;
+                continue;
+            }
+#endif
+
+            accumulatedOpticalThickness += lightDensity * (u_absorption_coefficient + u_scattering_coefficient) * dt;
+            tLight += dt;
+        }
+
+        lightTransmittance = exp(- accumulatedOpticalThickness);
+    }
+
+    FragColor = vec4(lightTransmittance);
+}
@@ -1,97 +1,133 @@
 #version 330 core
 
-in vec3 v_world_position;
 out vec4 FragColor;
 
-uniform vec3  u_camera_position;
 uniform mat4  u_model;
+uniform mat4  u_inv_model;
 uniform vec3  u_box_min;
 uniform vec3  u_box_max;
 
 uniform sampler3D u_texture;
 
 uniform float u_step_length;
-uniform vec4  u_background_color;
 
-// Cut plane (xyz = normal, w = offset)
-uniform vec3 u_plane;
-uniform float u_cutoff;
-// Transfer function for normalized CT [0..1].
-vec3 transferFunction(float d)
-{
-    if (d < 0.25)
-        return vec3(0.0);
+// The depth is written after clipping, in main
+#define RAY_SETUP_NO_DEPTH
+#include "include/intersect.glsl"
+#include "include/ray_setup.glsl"
 
-    if (d < 0.6)
-        return mix(vec3(0.0), vec3(1.0, 0.25, 0.25), (d - 0.25) / 0.35);
+// Clipping in local space (see MedicalMaterial), applied to the ray interval and not per sample
+#define MAX_CLIP_PLANES 4
+uniform vec4 u_clip_planes[MAX_CLIP_PLANES]; // xyz = normal, w = offset, keeps dot(normal, p) >= offset
+uniform int u_num_clip_planes;
+uniform bool u_use_crop_box;
+uniform mat4 u_crop_matrix; // local space to the unit box of the oriented crop box
 
-    return vec3(1.0);
-}
+// Transfer function for normalized CT [0..1] (see TransferFunction)
+uniform sampler2D u_transfer_function; // 256x1: rgb + extinction
+uniform sampler2D u_preintegrated; // 256x256, (front, back) density: premultiplied rgb + opacity of one step
+uniform bool u_use_preintegration = false;
 
-vec2 intersectAABB(vec3 ro, vec3 rd, vec3 mn, vec3 mx)
-{
-    vec3 t1 = (mn - ro) / rd;
-    vec3 t2 = (mx - ro) / rd;
-    vec3 tmin = min(t1, t2);
-    vec3 tmax = max(t1, t2);
+const float LUT_SIZE = 256.0;
 
-    float tNear = max(max(tmin.x, tmin.y), tmin.z);
-    float tFar  = min(min(tmax.x, tmax.y), tmax.z);
+vec2 lutCoord(vec2 d)
+{
+    return (d * (LUT_SIZE - 1.0) + 0.5) / LUT_SIZE;
+}
 
-    return vec2(tNear, tFar);
+vec4 transferFunction(float d)
+{
+    return texture(u_transfer_function, vec2(lutCoord(vec2(d)).x, 0.5));
 }
 
-void main()
+// Trims [t0, t1] to the part of the ray that survives the clip planes and the crop box
+bool clipRay(vec3 ro, vec3 rd, inout float t0, inout float t1)
 {
-    vec3 roW = u_camera_position;
-    vec3 rdW = normalize(v_world_position - u_camera_position);
+    for (int i = 0; i < u_num_clip_planes; i++) {
+        vec3 n = u_clip_planes[i].xyz;
+        float d = u_clip_planes[i].w - dot(n, ro);
+        float denom = dot(n, rd);
+
+        // Parallel rays are either fully kept or fully clipped
+        if (abs(denom) < 1e-6) {
+            if (d > 0.0)
+                return false;
+            continue;
+        }
+
+        float t = d / denom;
+        if (denom > 0.0)
+            t0 = max(t0, t);
+        else
+            t1 = min(t1, t);
+    }
 
-    mat4 invModel = inverse(u_model);
-    vec3 ro = (invModel * vec4(roW, 1.0)).xyz;
-    vec3 rd = normalize((invModel * vec4(rdW, 0.0)).xyz);
+    // Same parameter t in crop space, the direction is just not unit length there
+    if (u_use_crop_box) {
+        vec3 cro = (u_crop_matrix * vec4(ro, 1.0)).xyz;
+        vec3 crd = (u_crop_matrix * vec4(rd, 0.0)).xyz;
+        vec2 crop = intersectAABB(cro, crd, vec3(-1.0), vec3(1.0));
+        t0 = max(t0, crop.x);
+        t1 = min(t1, crop.y);
+    }
 
-    vec2 hit = intersectAABB(ro, rd, u_box_min, u_box_max);
-    float t0 = hit.x;
-    float t1 = hit.y;
+    return t0 < t1;
+}
 
-    if (t1 < 0.0 || t0 > t1)
+void main()
+{
+    vec3 ro, rd;
+    float t0, t1;
+    if (!setupRay(ro, rd, t0, t1) || !clipRay(ro, rd, t0, t1))
         discard;
 
-    t0 = max(t0, 0.0);
+    // Depth of the first visible point, 0 when the camera is inside
+    vec4 clip = u_viewprojection * u_model * vec4(ro + rd * t0, 1.0);
+    gl_FragDepth = t0 > 0.0 ? clip.z / clip.w * 0.5 + 0.5 : 0.0;
 
     float dt = u_step_length;
 
     vec3 color = vec3(0.0);
     float alpha = 0.0;
+    float prev_d = -1.0; // start of the current pre-integrated segment
 
     for (float t = t0; t < t1; t += dt)
     {
         vec3 p = ro + rd * t;
 
-        // Apply cut plane BEFORE sampling
-        if (dot(u_plane, p) < u_cutoff)
-            continue;
-
         vec3 uvw = (p - u_box_min) / (u_box_max - u_box_min);
 
         if (any(lessThan(uvw, vec3(0.0))) ||
-            any(greaterThan(uvw, vec3(1.0))))
+            any(greaterThan(uvw, vec3(1.0)))) {
+            prev_d = -1.0;
             continue;
+        }
 
         float d = texture(u_texture, uvw).r;
 
-        vec3 c = transferFunction(d);
-        float a = d;
-
-        color += (1.0 - alpha) * a * c;
-        alpha += (1.0 - alpha) * a;
+        vec4 s;
+        if (u_use_preintegration) {
+            // Whole segment between the previous sample and this one
+            if (prev_d < 0.0) {
+                prev_d = d;
+                continue;
+            }
+            s = texture(u_preintegrated, lutCoord(vec2(prev_d, d)));
+            prev_d = d;
+        }
+        else {
+            vec4 tf = transferFunction(d);
+            float a = 1.0 - exp(-tf.a * dt);
+            s = vec4(tf.rgb * a, a);
+        }
+
+        color += (1.0 - alpha) * s.rgb;
+        alpha += (1.0 - alpha) * s.a;
 
         if (alpha > 0.99)
             break;
     }
 
-    vec3 bg = u_background_color.rgb;
-    vec3 final = mix(bg, color, alpha);
-
-    FragColor = vec4(final, 1.0);
+    // Premultiplied, composited over the opaque scene
+    FragColor = vec4(color, alpha);
 }
@@ -0,0 +1,175 @@
+#version 330 core
+
+// All the batched volume nodes in one full screen pass (see MultiVolume).
+// Each pixel intersects the boxes in world space, sorts the intervals by entry and marches them front to back
+// in a single loop: overlapping volumes add their extinction and emission at the same sample, the gaps between
+// intervals are skipped and the march stops for all of them once the transmittance is negligible.
+
+#define MAX_VOLUMES 4
+
+out vec4 FragColor;
+
+uniform int u_num_volumes;
+uniform mat4 u_inv_models[MAX_VOLUMES];
+uniform vec3 u_box_min[MAX_VOLUMES];
+uniform vec3 u_box_max[MAX_VOLUMES];
+uniform vec3 u_emission[MAX_VOLUMES]; // black for absorption only volumes
+uniform float u_absorption[MAX_VOLUMES];
+uniform int u_density_source[MAX_VOLUMES]; // 0: homogeneous, 1: baked noise, 2: dense texture
+uniform sampler3D u_textures[MAX_VOLUMES];
+
+uniform float u_step_lengths[MAX_VOLUMES];
+uniform float u_max_step_scales[MAX_VOLUMES]; // adaptive stepping of each volume, see VolumeMaterial::quality
+uniform float u_min_transmittance; // the same for every batched volume
+
+#include "include/frame.glsl"
+#include "include/stepping.glsl"
+
+uniform vec2 u_viewport_size;
+uniform sampler2D u_scene_depth; // opaque scene, rays stop at its surface
+
+#include "include/intersect.glsl"
+
+// Sampler arrays can only be indexed with constant expressions in GLSL 3.30
+float sampleTexture(int i, vec3 coord)
+{
+    if (i == 0) return texture(u_textures[0], coord).r;
+    if (i == 1) return texture(u_textures[1], coord).r;
+    if (i == 2) return texture(u_textures[2], coord).r;
+    return texture(u_textures[3], coord).r;
+}
+
+// Same densities as the single volume shaders, point in the local space of volume i
+float getExtinction(int i, vec3 point)
+{
+    float density = 1.0;
+    vec3 coord = (point - u_box_min[i]) / (u_box_max[i] - u_box_min[i]);
+    if (u_density_source[i] == 1)
+        density = max(0.0, sampleTexture(i, coord));
+    else if (u_density_source[i] == 2)
+        density = sampleTexture(i, coord);
+    return density * u_absorption[i];
+}
+
+void main()
+{
+    vec2 uv = gl_FragCoord.xy / u_viewport_size;
+
+    // World space ray of this pixel
+    vec4 farPoint = u_inv_viewprojection * vec4(uv * 2.0 - 1.0, 1.0, 1.0);
+    vec3 rayOrigin = u_camera_position;
+    vec3 rayDir = normalize(farPoint.xyz / farPoint.w - rayOrigin);
+
+    // Opaque surface behind the pixel
+    float tOpaque = 1e30;
+    float sceneDepth = texture(u_scene_depth, uv).r;
+    if (sceneDepth < 1.0) {
+        vec4 world = u_inv_viewprojection * vec4(vec3(uv, sceneDepth) * 2.0 - 1.0, 1.0);
+        tOpaque = dot(world.xyz / world.w - rayOrigin, rayDir);
+    }
+
+    // Interval list, sorted by entry. The local direction is not normalized so t stays in world units
+    float entries[MAX_VOLUMES];
+    float exits[MAX_VOLUMES];
+    int ids[MAX_VOLUMES];
+    int count = 0;
+
+    for (int i = 0; i < u_num_volumes; i++) {
+        vec3 originLoc = (u_inv_models[i] * vec4(rayOrigin, 1.0)).xyz;
+        vec3 dirLoc = (u_inv_models[i] * vec4(rayDir, 0.0)).xyz;
+        vec2 interval = intersectAABB(originLoc, dirLoc, u_box_min[i], u_box_max[i]);
+        interval.x = max(interval.x, 0.0);
+        interval.y = min(interval.y, tOpaque);
+        if (interval.x >= interval.y)
+            continue;
+
+        int k = count++;
+        while (k > 0 && entries[k - 1] > interval.x) {
+            entries[k] = entries[k - 1];
+            exits[k] = exits[k - 1];
+            ids[k] = ids[k - 1];
+            k--;
+        }
+        entries[k] = interval.x;
+        exits[k] = interval.y;
+        ids[k] = i;
+    }
+
+    if (count == 0)
+        discard;
+
+    float tEnd = 0.0;
+    for (int k = 0; k < count; k++)
+        tEnd = max(tEnd, exits[k]);
+
+    // Each volume keeps its own step and adaptive stepping, the shortest step of the volumes at the sample wins
+    float minStep = 1e30;
+    float prevExtinction[MAX_VOLUMES];
+    for (int i = 0; i < MAX_VOLUMES; i++)
+        prevExtinction[i] = 0.0;
+    for (int k = 0; k < count; k++)
+        minStep = min(minStep, u_step_lengths[ids[k]]);
+
+    float offset = rayOffset();
+    float dt = minStep;
+    float t = entries[0] + offset * dt;
+    float thickness = 0.0;
+    vec3 L = vec3(0.0);
+
+    while (t < tEnd)
+    {
+        vec3 point = rayOrigin + rayDir * t;
+
+        float extinction = 0.0;
+        vec3 emission = vec3(0.0);
+        float nextEntry = tEnd;
+        float nextStep = 1e30;
+        float border = tEnd; // next entry or exit of an interval
+        bool inside = false;
+
+        for (int k = 0; k < count; k++) {
+            if (t < entries[k]) {
+                nextEntry = min(nextEntry, entries[k]);
+                border = min(border, entries[k]);
+                continue;
+            }
+            if (t >= exits[k])
+                continue;
+
+            int i = ids[k];
+            float sigma = getExtinction(i, (u_inv_models[i] * vec4(point, 1.0)).xyz);
+            extinction += sigma;
+            emission += sigma * u_emission[i];
+            inside = true;
+            border = min(border, exits[k]);
+
+            nextStep = min(nextStep, adaptiveStep(sigma, prevExtinction[i], dt, u_step_lengths[i], u_max_step_scales[i]));
+            prevExtinction[i] = sigma;
+        }
+
+        // Gap between intervals, continue at the next entry with the same offset
+        if (!inside) {
+            dt = minStep;
+            t = nextEntry + offset * dt;
+            continue;
+        }
+
+        // Without stepping over the entry or exit of a volume
+        dt = max(min(nextStep, border - t), 1e-4);
+
+        thickness += extinction * dt;
+        L += emission * exp(- thickness) * dt;
+        t += dt;
+
+        // Early ray termination, shared by all the volumes
+        if (exp(- thickness) < u_min_transmittance)
+            break;
+    }
+
+    // Depth of the nearest entry, for the upsample pass
+    vec4 clip = u_viewprojection * vec4(rayOrigin + rayDir * entries[0], 1.0);
+    gl_FragDepth = entries[0] > 0.0 ? clip.z / clip.w * 0.5 + 0.5 : 0.0;
+
+    // Premultiplied, composited over the opaque scene
+    FragColor = vec4(L, 1.0 - exp(- thickness));
+}
@@ -0,0 +1,12 @@
+#version 330 core
+
+// Local position of the proxy surface, see RaySetup
+
+in vec3 v_position;
+
+out vec4 FragColor;
+
+void main()
+{
+    FragColor = vec4(v_position, 1.0);
+}
@@ -0,0 +1,55 @@
+#version 330 core
+
+// Composites the low resolution volume target of DynamicResolution over the opaque scene.
+// The 2x2 low resolution texels around the pixel are filtered bilinearly, except the ones behind the
+// opaque surface of this pixel (full resolution depth), so the volume does not bleed over closer geometry.
+// Writes depth too, the wireframes and the grid are drawn after it.
+
+in vec2 v_uv;
+
+out vec4 FragColor;
+
+uniform sampler2D u_texture; // volumes: premultiplied color, opacity in alpha
+uniform sampler2D u_volume_depth;
+uniform sampler2D u_scene_color;
+uniform sampler2D u_scene_depth;
+uniform vec2 u_viewport; // texels of the volume target in use
+
+void main()
+{
+    vec4 scene = texture(u_scene_color, v_uv);
+    float sceneDepth = texture(u_scene_depth, v_uv).r;
+
+    vec2 coord = v_uv * u_viewport - 0.5;
+    ivec2 base = ivec2(floor(coord));
+    vec2 f = coord - vec2(base);
+    ivec2 maxTexel = ivec2(u_viewport) - 1;
+
+    vec4 volume = vec4(0.0);
+    float volumeDepth = 1.0;
+    float weightSum = 0.0;
+
+    for (int j = 0; j < 2; ++j)
+    for (int i = 0; i < 2; ++i)
+    {
+        ivec2 texel = clamp(base + ivec2(i, j), ivec2(0), maxTexel);
+        float w = (i == 0 ? 1.0 - f.x : f.x) * (j == 0 ? 1.0 - f.y : f.y);
+
+        // Volume behind the opaque surface of this pixel. Empty texels (far depth) still count so silhouettes stay smooth
+        float depth = texelFetch(u_volume_depth, texel, 0).r;
+        bool covered = depth < 1.0;
+        if (covered && depth > sceneDepth)
+            continue;
+
+        volume += texelFetch(u_texture, texel, 0) * w;
+        if (covered)
+            volumeDepth = min(volumeDepth, depth);
+        weightSum += w;
+    }
+
+    if (weightSum > 0.0)
+        volume /= weightSum;
+
+    FragColor = vec4(volume.rgb + scene.rgb * (1.0 - volume.a), 1.0);
+    gl_FragDepth = volume.a > 0.5 ? volumeDepth : sceneDepth;
+}
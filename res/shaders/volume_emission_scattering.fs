@@ -1,152 +1,298 @@
 #version 330 core
 
-in vec3 v_world_position;
+// Variant defines, set by VolumeMaterial::getShaderMacros():
+//  VOLUME_TYPE: 0 homogeneous, 1 heterogeneous (noise), 2 VDB
+//  BAKED_NOISE: noise fetched from u_noise_texture instead of evaluating snoise
+//  SPARSE_GRID: VDB traversed through the sparse tables instead of u_texture
+//  LIGHT_VOLUME: transmittance toward the light fetched from u_light_transmittance
+//  DELTA_TRACKING: one stochastic path per frame instead of the fixed step march
+//  MAJORANT_GRID: per cell density bound for DELTA_TRACKING, from u_majorant
+#ifndef VOLUME_TYPE
+#define VOLUME_TYPE 0
+#endif
+
 in vec3 v_normal;
 in vec4 v_color;
 in vec2 v_uv;
 
 out vec4 FragColor;
 
-uniform int u_volume_type = 0; // 0: homogeneous, 1: heterogeneous
-uniform vec3 u_camera_position;
-uniform vec4 u_color;
-uniform float u_absorption_coefficient;
-uniform float u_scattering_coefficient;
+#include "include/frame.glsl"
+#include "include/volume_material.glsl"
+
 uniform mat4 u_model;
-uniform vec4 u_background_color;
+uniform mat4 u_inv_model; // uploaded once per draw
 uniform int u_num_steps;
-uniform float u_step_length;
-uniform float noise_scale;
-uniform vec3 u_box_min;
-uniform vec3 u_box_max;
+uniform sampler3D u_noise_texture; // snoise baked over the box by NoiseVolume
 
-uniform vec3 u_local_light_position;
-uniform vec4 u_light_color;
-uniform float u_light_intensity;
+#include "include/lights.glsl"
 
 uniform sampler3D u_texture;
 
-uniform float g_value;
+uniform sampler3D u_light_transmittance; // see LightVolume
+
+#include "include/intersect.glsl"
+#include "include/ray_setup.glsl"
+#include "include/raymarch.glsl"
+#include "include/sparse.glsl"
 
-vec2 intersectAABB(vec3 rayOrigin, vec3 rayDir, vec3 boxMin, vec3 boxMax)
+#if VOLUME_TYPE == 1 && !defined(BAKED_NOISE)
+#include "include/snoise.glsl"
+#endif
+
+#if VOLUME_TYPE == 1
+float getAbsorption(vec3 point)
 {
-    vec3 tMin = (boxMin - rayOrigin) / rayDir;
-    vec3 tMax = (boxMax - rayOrigin) / rayDir;
-    vec3 t1 = min(tMin, tMax);
-    vec3 t2 = max(tMin, tMax);
-    float tNear = max(max(t1.x, t1.y), t1.z);
-    float tFar = min(min(t2.x, t2.y), t2.z);
-    return vec2(tNear, tFar);
+#ifdef BAKED_NOISE
+    float noise = texture(u_noise_texture, (point - u_box_min) / (u_box_max - u_box_min)).r;
+#else
+    float noise = snoise(point * noise_scale);
+#endif
+    return max(0.0, noise);
 }
+#endif
 
-//	Simplex 3D Noise 
-//	by Ian McEwan, Stefan Gustavson (https://github.com/stegu/webgl-noise)
-//
-vec4 permute(vec4 x){return mod(((x*34.0)+1.0)*x, 289.0);}
-vec4 taylorInvSqrt(vec4 r){return 1.79284291400159 - 0.85373472095314 * r;}
-
-float snoise(vec3 v){ 
-  const vec2  C = vec2(1.0/6.0, 1.0/3.0) ;
-  const vec4  D = vec4(0.0, 0.5, 1.0, 2.0);
-
-// First corner
-  vec3 i  = floor(v + dot(v, C.yyy) );
-  vec3 x0 =   v - i + dot(i, C.xxx) ;
-
-// Other corners
-  vec3 g = step(x0.yzx, x0.xyz);
-  vec3 l = 1.0 - g;
-  vec3 i1 = min( g.xyz, l.zxy );
-  vec3 i2 = max( g.xyz, l.zxy );
-
-  //  x0 = x0 - 0. + 0.0 * C 
-  vec3 x1 = x0 - i1 + 1.0 * C.xxx;
-  vec3 x2 = x0 - i2 + 2.0 * C.xxx;
-  vec3 x3 = x0 - 1. + 3.0 * C.xxx;
-
-// Permutations
-  i = mod(i, 289.0 ); 
-  vec4 p = permute( permute( permute( 
-             i.z + vec4(0.0, i1.z, i2.z, 1.0 ))
-           + i.y + vec4(0.0, i1.y, i2.y, 1.0 )) 
-           + i.x + vec4(0.0, i1.x, i2.x, 1.0 ));
-
-// Gradients
-// ( N*N points uniformly over a square, mapped onto an octahedron.)
-  float n_ = 1.0/7.0; // N=7
-  vec3  ns = n_ * D.wyz - D.xzx;
-
-  vec4 j = p - 49.0 * floor(p * ns.z *ns.z);  //  mod(p,N*N)
-
-  vec4 x_ = floor(j * ns.z);
-  vec4 y_ = floor(j - 7.0 * x_ );    // mod(j,N)
-
-  vec4 x = x_ *ns.x + ns.yyyy;
-  vec4 y = y_ *ns.x + ns.yyyy;
-  vec4 h = 1.0 - abs(x) - abs(y);
-
-  vec4 b0 = vec4( x.xy, y.xy );
-  vec4 b1 = vec4( x.zw, y.zw );
-
-  vec4 s0 = floor(b0)*2.0 + 1.0;
-  vec4 s1 = floor(b1)*2.0 + 1.0;
-  vec4 sh = -step(h, vec4(0.0));
-
-  vec4 a0 = b0.xzyw + s0.xzyw*sh.xxyy ;
-  vec4 a1 = b1.xzyw + s1.xzyw*sh.zzww ;
-
-  vec3 p0 = vec3(a0.xy,h.x);
-  vec3 p1 = vec3(a0.zw,h.y);
-  vec3 p2 = vec3(a1.xy,h.z);
-  vec3 p3 = vec3(a1.zw,h.w);
-
-//Normalise gradients
-  vec4 norm = taylorInvSqrt(vec4(dot(p0,p0), dot(p1,p1), dot(p2, p2), dot(p3,p3)));
-  p0 *= norm.x;
-  p1 *= norm.y;
-  p2 *= norm.z;
-  p3 *= norm.w;
-
-// Mix final noise value
-  vec4 m = max(0.6 - vec4(dot(x0,x0), dot(x1,x1), dot(x2,x2), dot(x3,x3)), 0.0);
-  m = m * m;
-  return 42.0 * dot( m*m, vec4( dot(p0,x0), dot(p1,x1), 
-                                dot(p2,x2), dot(p3,x3) ) );
+// Density at a local point, skip > 0 inside an empty sparse node (its size)
+float getDensity(vec3 point, out float skip)
+{
+    skip = 0.0;
+#if VOLUME_TYPE == 0
+    return 1.0;
+#elif VOLUME_TYPE == 1
+    return getAbsorption(point);
+#elif defined(SPARSE_GRID)
+    return sampleSparse(point, skip);
+#else
+    return texture(u_texture, (point - u_box_min) / (u_box_max - u_box_min)).r;
+#endif
 }
 
+// Transmittance from point to the box exit toward the light
+float lightTransmittance(vec3 point, vec3 lightDir, inout int lightSamples)
+{
+    float lightDt = u_step_length; // dt adapts along the view ray only
+
+    // Offset to avoid self-intersection
+    vec3 offsetPoint = point + lightDir * lightDt;
+
+    vec2 lightIntersection = intersectAABB(offsetPoint, lightDir, u_box_min, u_box_max);
+    float tLightEntry = lightIntersection.x;
+    float tLightExit = lightIntersection.y;
+    if (tLightEntry >= tLightExit)
+        return 1.0;
+
+    float tLight = tLightEntry + 0.5 * lightDt;
+    int Nlight = int((tLightExit - tLightEntry) / lightDt);
+    float accumulatedOpticalThickness = 0.0;
+
+    for (int j = 0; j < Nlight; ++j)
+    {
+        vec3 lightPoint = offsetPoint + tLight * lightDir;
+        float skip;
+        float lightDensity = getDensity(lightPoint, skip);
+
+#ifdef SPARSE_GRID
+        // Empty node: jump to the first sample past it, keeping the same spacing
+        if (skip > 0.0) {
+            int steps = max(int(ceil(sparseNodeExit(lightPoint, lightDir, skip) / lightDt)), 1);
+            j += steps - 1;
+            tLight += float(steps) * lightDt;
+            continue;
+        }
+#endif
+        float lightExtinctionCoefficient = lightDensity * (u_absorption_coefficient + u_scattering_coefficient);
+        accumulatedOpticalThickness += lightExtinctionCoefficient * lightDt;
+        tLight += lightDt;
+        lightSamples++;
+
+        if (exp(- accumulatedOpticalThickness) < u_min_transmittance)
+            break;
+    }
 
-float getAbsorption(vec3 point)
+    return exp(- accumulatedOpticalThickness);
+}
+
+#ifdef DELTA_TRACKING
+// Unbiased integration: delta tracking for the view ray, ratio tracking toward the lights.
+// Tentative collisions are drawn with a bound of the extinction (majorant) and accepted with
+// probability extinction / majorant, so the density is only looked up at the collisions.
+uniform int u_frame_index; // seeds a different sequence every accumulated frame
+
+#ifdef MAJORANT_GRID
+uniform sampler3D u_majorant; // max density per cell, see MajorantGrid
+uniform ivec3 u_majorant_dims;
+uniform vec3 u_majorant_cell_size; // over the box, the grid can overhang it when the dims are not a multiple of the cell
+#endif
+
+#define MAX_COLLISIONS 512
+
+uint rngState = 0u; // seeded in main
+
+// PCG hash, uniform in [0, 1)
+float random()
 {
-    float noise = snoise(point * noise_scale);
-    return max(0.0, noise);
+    rngState = rngState * 747796405u + 2891336453u;
+    uint word = ((rngState >> ((rngState >> 28u) + 4u)) ^ rngState) * 277803737u;
+    return float((word >> 22u) ^ word) / 4294967296.0;
 }
 
-void main()
+// Majorant of the cell around point, tCell returns the distance to leave it along dir
+float majorantCell(vec3 point, vec3 dir, out float tCell)
+{
+    float extinction = u_absorption_coefficient + u_scattering_coefficient;
+#ifdef MAJORANT_GRID
+    vec3 cellSize = (u_box_max - u_box_min) * u_majorant_cell_size;
+    ivec3 cell = clamp(ivec3(floor((point - u_box_min) / cellSize)), ivec3(0), u_majorant_dims - 1);
+    vec3 cellMin = u_box_min + vec3(cell) * cellSize;
+    tCell = max(intersectAABB(point, dir, cellMin, cellMin + cellSize).y, 0.0) + 1e-4;
+    return texelFetch(u_majorant, cell, 0).r * extinction;
+#else
+    // Constant density, or max(0, snoise) which stays below 1
+    tCell = 1e30;
+    return extinction;
+#endif
+}
+
+// Advances t to the next tentative collision, false once it goes past tMax
+bool nextCollision(vec3 rayOrigin, vec3 rayDir, inout float t, float tMax, out float majorant)
 {
-    // Initialize ray in world space
-    vec3 rayOrigin = u_camera_position;
-    vec3 rayDir = normalize(v_world_position - u_camera_position);
+    for (int i = 0; i < MAX_COLLISIONS; i++) {
+        float tCell;
+        majorant = majorantCell(rayOrigin + t * rayDir, rayDir, tCell);
+        float step = majorant > 0.0 ? -log(1.0 - random()) / majorant : 1e30;
+        if (step < tCell) {
+            t += step;
+            return t < tMax;
+        }
 
-    // Transform ray into local space
-    mat4 invModel = inverse(u_model);
-    vec3 rayOriginLoc = (invModel * vec4(rayOrigin, 1.0)).xyz;
-    vec3 rayDirLoc = normalize((invModel * vec4(rayDir, 0.0)).xyz);
+        // Free paths are memoryless, start again at the border with the bound of the next cell
+        t += tCell;
+        if (t >= tMax)
+            return false;
+    }
+    return false;
+}
 
-    vec3 lightPositionLoc = u_local_light_position;
+// First real collision along the view ray
+bool deltaTracking(vec3 rayOrigin, vec3 rayDir, float tEntry, float tExit, out float tHit, inout int samples)
+{
+    float t = tEntry;
+    float majorant;
+    tHit = tExit;
+
+    for (int i = 0; i < MAX_COLLISIONS && nextCollision(rayOrigin, rayDir, t, tExit, majorant); i++) {
+        float skip;
+        float extinction = getDensity(rayOrigin + t * rayDir, skip) * (u_absorption_coefficient + u_scattering_coefficient);
+        samples++;
+
+        if (random() * majorant < extinction) {
+            tHit = t;
+            return true;
+        }
+    }
+    return false;
+}
 
-    if (u_volume_type == 0) {
-        // Compute intersection with box in local space
-        vec2 intersection = intersectAABB(rayOriginLoc, rayDirLoc, u_box_min, u_box_max);
-        float tEntry = intersection.x;
-        float tExit = intersection.y;
+// Transmittance from point to the box exit toward the light
+float ratioTracking(vec3 point, vec3 lightDir, inout int lightSamples)
+{
+    float tMax = intersectAABB(point, lightDir, u_box_min, u_box_max).y;
+    float t = 0.0;
+    float transmittance = 1.0;
+    float majorant;
+
+    for (int i = 0; i < MAX_COLLISIONS && nextCollision(point, lightDir, t, tMax, majorant); i++) {
+        float skip;
+        float extinction = getDensity(point + t * lightDir, skip) * (u_absorption_coefficient + u_scattering_coefficient);
+        // Never negative, even if a lookup goes above the bound of its cell
+        transmittance *= max(1.0 - extinction / majorant, 0.0);
+        lightSamples++;
+
+        // Russian roulette instead of a hard cut, so the estimate stays unbiased
+        if (transmittance < u_min_transmittance) {
+            if (random() < 0.5)
+                return 0.0;
+            transmittance *= 2.0;
+        }
+    }
+    return transmittance;
+}
+#endif
 
-        if (tExit < 0.0 || tEntry > tExit)
-            discard;
+// In-scattered light at a local point from every light that reaches the node, phase function included
+vec3 inScattering(vec3 point, vec3 rayDirLoc, inout int lightSamples)
+{
+    vec3 worldPoint = (u_model * vec4(point, 1.0)).xyz;
+    float g_2 = g_value * g_value;
+
+    vec3 Ls = vec3(0.0);
+    for (int i = 0; i < u_num_lights; i++)
+    {
+        int index = u_light_indices[i];
+        sLight light = u_lights[index];
+
+        float falloff = lightFalloff(light.position, worldPoint);
+        if (falloff <= 0.0)
+            continue;
+
+        vec3 lightPositionLoc = (u_inv_model * vec4(light.position.xyz, 1.0)).xyz;
+        vec3 lightDir = normalize(lightPositionLoc - point);
+
+        // The light volume pass precomputes the first light only, one fetch instead of a secondary march
+        float transmittance;
+#ifdef LIGHT_VOLUME
+        if (index == 0)
+            transmittance = texture(u_light_transmittance, (point - u_box_min) / (u_box_max - u_box_min)).r;
+        else
+#endif
+#ifdef DELTA_TRACKING
+        transmittance = ratioTracking(point, lightDir, lightSamples);
+#else
+        transmittance = lightTransmittance(point, lightDir, lightSamples);
+#endif
+
+        vec3 Li = light.color.rgb * falloff * transmittance;
+
+        float cosTheta = dot(lightDir, -rayDirLoc); // Angle between light direction and view direction
+        float phaseFunction = 1.0 / (4.0 * 3.14159265) * (1.0 - g_2) / pow(1.0 + g_2 - 2.0 * g_value * cosTheta, 1.5); // Henyey-Greenstein phase function
+
+        Ls += Li * phaseFunction;
+    }
+
+    return Ls;
+}
 
+void main()
+{
+    // Samples taken by this ray, written out by the RAY_STATS variant
+    int samples = 0;
+    int lightSamples = 0;
+
+    // Local space ray, from the rasterized entry and exit points
+    vec3 rayOriginLoc, rayDirLoc;
+    float tEntry, tExit;
+    if (!setupRay(rayOriginLoc, rayDirLoc, tEntry, tExit))
+        discard;
+
+#ifdef DELTA_TRACKING
+    // One path per pixel and frame, the accumulation buffer averages them
+    rngState = uint(gl_FragCoord.x) * 1973u + uint(gl_FragCoord.y) * 9277u + uint(u_frame_index) * 26699u;
+    random();
+
+    // Collisions are distributed as transmittance * extinction, so the source term over the
+    // extinction is an estimate of the whole integral. Missing the medium counts as background
+    float tHit;
+    FragColor = vec4(0.0);
+    if (deltaTracking(rayOriginLoc, rayDirLoc, tEntry, tExit, tHit, samples)) {
+        vec3 point = rayOriginLoc + tHit * rayDirLoc;
+        float albedo = u_scattering_coefficient / max(u_absorption_coefficient + u_scattering_coefficient, 1e-6);
+        FragColor = vec4(u_color.rgb + albedo * inScattering(point, rayDirLoc, lightSamples), 1.0);
+    }
+#elif VOLUME_TYPE == 0
         float dt = u_step_length;
         int N = int((tExit - tEntry) / dt);
 
-        float t = tEntry + 0.5 * dt;
+        float t = tEntry + rayOffset() * dt;
 
         float thickness = 0.0;
         vec3 L = vec3(0.0);
@@ -162,79 +308,37 @@ void main()
             thickness += extinction_coefficient * dt;
             float transmittance = exp(- thickness);
 
-            vec3 lightDir = normalize(lightPositionLoc - point);
-            vec3 offsetPoint = point + lightDir * dt;
-
-            vec2 lightIntersection = intersectAABB(offsetPoint, lightDir, u_box_min, u_box_max);
-            float tLightEntry = lightIntersection.x;
-            float tLightExit = lightIntersection.y;
-            float lightTransmittance = 1.0;
-
-            if (tLightEntry < tLightExit) {
-                float tLight = tLightEntry + 0.5 * dt;
-                int Nlight = int((tLightExit - tLightEntry) / dt);
-                float accumulatedOpticalThickness = 0.0;
-
-                for (int j = 0; j < Nlight; ++j)
-                {
-                    vec3 lightPoint = offsetPoint + tLight * lightDir;
-
-                    float lightAbsorptionCoefficient = u_absorption_coefficient;
-                    float lightScatteringCoefficient = u_scattering_coefficient;
-                    float lightExtinctionCoefficient = lightAbsorptionCoefficient + lightScatteringCoefficient;
-
-                    accumulatedOpticalThickness += lightExtinctionCoefficient * dt;
-                    tLight += dt;
-                }
-
-                lightTransmittance = exp(- accumulatedOpticalThickness);
-            }
-
-            vec3 Li = u_light_color.rgb * u_light_intensity * lightTransmittance;
-
-            float g_2 = g_value * g_value;
-            float cosTheta = dot(lightDir, -rayDirLoc);
-            float phaseFunction =
-                1.0 / (4.0 * 3.14159265) *
-                (1.0 - g_2) /
-                pow(1.0 + g_2 - 2.0 * g_value * cosTheta, 1.5);
-
-            vec3 Ls = Li * phaseFunction;
+            // Scattering toward the lights
+            vec3 Ls = inScattering(point, rayDirLoc, lightSamples);
             vec3 Le = u_color.rgb;
 
             L += transmittance * (extinction_coefficient * Le + scattering_coefficient * Ls) * dt;
 
             t += dt;
+            samples++;
+
+            // Early ray termination, nothing behind this point is visible anymore
+            if (exp(- thickness) < u_min_transmittance)
+                break;
         }
 
         float transmittance_background = exp(- thickness);
-        vec3 background = u_background_color.rgb;
-
-        vec3 finalColor = L + background * transmittance_background;
-
-        FragColor = vec4(finalColor, u_color.a);
-    }
-      else if (u_volume_type == 1) {
-        // Compute intersection with box in local space
-        vec2 intersection = intersectAABB(rayOriginLoc, rayDirLoc, u_box_min, u_box_max);
-        float tEntry = intersection.x;
-        float tExit = intersection.y;
-
-        // If no intersection, discard fragment
-        if (tExit < 0.0 || tEntry > tExit)
-            discard;
+        vec3 finalColor = L;
 
+        FragColor = vec4(finalColor, 1.0 - transmittance_background);
+#elif VOLUME_TYPE == 1
         // Sampling parameters
         float dt = u_step_length;
-        int N = int((tExit - tEntry) / dt);
 
-        float t = tEntry + 0.5 * dt;
+        float t = tEntry + rayOffset() * dt;
 
         // Optical thickness
         float thickness = 0.0;
         vec3 L = vec3(0.0); 
 
-        for (int i = 0; i < N; ++i)
+        float prevExtinction = 0.0;
+
+        while (t < tExit)
         {
             vec3 point = rayOriginLoc + t * rayDirLoc; 
             float density = getAbsorption(point);
@@ -243,165 +347,110 @@ void main()
 
             float extinction_coefficient = absorption_coefficient + scattering_coefficient;
 
+            // Longer steps where the extinction is flat
+            dt = min(nextStep(extinction_coefficient, prevExtinction, dt), tExit - t);
+            prevExtinction = extinction_coefficient;
+
             thickness += extinction_coefficient * dt;
             float transmittance = exp(- thickness);
 
-            // Scattering toward light
-            vec3 lightDir = normalize(lightPositionLoc - point);
-
-            vec3 offsetPoint = point + lightDir * dt;
-
-            // Compute intersection
-            vec2 lightIntersection = intersectAABB(offsetPoint, lightDir, u_box_min, u_box_max);
-            float tLightEntry = lightIntersection.x;
-            float tLightExit = lightIntersection.y;
-            float lightTransmittance = 1.0;
-
-            if (tLightEntry < tLightExit) {
-                float tLight = tLightEntry + 0.5 * dt;
-                int Nlight = int((tLightExit - tLightEntry) / dt);
-                float accumulatedOpticalThickness = 0.0;
-
-                for (int j = 0; j < Nlight; ++j)
-                {
-                    vec3 lightPoint = offsetPoint + tLight * lightDir; 
-                    float lightDensity = getAbsorption(lightPoint);
-                    float lightAbsorptionCoefficient = lightDensity * u_absorption_coefficient;
-                    float lightScatteringCoefficient = lightDensity * u_scattering_coefficient;
-
-                    float lightExtinctionCoefficient = lightAbsorptionCoefficient + lightScatteringCoefficient;
-                    accumulatedOpticalThickness += lightExtinctionCoefficient * dt;
-                    tLight += dt;
-                }
-
-                 lightTransmittance = exp(- accumulatedOpticalThickness);
-
-            }
-            else {
-                lightTransmittance = 1.0;
-            }
-
-            vec3 Li = u_light_color.rgb * u_light_intensity * lightTransmittance;
-
-            float g_2 = g_value * g_value;
-            float cosTheta = dot(lightDir, -rayDirLoc); // Angle between light direction and view direction
-            float phaseFunction = 1/(4.0 * 3.14159265) * (1.0 - g_2) / pow(1.0 + g_2 - 2.0 * g_value * cosTheta, 1.5); // Henyey-Greenstein phase function
-
-            vec3 Ls = Li * phaseFunction;
+            // Scattering toward the lights
+            vec3 Ls = inScattering(point, rayDirLoc, lightSamples);
 
             vec3 Le = u_color.rgb;
 
             L += transmittance * (extinction_coefficient * Le + scattering_coefficient * Ls) * dt;
 
             t += dt;
+            samples++;
+
+            // Early ray termination, nothing behind this point is visible anymore
+            if (exp(- thickness) < u_min_transmittance)
+                break;
         }     
 
         // Final color
         float transmittance_background = exp(- thickness);
-        vec3 background = u_background_color.rgb;
+        vec3 finalColor = L;
 
-        vec3 finalColor = L + background * transmittance_background;
-
-        FragColor = vec4(finalColor, u_color.a);
-    } else if (u_volume_type == 2) {
+        FragColor = vec4(finalColor, 1.0 - transmittance_background);
+#elif VOLUME_TYPE == 2
         // VDB-based volume rendering
-        // Compute intersection with box in local space
-        vec2 intersection = intersectAABB(rayOriginLoc, rayDirLoc, u_box_min, u_box_max);
-        float tEntry = intersection.x;
-        float tExit = intersection.y;
-
-        // If no intersection, discard fragment
-        if (tExit < 0.0 || tEntry > tExit)
-            discard;
-
         // Sampling parameters
         float dt = u_step_length;
-        int N = int((tExit - tEntry) / dt);
 
-        float t = tEntry + 0.5 * dt;
+        float t = tEntry + rayOffset() * dt;
 
         // Optical thickness
         float thickness = 0.0;
         vec3 L = vec3(0.0); 
 
-        for (int i = 0; i < N; ++i) {
+        float prevExtinction = 0.0;
+
+        while (t < tExit) {
           vec3 point = rayOriginLoc + t * rayDirLoc;
           
-          vec3 texturePoint = (point + 1.0) / 2.0;
+          float density;
+#ifdef SPARSE_GRID
+          float skip;
+          density = sampleSparse(point, skip);
+
+          // Empty node: jump to the first sample past it, keeping the same spacing
+          if (skip > 0.0) {
+              t += max(ceil(sparseNodeExit(point, rayDirLoc, skip) / dt), 1.0) * dt;
+              prevExtinction = 0.0;
+              continue;
+          }
+#else
+          // Same box mapping as getDensity, so both estimators and the majorant cells agree
+          vec3 texturePoint = (point - u_box_min) / (u_box_max - u_box_min);
 
           // Density from 3D texture
-          float density = texture(u_texture, texturePoint).r;
+          density = texture(u_texture, texturePoint).r;
+#endif
           float absorption_coefficient = density * u_absorption_coefficient;
           float scattering_coefficient = density * u_scattering_coefficient;
 
           float extinction_coefficient = absorption_coefficient + scattering_coefficient;
 
+          // Longer steps where the extinction is flat
+          dt = min(nextStep(extinction_coefficient, prevExtinction, dt), tExit - t);
+          prevExtinction = extinction_coefficient;
+
           thickness += extinction_coefficient * dt;
           float transmittance = exp(- thickness);
 
-          // Scattering toward light
-          vec3 lightDir = normalize(lightPositionLoc - point);
-
-          // Offset to avoid self-intersection
-          vec3 offsetPoint = point + lightDir * dt;
-
-          // Compute intersection
-          vec2 lightIntersection = intersectAABB(offsetPoint, lightDir, u_box_min, u_box_max);
-          float tLightEntry = lightIntersection.x;
-          float tLightExit = lightIntersection.y;
-          float lightTransmittance = 1.0;
-
-          if (tLightEntry < tLightExit) {
-              float tLight = tLightEntry + 0.5 * dt;
-              int Nlight = int((tLightExit - tLightEntry) / dt);
-              float accumulatedOpticalThickness = 0.0;
-
-              for (int j = 0; j < Nlight; ++j)
-              {
-                  vec3 lightPoint = offsetPoint + tLight * lightDir; 
-                  vec3 lightTexturePoint = (lightPoint - u_box_min) / (u_box_max - u_box_min);
-                  float lightDensity = texture(u_texture, lightTexturePoint).r;
-                  float lightAbsorptionCoefficient = lightDensity * u_absorption_coefficient;
-                  float lightScatteringCoefficient = lightDensity * u_scattering_coefficient;
-
-                  float lightExtinctionCoefficient = lightAbsorptionCoefficient + lightScatteringCoefficient;
-                  accumulatedOpticalThickness += lightExtinctionCoefficient * dt;
-                  tLight += dt;
-              }
-
-               lightTransmittance = exp(- accumulatedOpticalThickness);
-
-          }
-          else {
-              lightTransmittance = 1.0;
-          }
-
-          vec3 Li = u_light_color.rgb * u_light_intensity * lightTransmittance;
-
-          float g_2 = g_value * g_value;
-          float cosTheta = dot(lightDir, -rayDirLoc); // Angle between light direction and view direction
-          float phaseFunction = 1/(4.0 * 3.14159265) * (1.0 - g_2) / pow(1.0 + g_2 - 2.0 * g_value * cosTheta, 1.5); // Henyey-Greenstein phase function
-
-          vec3 Ls = Li * phaseFunction;
+          // Scattering toward the lights
+          vec3 Ls = inScattering(point, rayDirLoc, lightSamples);
 
           vec3 Le = u_color.rgb;
 
           L += transmittance * (extinction_coefficient * Le + scattering_coefficient * Ls) * dt;
 
           t += dt;
+          samples++;
+
+          // Early ray termination, nothing behind this point is visible anymore
+          if (exp(- thickness) < u_min_transmittance)
+              break;
         }
 
         // Final color
         float transmittance_background = exp(- thickness);
-        vec3 background = u_background_color.rgb;
-
-        vec3 finalColor = L + background * transmittance_background;
+        vec3 finalColor = L;
 
         // Discard if almost fully transparent
+#ifndef RAY_STATS
         if (transmittance_background > 0.99) {
             discard;
         }
+#endif
         
-        FragColor = vec4(finalColor, u_color.a);
-    }
+        FragColor = vec4(finalColor, 1.0 - transmittance_background);
+#endif
+
+#ifdef RAY_STATS
+    // Samples in r, rays in g, light samples in b (see VolumeMaterial::updateStats)
+    FragColor = vec4(float(samples), 1.0, float(lightSamples), 1.0);
+#endif
 }
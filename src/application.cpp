@@ -1,4 +1,13 @@
 #include "application.h"
+#include "graphics/fbo.h"
+#include "graphics/dynamicresolution.h"
+#include "graphics/multivolume.h"
+#include "graphics/lightbuffer.h"
+#include "graphics/uniformring.h"
+#include "graphics/textureupload.h"
+#include "graphics/framereadback.h"
+#include "graphics/framecapture.h"
+#include "graphics/textureloader.h"
 
 bool render_wireframe = false;
 Camera* Application::camera = nullptr;
@@ -24,7 +33,18 @@ void Application::init(GLFWwindow* window)
 
     this->background_color = glm::vec4(0.f, 0.f, 0.f, 1.f);
 
+    this->scene_fbo = new FBO();
+    this->dynamic_resolution = new DynamicResolution();
+    this->multi_volume = new MultiVolume();
+    this->readback = new FrameReadback();
+    this->capture = new FrameCapture();
+
     /* ADD NODES TO THE SCENE */
+    /*
+    // Decoded in parallel before the nodes ask for them, Texture::Get returns the ones already created
+    TextureLoader::Get()->load({ "res/textures/albedo.png", "res/textures/normal.tga" });
+    */
+
     /*
     SceneNode* example = new SceneNode("Example Node");
     example->mesh = Mesh::Get("res/meshes/sphere.obj");
@@ -42,12 +62,21 @@ void Application::init(GLFWwindow* window)
     /*
     SceneNode* bunny = new SceneNode("Bunny");
     VolumeMaterial* bunnyMaterial = new VolumeMaterial();
-    bunnyMaterial->loadVDB("res/volumes/bunny_cloud.vdb");
+    bunnyMaterial->loadVDB("res/volumes/bunny_cloud.vdb"); // pass true to traverse the sparse grid instead of a dense texture
     bunny->material = bunnyMaterial;
     bunny->mesh = Mesh::Get("res/meshes/cube.obj");
     this->node_list.push_back(bunny);
     */
 
+    /*
+    SceneNode* smoke = new SceneNode("Smoke Sequence");
+    VolumeMaterial* smokeMaterial = new VolumeMaterial();
+    smokeMaterial->loadVDBSequence("res/volumes/smoke/"); // one .vdb per frame
+    smoke->material = smokeMaterial;
+    smoke->mesh = Mesh::Get("res/meshes/cube.obj");
+    this->node_list.push_back(smoke);
+    */
+
     SceneNode* volume_node = new SceneNode("DICOM Volume");
     volume_node->mesh = Mesh::Get("res/meshes/cube.obj");
     VolumeDICOMLoader* dicomLoader = new VolumeDICOMLoader();
@@ -74,8 +103,39 @@ void Application::update(float dt)
     this->lastMousePosition = this->mousePosition;
 }
 
+// Block "Frame" of the shaders (std140)
+struct sFrameBlock {
+    glm::mat4 viewprojection;
+    glm::mat4 inv_viewprojection;
+    glm::vec3 camera_position;
+    float padding;
+    glm::vec4 ambient_light;
+    glm::vec4 background_color;
+};
+
 void Application::render()
 {
+    this->dynamic_resolution->beginFrame();
+    Shader::BeginFrame();
+    TextureLoader::Get()->update();
+    TextureUploadQueue::Get()->update();
+
+    // Camera and scene uniforms once for every draw of the frame
+    UniformRing* ring = UniformRing::Get();
+    ring->beginFrame();
+
+    sFrameBlock frame;
+    frame.viewprojection = this->camera->viewprojection_matrix;
+    frame.inv_viewprojection = glm::inverse(this->camera->viewprojection_matrix);
+    frame.camera_position = this->camera->eye;
+    frame.padding = 0.f;
+    frame.ambient_light = this->ambient_light;
+    frame.background_color = this->background_color;
+    ring->bind(ring->upload(&frame, sizeof(frame)), Shader::FRAME_BINDING);
+
+    // Every material reads the lights from the same buffer
+    LightBuffer::Get()->update(this->light_list);
+
     // Set the clear color (the background color)
     glClearColor(this->background_color.r, this->background_color.g, this->background_color.b, this->background_color.a);
 
@@ -86,15 +146,63 @@ void Application::render()
     glEnable(GL_DEPTH_TEST);
     glEnable(GL_CULL_FACE);
 
+    // Opaque nodes at full resolution
+    if (this->scene_fbo->width != this->window_width || this->scene_fbo->height != this->window_height)
+        this->scene_fbo->create(this->window_width, this->window_height);
+
+    this->scene_fbo->bind();
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     for (unsigned int i = 0; i < this->node_list.size(); i++)
     {
-        this->node_list[i]->render(this->camera);
+        Material* material = this->node_list[i]->material;
+        if (!material || !material->isVolume()) this->node_list[i]->render(this->camera);
+    }
+    this->scene_fbo->unbind();
 
-        if (this->flag_wireframe) this->node_list[i]->renderWireframe(this->camera);
+    // Volumes at the resolution that fits the frame budget, together when they can be. The scale is kept
+    // while a volume accumulates frames, the accumulation restarts whenever its resolution changes
+    bool accumulating = false;
+    for (unsigned int i = 0; i < this->node_list.size(); i++)
+    {
+        VolumeMaterial* material = dynamic_cast<VolumeMaterial*>(this->node_list[i]->material);
+        if (material && material->isAccumulating()) accumulating = true;
+    }
+    this->dynamic_resolution->frozen = accumulating;
+    this->dynamic_resolution->begin(this->window_width, this->window_height);
+    std::vector<SceneNode*> volumes;
+    this->multi_volume->render(this->node_list, this->camera, volumes);
+    for (unsigned int i = 0; i < volumes.size(); i++)
+        volumes[i]->render(this->camera);
+    this->dynamic_resolution->end();
+
+    // Both to the window, with depth so the helpers below are still occluded
+    this->dynamic_resolution->composite(this->scene_fbo);
+
+    if (this->flag_wireframe) {
+        for (unsigned int i = 0; i < this->node_list.size(); i++)
+            this->node_list[i]->renderWireframe(this->camera);
     }
 
     // Draw the floor grid
     if (this->flag_grid) drawGrid();
+
+    ring->endFrame();
+    this->dynamic_resolution->endFrame();
+
+    // Frames read a couple of frames late, the pixels are only counted
+    if (this->readback_every_frame)
+        this->readback->request(this->readback->requested);
+    FrameReadback::sFrame frame_pixels;
+    while (this->readback->poll(frame_pixels))
+        this->readback->recycle(frame_pixels);
+
+    this->capture->update();
+
+    // The program variants are created on their first draw, so startup ends with the first frame
+    if (!this->startup_reported) {
+        Shader::PrintCompileStats("Startup shaders");
+        this->startup_reported = true;
+    }
 }
 
 void Application::renderGUI()
@@ -109,6 +217,59 @@ void Application::renderGUI()
             ImGui::TreePop();
         }
 
+        if (ImGui::TreeNode("Dynamic Resolution")) {
+            this->dynamic_resolution->renderInMenu();
+            ImGui::TreePop();
+        }
+
+        if (ImGui::TreeNode("Multi Volume")) {
+            this->multi_volume->renderInMenu();
+            ImGui::TreePop();
+        }
+
+        if (ImGui::TreeNode("Capture")) {
+            this->capture->renderInMenu();
+            ImGui::TreePop();
+        }
+
+        if (ImGui::TreeNode("Frame Readback")) {
+            FrameReadback* readback = this->readback;
+            ImGui::Checkbox("Read back every frame", &this->readback_every_frame);
+            const char* formats[] = { "RGBA8", "RGB10A2", "R32F depth" };
+            ImGui::Combo("Format", (int*)&readback->format, formats, 3);
+            ImGui::Text("Completed: %d, dropped: %d, copy: %.2f ms", readback->completed, readback->dropped, readback->copy_ms);
+            ImGui::TreePop();
+        }
+
+        if (ImGui::TreeNode("Texture Uploads")) {
+            TextureLoader::Get()->renderInMenu();
+            TextureUploadQueue::Get()->renderInMenu();
+            ImGui::TreePop();
+        }
+
+        if (ImGui::TreeNode("Shaders")) {
+            const Shader::sStateStats& stats = Shader::last_stats;
+            ImGui::Text("Uniforms: %d uploaded, %d skipped", stats.uniforms_issued, stats.uniforms_skipped);
+            ImGui::Text("Textures: %d bound, %d skipped", stats.textures_issued, stats.textures_skipped);
+            UniformRing* ring = UniformRing::Get();
+            ImGui::Text("Uniform blocks: %d (%d bytes, %s)", ring->uploads, ring->bytes, ring->persistent ? "persistent" : "BufferSubData");
+            if (ImGui::Button("Benchmark uniform lookups"))
+                Shader::BenchmarkUniformLookups();
+
+            const Shader::sCompileStats& compile = Shader::compile_stats;
+            ImGui::Text("Programs: %d (%d from binaries), %.1f ms", compile.programs, compile.from_cache, compile.ms);
+            ImGui::Text("Deduplicated variants: %d", compile.deduplicated);
+            if (!Shader::SupportsProgramBinaries())
+                ImGui::Text("Program binaries not supported by the driver");
+            ImGui::Checkbox("Program binary cache", &Shader::s_use_binary_cache);
+            ImGui::Checkbox("Reload on save", &Shader::s_reload_on_save);
+            if (ImGui::Button("Reload all (blocking)"))
+                Shader::ReloadAll();
+            if (ImGui::Button("Clear binary cache"))
+                Shader::ClearBinaryCache();
+            ImGui::TreePop();
+        }
+
         unsigned int count = 0;
         std::stringstream ss;
         for (auto& node : this->node_list) {
@@ -132,7 +293,7 @@ void Application::onKeyDown(int key, int scancode)
         close = true;
         break;
     case GLFW_KEY_R:
-        Shader::ReloadAll();
+        Shader::ReloadChanged();
         break;
     }
 }
@@ -199,6 +360,11 @@ void Application::onScroll(double xOffset, double yOffset)
 
 void Application::onWindowSize(int width, int height)
 {
+    if (!width || !height) return; // minimized
+
+    this->window_width = width;
+    this->window_height = height;
+
     glViewport(0, 0, width, height);
     this->camera->setAspectRatio(width / (float)height);
     this->camera->updateProjectionMatrix();
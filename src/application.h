@@ -7,6 +7,12 @@
 #include "framework/volumedicomloader.h"
 #include <glm/vec2.hpp>
 
+class FBO;
+class DynamicResolution;
+class MultiVolume;
+class FrameReadback;
+class FrameCapture;
+
 class Application
 {
 public:
@@ -24,6 +30,14 @@ public:
 	bool flag_grid;
 	bool flag_wireframe;
 
+	FBO* scene_fbo = NULL; // opaque nodes, the volumes are upsampled over it
+	DynamicResolution* dynamic_resolution = NULL;
+	MultiVolume* multi_volume = NULL; // overlapping volumes marched together
+	bool startup_reported = false; // shader compile times, after the first frame
+	FrameReadback* readback = NULL; // reads every frame back when readback_every_frame, to measure its cost
+	bool readback_every_frame = false;
+	FrameCapture* capture = NULL; // turntables and reviews, written in the background
+
 	bool close = false;
 	bool dragging;
 	glm::vec2 mousePosition;
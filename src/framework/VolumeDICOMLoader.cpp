@@ -161,8 +161,12 @@ void VolumeDICOMLoader::create3DTextureFromDicom()
         format,          // GL_RED
         type,            // GL_FLOAT
         false,           // no mipmaps
-        volume.data(),   // pointer to your float values
+        (float*)NULL,    // storage only, the slices are streamed below
         internalFormat   // GL_R8 (or GL_R16F, GL_R32F)
     );
+
+    // A CT series is hundreds of MB of floats, copy it in the background through the upload queue.
+    // volume is kept by the loader, so it stays valid until the upload is complete
+    this->upload = TextureUploadQueue::Get()->enqueue(this->texture, volume.data());
 }
 
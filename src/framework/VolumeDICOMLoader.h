@@ -3,11 +3,13 @@
 #include <vector>
 #include <glm/glm.hpp>
 #include "graphics/texture.h"
+#include "graphics/textureupload.h"
 
 class VolumeDICOMLoader {
 public:
 
     Texture* texture = NULL;
+    TextureUploadQueue::Ticket upload = 0; // the texture is filled over the next frames
 
     bool loadSeries(const std::string& folder);
 
@@ -45,6 +45,7 @@ void Light::renderInMenu()
 	ImGuizmo::RecomposeMatrixFromComponents(matrixTranslation, matrixRotation, matrixScale, glm::value_ptr(this->model));
 
 	ImGui::SliderFloat("Intensity", (float*)&this->intensity, 0.f, 50.f);
+	ImGui::DragFloat("Radius", &this->radius, 0.1f, 0.f, 100.f);
 	
 	material->renderInMenu();
 }
\ No newline at end of file
@@ -8,6 +8,7 @@ public:
 	float intensity;
 	glm::vec4 color;
 	glm::vec3 position;
+	float radius = 0.f; // influence range for culling and falloff, 0: reaches the whole scene
 
 	Light(glm::vec3 position = glm::vec3(0.f), float intensity = 1.f, glm::vec4 color = glm::vec4(1.f));
 
@@ -0,0 +1,122 @@
+#include "threadpool.h"
+
+#include <algorithm>
+#include <memory>
+
+ThreadPool::ThreadPool(int num_threads)
+{
+	if (num_threads <= 0)
+		num_threads = std::max(1, (int)std::thread::hardware_concurrency() - 1);
+
+	for (int i = 0; i < num_threads; i++)
+		this->workers.emplace_back(&ThreadPool::workerLoop, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->stopping = true;
+	}
+	this->job_available.notify_all();
+
+	for (std::thread& worker : this->workers)
+		worker.join();
+}
+
+ThreadPool* ThreadPool::Get()
+{
+	static ThreadPool* pool = new ThreadPool();
+	return pool;
+}
+
+void ThreadPool::enqueue(std::function<void()> job)
+{
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->jobs.push_back(std::move(job));
+	}
+	this->job_available.notify_one();
+}
+
+void ThreadPool::parallelFor(int begin, int end, const std::function<void(int, int)>& fn, int chunk_size)
+{
+	if (end <= begin)
+		return;
+
+	int count = end - begin;
+	if (chunk_size <= 0)
+		chunk_size = std::max(1, count / (4 * (getNumThreads() + 1)));
+
+	// Shared state lives until the last helper job is done, even if it runs after we return
+	struct sParallelState {
+		std::atomic<int> next_chunk{ 0 };
+		std::atomic<int> done_chunks{ 0 };
+		int num_chunks = 0;
+		std::mutex mutex;
+		std::condition_variable finished;
+	};
+
+	std::shared_ptr<sParallelState> state = std::make_shared<sParallelState>();
+	state->num_chunks = (count + chunk_size - 1) / chunk_size;
+
+	auto consume = [state, begin, end, chunk_size, &fn]() {
+		int chunk;
+		while ((chunk = state->next_chunk.fetch_add(1)) < state->num_chunks) {
+			int chunk_begin = begin + chunk * chunk_size;
+			fn(chunk_begin, std::min(end, chunk_begin + chunk_size));
+			if (state->done_chunks.fetch_add(1) + 1 == state->num_chunks) {
+				std::lock_guard<std::mutex> lock(state->mutex);
+				state->finished.notify_all();
+			}
+		}
+	};
+
+	// Helpers only touch "fn" while they own a chunk, and every chunk is finished before we return
+	int num_helpers = std::min(getNumThreads(), state->num_chunks - 1);
+	for (int i = 0; i < num_helpers; i++)
+		enqueue(consume);
+
+	consume();
+
+	std::unique_lock<std::mutex> lock(state->mutex);
+	state->finished.wait(lock, [&state]() { return state->done_chunks.load() == state->num_chunks; });
+}
+
+void ThreadPool::wait()
+{
+	std::unique_lock<std::mutex> lock(this->mutex);
+	this->job_finished.wait(lock, [this]() { return this->jobs.empty() && this->running_jobs == 0; });
+}
+
+int ThreadPool::getPendingJobs()
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	return (int)this->jobs.size() + this->running_jobs;
+}
+
+void ThreadPool::workerLoop()
+{
+	while (true)
+	{
+		std::function<void()> job;
+		{
+			std::unique_lock<std::mutex> lock(this->mutex);
+			this->job_available.wait(lock, [this]() { return this->stopping || !this->jobs.empty(); });
+			if (this->stopping && this->jobs.empty())
+				return;
+
+			job = std::move(this->jobs.front());
+			this->jobs.pop_front();
+			this->running_jobs++;
+		}
+
+		job();
+
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			this->running_jobs--;
+		}
+		this->job_finished.notify_all();
+	}
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+
+// Small worker pool used for CPU work that should not block the render thread
+// (file loading, voxelization, texture baking...). Workers never touch OpenGL.
+class ThreadPool
+{
+public:
+	ThreadPool(int num_threads = 0); // 0: one thread per hardware core (minus the render thread)
+	~ThreadPool();
+
+	// Global pool shared by the whole application
+	static ThreadPool* Get();
+
+	// Queue a job to be executed in any of the workers
+	void enqueue(std::function<void()> job);
+
+	// Split [begin, end) in chunks and run them in parallel, returns when all chunks are done.
+	// The calling thread also consumes chunks, so it is safe to call it from inside a job.
+	void parallelFor(int begin, int end, const std::function<void(int, int)>& fn, int chunk_size = 0);
+
+	// Wait until the queue is empty and no job is running
+	void wait();
+
+	int getNumThreads() const { return (int)this->workers.size(); }
+	int getPendingJobs();
+
+private:
+	std::vector<std::thread> workers;
+	std::deque<std::function<void()>> jobs;
+	std::mutex mutex;
+	std::condition_variable job_available;
+	std::condition_variable job_finished;
+	int running_jobs = 0;
+	bool stopping = false;
+
+	void workerLoop();
+};
@@ -211,6 +211,16 @@ bool checkGLErrors()
 	return true;
 }
 
+bool hasGLExtension(const char* name)
+{
+	GLint count = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+	for (GLint i = 0; i < count; i++)
+		if (strcmp((const char*)glGetStringi(GL_EXTENSIONS, i), name) == 0)
+			return true;
+	return false;
+}
+
 std::vector<std::string>& split(const std::string& s, char delim, std::vector<std::string>& elems) {
 	std::stringstream ss(s);
 	std::string item;
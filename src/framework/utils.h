@@ -16,7 +16,7 @@
 
 //General functions **************
 long getTime();
-float* snapshot();
+float* snapshot(); //blocking read of the viewport as float RGBA, use FrameReadback for captures every frame
 bool readFile(const std::string& filename, std::string& content);
 
 //generic purposes fuctions
@@ -25,6 +25,8 @@ glm::vec3 transformQuat(const glm::vec3& a, const glm::quat& q);
 
 //check opengl errors
 bool checkGLErrors();
+//check if the driver exposes an extension, e.g. "GL_ARB_buffer_storage"
+bool hasGLExtension(const char* name);
 
 std::string getPath();
 
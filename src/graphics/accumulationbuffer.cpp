@@ -0,0 +1,108 @@
+#include "accumulationbuffer.h"
+
+#include "fbo.h"
+#include "texture.h"
+#include "shader.h"
+
+#include <cmath>
+
+AccumulationBuffer::AccumulationBuffer() { }
+
+AccumulationBuffer::~AccumulationBuffer()
+{
+	if (this->frame)
+		delete this->frame;
+	for (int i = 0; i < 2; i++)
+		if (this->history[i])
+			delete this->history[i];
+}
+
+void AccumulationBuffer::reset()
+{
+	this->num_frames = 0;
+}
+
+bool AccumulationBuffer::begin(int width, int height)
+{
+	if (!this->frame || this->frame->width != width || this->frame->height != height) {
+		if (!this->frame) {
+			this->frame = new FBO();
+			this->history[0] = new FBO();
+			this->history[1] = new FBO();
+		}
+		this->frame->create(width, height, 1, GL_RGBA, GL_FLOAT, false, GL_RGBA32F);
+		this->history[0]->create(width, height, 1, GL_RGBA, GL_FLOAT, false, GL_RGBA32F);
+		this->history[1]->create(width, height, 1, GL_RGBA, GL_FLOAT, false, GL_RGBA32F);
+		reset();
+	}
+
+	if (this->num_frames >= this->max_frames)
+		return false;
+
+	glGetFloatv(GL_COLOR_CLEAR_VALUE, this->clear_color);
+	this->frame->bind();
+	glClearColor(0.f, 0.f, 0.f, 0.f);
+	glClear(GL_COLOR_BUFFER_BIT);
+	return true;
+}
+
+void AccumulationBuffer::end()
+{
+	this->frame->unbind();
+	glClearColor(this->clear_color[0], this->clear_color[1], this->clear_color[2], this->clear_color[3]);
+
+	Shader* shader = Shader::Get("res/shaders/quad.vs", "res/shaders/accumulate.fs");
+	if (!shader)
+		return;
+
+	GLboolean depth_test = glIsEnabled(GL_DEPTH_TEST);
+	GLboolean blend = glIsEnabled(GL_BLEND);
+	glDisable(GL_DEPTH_TEST);
+	glDisable(GL_BLEND);
+
+	// history[next] = mix(history[current], frame, 1 / n)
+	int next = 1 - this->current;
+	this->history[next]->bind();
+	shader->enable();
+	shader->setUniform("u_history", this->history[this->current]->color_textures[0], 1);
+	shader->setUniform("u_weight", 1.f / (this->num_frames + 1));
+	this->frame->color_textures[0]->toViewport(shader);
+	this->history[next]->unbind();
+
+	if (depth_test) glEnable(GL_DEPTH_TEST);
+	if (blend) glEnable(GL_BLEND);
+
+	this->current = next;
+	this->num_frames++;
+}
+
+void AccumulationBuffer::draw()
+{
+	Shader* shader = Shader::Get("res/shaders/quad.vs", "res/shaders/composite.fs");
+	if (!shader || this->num_frames == 0)
+		return;
+
+	GLboolean depth_test = glIsEnabled(GL_DEPTH_TEST);
+	GLboolean blend = glIsEnabled(GL_BLEND);
+	glDisable(GL_DEPTH_TEST);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+
+	this->history[this->current]->color_textures[0]->toViewport(shader);
+
+	if (depth_test) glEnable(GL_DEPTH_TEST);
+	if (!blend) glDisable(GL_BLEND);
+}
+
+float AccumulationBuffer::getFrameOffset()
+{
+	const float golden_ratio = 0.61803398875f;
+	float offset = this->num_frames * golden_ratio;
+	return offset - floorf(offset);
+}
+
+void AccumulationBuffer::renderInMenu()
+{
+	ImGui::Text("Accumulated frames: %d / %d", this->num_frames, this->max_frames);
+	ImGui::SliderInt("Max Frames", &this->max_frames, 1, 1024);
+}
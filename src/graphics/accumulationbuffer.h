@@ -0,0 +1,38 @@
+#pragma once
+
+#include "../framework/includes.h"
+
+class FBO;
+class Shader;
+
+// Progressive refinement: running average of jittered frames of the same view.
+// Every frame is drawn into "frame" and blended into the history, the caller restarts it with reset()
+// when the view or the parameters change. Stores premultiplied color and coverage in alpha.
+class AccumulationBuffer
+{
+public:
+	int num_frames = 0; // frames in the average
+	int max_frames = 256; // converged, stop rendering new frames
+
+	AccumulationBuffer();
+	~AccumulationBuffer();
+
+	void reset();
+
+	// Binds and clears the frame target. Returns false when there is nothing left to refine
+	bool begin(int width, int height);
+	// Unbinds the frame target and adds it to the average
+	void end();
+	// Composites the average over the current framebuffer
+	void draw();
+
+	// Offset of the jitter pattern for the next frame, golden ratio sequence so any run of frames is well spread
+	float getFrameOffset();
+	void renderInMenu();
+
+private:
+	FBO* frame = NULL;
+	FBO* history[2] = { NULL, NULL };
+	int current = 0; // history with the latest average
+	GLfloat clear_color[4];
+};
@@ -0,0 +1,118 @@
+#include "dynamicresolution.h"
+
+#include "fbo.h"
+#include "texture.h"
+#include "shader.h"
+
+#include <algorithm>
+#include <cmath>
+
+DynamicResolution::DynamicResolution() { }
+
+DynamicResolution::~DynamicResolution()
+{
+	if (this->fbo)
+		delete this->fbo;
+	if (this->queries[0])
+		glDeleteQueries(NUM_QUERIES, this->queries);
+}
+
+void DynamicResolution::beginFrame()
+{
+	if (!this->queries[0])
+		glGenQueries(NUM_QUERIES, this->queries);
+
+	// Result of the oldest query in the ring, if the GPU got there already
+	if (this->frame >= NUM_QUERIES) {
+		GLuint oldest = this->queries[this->frame % NUM_QUERIES];
+		GLint available = 0;
+		glGetQueryObjectiv(oldest, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (available) {
+			GLuint64 ns = 0;
+			glGetQueryObjectui64v(oldest, GL_QUERY_RESULT, &ns);
+			updateScale(ns / 1000000.f);
+		}
+	}
+
+	glBeginQuery(GL_TIME_ELAPSED, this->queries[this->frame % NUM_QUERIES]);
+}
+
+void DynamicResolution::endFrame()
+{
+	glEndQuery(GL_TIME_ELAPSED);
+	this->frame++;
+}
+
+void DynamicResolution::updateScale(float ms)
+{
+	this->gpu_ms = this->gpu_ms == 0.f ? ms : this->gpu_ms * 0.9f + ms * 0.1f;
+	if (!this->enabled || this->frozen)
+		return;
+
+	// The cost of the volumes goes with the pixel count, scale^2. Leave some margin so it does not oscillate
+	float ratio = this->target_ms / std::max(this->gpu_ms, 0.01f);
+	if (ratio < 0.95f || ratio > 1.25f)
+		this->scale = std::clamp(this->scale * std::clamp(sqrtf(ratio), 0.9f, 1.05f), this->min_scale, 1.f);
+}
+
+void DynamicResolution::begin(int width, int height)
+{
+	if (!this->fbo || this->fbo->width != width || this->fbo->height != height) {
+		if (!this->fbo)
+			this->fbo = new FBO();
+		this->fbo->create(width, height, 1, GL_RGBA, GL_FLOAT, true, GL_RGBA16F);
+	}
+
+	this->viewport[0] = std::max((int)(width * this->scale), 1);
+	this->viewport[1] = std::max((int)(height * this->scale), 1);
+
+	GLfloat clear_color[4];
+	glGetFloatv(GL_COLOR_CLEAR_VALUE, clear_color);
+
+	this->fbo->bind();
+	glViewport(0, 0, this->viewport[0], this->viewport[1]);
+	glClearColor(0.f, 0.f, 0.f, 0.f);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	glClearColor(clear_color[0], clear_color[1], clear_color[2], clear_color[3]);
+}
+
+void DynamicResolution::end()
+{
+	this->fbo->unbind();
+}
+
+void DynamicResolution::composite(FBO* scene)
+{
+	Shader* shader = Shader::Get("res/shaders/quad.vs", "res/shaders/upsample.fs");
+	if (!shader || !this->fbo)
+		return;
+
+	// Depth is written by the shader, the test only has to let it through
+	GLint depth_func;
+	glGetIntegerv(GL_DEPTH_FUNC, &depth_func);
+	GLboolean depth_test = glIsEnabled(GL_DEPTH_TEST);
+	glEnable(GL_DEPTH_TEST);
+	glDepthFunc(GL_ALWAYS);
+
+	shader->enable();
+	shader->setUniform("u_volume_depth", this->fbo->depth_texture, 1);
+	shader->setUniform("u_scene_color", scene->color_textures[0], 2);
+	shader->setUniform("u_scene_depth", scene->depth_texture, 3);
+	shader->setUniform("u_viewport", glm::vec2(this->viewport[0], this->viewport[1]));
+	this->fbo->color_textures[0]->toViewport(shader);
+
+	glDepthFunc(depth_func);
+	if (!depth_test) glDisable(GL_DEPTH_TEST);
+}
+
+void DynamicResolution::renderInMenu()
+{
+	ImGui::Checkbox("Enabled", &this->enabled);
+	ImGui::SliderFloat("Target (ms)", &this->target_ms, 4.f, 100.f);
+	ImGui::SliderFloat("Min Scale", &this->min_scale, 0.1f, 1.f);
+	if (!this->enabled)
+		ImGui::SliderFloat("Scale", &this->scale, this->min_scale, 1.f);
+	ImGui::Text("GPU: %.2f ms, volumes at %d x %d (%.0f%%)", this->gpu_ms, this->viewport[0], this->viewport[1], this->scale * 100.f);
+	if (this->frozen)
+		ImGui::Text("Scale frozen while accumulating");
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "../framework/includes.h"
+
+class FBO;
+
+// Volumes are drawn off-screen at a fraction of the window resolution and upsampled over the opaque scene.
+// The fraction follows the GPU time of the frame (timer queries, read a few frames late so they never stall)
+// to keep it under target_ms.
+class DynamicResolution
+{
+public:
+	bool enabled = true; // adapt the scale, otherwise it stays where it is
+	float scale = 1.f; // fraction of the window resolution per side
+	bool frozen = false; // set by the application while a volume accumulates frames, a new size would restart it
+	float min_scale = 0.25f;
+	float target_ms = 16.6f;
+	float gpu_ms = 0.f; // smoothed GPU time of the frame
+
+	DynamicResolution();
+	~DynamicResolution();
+
+	// Around everything the frame renders
+	void beginFrame();
+	void endFrame();
+
+	// Binds and clears the low resolution target, the viewport covers scale * size of it
+	void begin(int width, int height);
+	void end();
+
+	// Writes the opaque scene with the volumes on top to the current framebuffer, color and depth
+	void composite(FBO* scene);
+	void renderInMenu();
+
+private:
+	static const int NUM_QUERIES = 4;
+
+	FBO* fbo = NULL;
+	int viewport[2] = { 0, 0 }; // used part of the target in the last frame
+
+	GLuint queries[NUM_QUERIES] = { 0 };
+	int frame = 0;
+
+	void updateScale(float ms);
+};
@@ -0,0 +1,115 @@
+#include "fbo.h"
+
+#include "texture.h"
+#include "shader.h"
+
+FBO::FBO() { }
+
+FBO::~FBO()
+{
+	freeTextures();
+
+	if (this->fbo_id)
+		glDeleteFramebuffers(1, &this->fbo_id);
+}
+
+void FBO::freeTextures()
+{
+	if (this->owns_textures) {
+		for (Texture* texture : this->color_textures)
+			delete texture;
+		if (this->depth_texture)
+			delete this->depth_texture;
+	}
+
+	this->color_textures.clear();
+	this->depth_texture = NULL;
+	this->owns_textures = false;
+}
+
+bool FBO::create(int width, int height, int num_textures, unsigned int format, unsigned int type, bool use_depth_texture, unsigned int internal_format)
+{
+	assert(width && height && num_textures > 0 && num_textures <= 4);
+
+	freeTextures();
+	this->width = width;
+	this->height = height;
+	this->owns_textures = true;
+
+	if (!this->fbo_id)
+		glGenFramebuffers(1, &this->fbo_id);
+	GLint previous_fbo = 0;
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previous_fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, this->fbo_id);
+
+	GLenum draw_buffers[4];
+	for (int i = 0; i < num_textures; i++) {
+		Texture* texture = new Texture(width, height, format, type, false, NULL, internal_format);
+		this->color_textures.push_back(texture);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_2D, texture->texture_id, 0);
+		draw_buffers[i] = GL_COLOR_ATTACHMENT0 + i;
+	}
+	glDrawBuffers(num_textures, draw_buffers);
+
+	if (use_depth_texture) {
+		this->depth_texture = new Texture(width, height, GL_DEPTH_COMPONENT, GL_FLOAT, false, NULL, GL_DEPTH_COMPONENT24);
+		glBindTexture(GL_TEXTURE_2D, this->depth_texture->texture_id);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		Shader::InvalidateTextureCache();
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, this->depth_texture->texture_id, 0);
+	}
+
+	bool ok = checkStatus();
+	glBindFramebuffer(GL_FRAMEBUFFER, previous_fbo);
+	return ok;
+}
+
+bool FBO::setTextureLayer(Texture* texture, int layer)
+{
+	assert(texture && texture->texture_type == GL_TEXTURE_3D);
+
+	if (this->owns_textures)
+		freeTextures();
+	this->width = (int)texture->width;
+	this->height = (int)texture->height;
+
+	if (!this->fbo_id)
+		glGenFramebuffers(1, &this->fbo_id);
+	GLint previous_fbo = 0;
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previous_fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, this->fbo_id);
+
+	glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, texture->texture_id, 0, layer);
+	glDrawBuffer(GL_COLOR_ATTACHMENT0);
+
+	bool ok = checkStatus();
+	glBindFramebuffer(GL_FRAMEBUFFER, previous_fbo);
+	return ok;
+}
+
+void FBO::bind()
+{
+	glGetIntegerv(GL_VIEWPORT, this->old_viewport);
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &this->old_fbo);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, this->fbo_id);
+	glViewport(0, 0, this->width, this->height);
+}
+
+void FBO::unbind()
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, this->old_fbo);
+	glViewport(this->old_viewport[0], this->old_viewport[1], this->old_viewport[2], this->old_viewport[3]);
+}
+
+bool FBO::checkStatus()
+{
+	GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	if (status != GL_FRAMEBUFFER_COMPLETE) {
+		std::cout << "[ERROR]: FBO not complete (0x" << std::hex << status << std::dec << ")" << std::endl;
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "../framework/includes.h"
+#include <vector>
+
+class Texture;
+
+// Framebuffer object, to render into textures instead of the screen
+class FBO
+{
+public:
+	GLuint fbo_id = 0;
+	std::vector<Texture*> color_textures;
+	Texture* depth_texture = NULL;
+	int width = 0;
+	int height = 0;
+
+	FBO();
+	~FBO();
+
+	// Creates num_textures color attachments (and a depth texture if requested) owned by the FBO
+	bool create(int width, int height, int num_textures = 1, unsigned int format = GL_RGBA, unsigned int type = GL_UNSIGNED_BYTE, bool use_depth_texture = true, unsigned int internal_format = 0);
+
+	// Attaches one slice of a 3D texture as the only color target, the texture is not owned
+	bool setTextureLayer(Texture* texture, int layer);
+
+	// Binds the FBO and sets the viewport to its size, unbind restores both
+	void bind();
+	void unbind();
+
+	void freeTextures();
+
+private:
+	GLint old_viewport[4];
+	GLint old_fbo = 0;
+	bool owns_textures = false;
+
+	bool checkStatus();
+};
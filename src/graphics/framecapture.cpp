@@ -0,0 +1,376 @@
+#include "framecapture.h"
+
+#include "../framework/threadpool.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <chrono>
+#include <cstring>
+#include <cstdio>
+#include <thread>
+
+static const char* encoder_names[] = { "TGA (RLE)", "PNG", "Y4M (YUV 4:2:0)" };
+
+FrameCapture::FrameCapture()
+{
+	this->readback.format = FrameReadback::RGBA8;
+}
+
+FrameCapture::~FrameCapture()
+{
+	// Workers hold pointers to this
+	while (this->queued.load() > 0)
+		std::this_thread::yield();
+
+	if (this->stream)
+		fclose(this->stream);
+}
+
+bool FrameCapture::start()
+{
+	if (this->recording || this->closing)
+		return false;
+
+	std::error_code error;
+	std::filesystem::create_directories(this->folder, error);
+
+	// First session number not on disk yet
+	std::string name;
+	do {
+		char suffix[32];
+		snprintf(suffix, sizeof(suffix), "/capture_%03d", ++this->session);
+		name = this->folder + suffix;
+	} while (std::filesystem::exists(name) || std::filesystem::exists(name + ".y4m"));
+
+	if (this->encoder == ENCODER_Y4M) {
+		this->path = name + ".y4m";
+		this->stream = fopen(this->path.c_str(), "wb");
+		if (!this->stream) {
+			std::cout << "[ERROR]: Cannot create capture file " << this->path << std::endl;
+			return false;
+		}
+		this->stream_width = this->stream_height = 0;
+		this->next_write = 0;
+		this->next_sequence = 0;
+		this->pending.clear();
+	}
+	else {
+		this->path = name;
+		if (!std::filesystem::create_directories(this->path, error)) {
+			std::cout << "[ERROR]: Cannot create capture folder " << this->path << std::endl;
+			return false;
+		}
+		this->next_sequence = 0;
+	}
+
+	this->captured = this->dropped = this->written = 0;
+	this->bytes_written = 0;
+	this->readback.dropped = 0;
+	this->recording = true;
+
+	std::cout << " + Capture: recording to " << this->path << " (" << encoder_names[this->encoder] << ")" << std::endl;
+	return true;
+}
+
+void FrameCapture::stop()
+{
+	if (!this->recording)
+		return;
+	this->recording = false;
+	this->closing = true;
+}
+
+void FrameCapture::finishStream()
+{
+	this->closing = false;
+	if (this->stream) {
+		// Buffered writes can still fail here
+		if (fclose(this->stream) != 0)
+			std::cout << "[ERROR]: Capture stream write failed: " << this->path << std::endl;
+		this->stream = NULL;
+	}
+	std::cout << " + Capture: " << this->written << " frames written to " << this->path << " (" << this->dropped << " dropped)" << std::endl;
+}
+
+void FrameCapture::update()
+{
+	if (this->recording)
+		this->readback.request(this->readback.requested);
+
+	FrameReadback::sFrame frame;
+	while (this->readback.poll(frame)) {
+		if (!this->recording && !this->closing) {
+			this->readback.recycle(frame);
+			continue;
+		}
+
+		// The stream keeps the size of its first frame (even, for the chroma planes)
+		bool accepted = this->queued.load() < this->max_queued;
+		if (this->encoder == ENCODER_Y4M) {
+			if (!this->stream_width) {
+				this->stream_width = frame.width & ~1;
+				this->stream_height = frame.height & ~1;
+			}
+			accepted = accepted && (frame.width & ~1) == this->stream_width && (frame.height & ~1) == this->stream_height;
+		}
+
+		if (!accepted) {
+			this->dropped++;
+			this->readback.recycle(frame);
+			continue;
+		}
+
+		int sequence = this->next_sequence++;
+		this->captured++;
+		this->queued++;
+
+		FrameReadback::sFrame* job = new FrameReadback::sFrame();
+		std::swap(*job, frame);
+		ThreadPool::Get()->enqueue([this, job, sequence]() {
+			encode(*job, sequence);
+			this->readback.recycle(*job);
+			delete job;
+			this->queued--;
+		});
+	}
+
+	if (this->closing && this->readback.getInFlight() == 0 && this->queued.load() == 0)
+		finishStream();
+}
+
+// Runs in a worker thread
+void FrameCapture::encode(const FrameReadback::sFrame& frame, int sequence)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	std::vector<uint8_t> data;
+	switch (this->encoder) {
+	case ENCODER_PNG: encodePNG(frame, data); break;
+	case ENCODER_Y4M: encodeYUV(frame, this->stream_width, this->stream_height, data); break;
+	default: encodeTGA(frame, data); break;
+	}
+
+	float ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+	if (this->encoder == ENCODER_Y4M) {
+		// Frames finish in any order, the stream takes them in sequence
+		std::lock_guard<std::mutex> lock(this->write_mutex);
+		this->avg_encode_ms = this->avg_encode_ms == 0.f ? ms : this->avg_encode_ms * 0.9f + ms * 0.1f;
+		if (!this->stream) {
+			this->dropped++; // the stream failed, nothing more is written
+			return;
+		}
+		this->pending[sequence].swap(data);
+
+		for (auto it = this->pending.find(this->next_write); it != this->pending.end(); it = this->pending.find(this->next_write)) {
+			bool ok = true;
+			if (this->next_write == 0) {
+				int header = fprintf(this->stream, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", this->stream_width, this->stream_height, this->fps);
+				ok = header > 0;
+				this->bytes_written += ok ? header : 0;
+			}
+			ok = ok && fwrite("FRAME\n", 1, 6, this->stream) == 6 && fwrite(it->second.data(), 1, it->second.size(), this->stream) == it->second.size();
+
+			// Disk full or gone, the frames waiting and the ones still to come are dropped
+			if (!ok) {
+				std::cout << "[ERROR]: Capture stream write failed: " << this->path << std::endl;
+				fclose(this->stream);
+				this->stream = NULL;
+				this->dropped += (int)this->pending.size();
+				this->pending.clear();
+				break;
+			}
+
+			this->bytes_written += 6 + it->second.size();
+			this->written++;
+			this->pending.erase(it);
+			this->next_write++;
+		}
+		return;
+	}
+
+	char name[32];
+	snprintf(name, sizeof(name), "/frame_%05d.%s", sequence, this->encoder == ENCODER_PNG ? "png" : "tga");
+	std::string filename = this->path + name;
+
+	FILE* file = fopen(filename.c_str(), "wb");
+	bool ok = file && fwrite(data.data(), 1, data.size(), file) == data.size();
+	if (file)
+		fclose(file);
+
+	std::lock_guard<std::mutex> lock(this->write_mutex);
+	this->avg_encode_ms = this->avg_encode_ms == 0.f ? ms : this->avg_encode_ms * 0.9f + ms * 0.1f;
+	if (!ok) {
+		std::cout << "[ERROR]: Cannot write " << filename << std::endl;
+		return;
+	}
+	this->written++;
+	this->bytes_written += data.size();
+}
+
+// 32 bits RLE TGA (type 10), bottom-up like the readback so the rows go as they are
+void FrameCapture::encodeTGA(const FrameReadback::sFrame& frame, std::vector<uint8_t>& out)
+{
+	int w = frame.width, h = frame.height;
+	uint8_t header[18] = { 0, 0, 10, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+		(uint8_t)(w & 0xFF), (uint8_t)(w >> 8), (uint8_t)(h & 0xFF), (uint8_t)(h >> 8), 32, 8 };
+	out.assign(header, header + 18);
+	out.reserve(18 + (size_t)w * h * 2);
+
+	auto pixel = [&](const uint8_t* p) { out.push_back(p[2]); out.push_back(p[1]); out.push_back(p[0]); out.push_back(p[3]); };
+	auto same = [](const uint8_t* a, const uint8_t* b) { return memcmp(a, b, 4) == 0; };
+
+	// Packets do not cross rows
+	for (int y = 0; y < h; y++) {
+		const uint8_t* row = frame.pixels.data() + (size_t)y * w * 4;
+		int x = 0;
+		while (x < w) {
+			int run = 1;
+			while (x + run < w && run < 128 && same(row + (x + run) * 4, row + x * 4))
+				run++;
+
+			if (run > 1) {
+				out.push_back((uint8_t)(0x80 | (run - 1)));
+				pixel(row + x * 4);
+				x += run;
+				continue;
+			}
+
+			// Raw pixels until the next run starts
+			int count = 1;
+			while (x + count < w && count < 128 && !(x + count + 1 < w && same(row + (x + count) * 4, row + (x + count + 1) * 4)))
+				count++;
+			out.push_back((uint8_t)(count - 1));
+			for (int i = 0; i < count; i++)
+				pixel(row + (x + i) * 4);
+			x += count;
+		}
+	}
+}
+
+static uint32_t crc32(uint32_t crc, const uint8_t* data, size_t size)
+{
+	static const std::vector<uint32_t> table = []() {
+		std::vector<uint32_t> t(256);
+		for (uint32_t n = 0; n < 256; n++) {
+			uint32_t c = n;
+			for (int k = 0; k < 8; k++)
+				c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			t[n] = c;
+		}
+		return t;
+	}();
+
+	crc = ~crc;
+	for (size_t i = 0; i < size; i++)
+		crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+static void pushBE32(std::vector<uint8_t>& out, uint32_t v)
+{
+	out.push_back(v >> 24); out.push_back((v >> 16) & 0xFF); out.push_back((v >> 8) & 0xFF); out.push_back(v & 0xFF);
+}
+
+static void pushChunk(std::vector<uint8_t>& out, const char* type, const uint8_t* data, size_t size)
+{
+	pushBE32(out, (uint32_t)size);
+	size_t start = out.size();
+	out.insert(out.end(), type, type + 4);
+	out.insert(out.end(), data, data + size);
+	pushBE32(out, crc32(0, out.data() + start, size + 4));
+}
+
+// RGBA PNG with stored (uncompressed) deflate blocks, there is no zlib in the tree. Top-down rows
+void FrameCapture::encodePNG(const FrameReadback::sFrame& frame, std::vector<uint8_t>& out)
+{
+	int w = frame.width, h = frame.height;
+	size_t row_size = (size_t)w * 4;
+
+	// Filter type 0 on every row
+	std::vector<uint8_t> raw((row_size + 1) * h);
+	for (int y = 0; y < h; y++) {
+		uint8_t* dst = &raw[(row_size + 1) * y];
+		dst[0] = 0;
+		memcpy(dst + 1, frame.pixels.data() + (size_t)(h - 1 - y) * row_size, row_size);
+	}
+
+	std::vector<uint8_t> zlib = { 0x78, 0x01 };
+	zlib.reserve(raw.size() + raw.size() / 65535 * 5 + 16);
+	uint32_t a = 1, b = 0;
+	for (size_t pos = 0; pos < raw.size(); ) {
+		size_t size = std::min(raw.size() - pos, (size_t)65535);
+		zlib.push_back(pos + size == raw.size() ? 1 : 0);
+		zlib.push_back(size & 0xFF); zlib.push_back(size >> 8);
+		zlib.push_back(~size & 0xFF); zlib.push_back((~size >> 8) & 0xFF);
+		zlib.insert(zlib.end(), raw.begin() + pos, raw.begin() + pos + size);
+		for (size_t i = pos; i < pos + size; i++) {
+			a = (a + raw[i]) % 65521;
+			b = (b + a) % 65521;
+		}
+		pos += size;
+	}
+	pushBE32(zlib, (b << 16) | a);
+
+	static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	out.assign(signature, signature + 8);
+
+	std::vector<uint8_t> ihdr;
+	pushBE32(ihdr, w);
+	pushBE32(ihdr, h);
+	ihdr.insert(ihdr.end(), { 8, 6, 0, 0, 0 }); // 8 bits RGBA, deflate, no interlace
+	pushChunk(out, "IHDR", ihdr.data(), ihdr.size());
+	pushChunk(out, "IDAT", zlib.data(), zlib.size());
+	pushChunk(out, "IEND", NULL, 0);
+}
+
+// Full range BT.601 (C420jpeg), chroma averaged over 2x2 pixels. Top-down rows
+void FrameCapture::encodeYUV(const FrameReadback::sFrame& frame, int width, int height, std::vector<uint8_t>& out)
+{
+	int cw = width / 2, ch = height / 2;
+	out.resize((size_t)width * height + (size_t)cw * ch * 2);
+	uint8_t* Y = out.data();
+	uint8_t* U = Y + (size_t)width * height;
+	uint8_t* V = U + (size_t)cw * ch;
+
+	auto source = [&](int x, int y) { return frame.pixels.data() + ((size_t)(frame.height - 1 - y) * frame.width + x) * 4; };
+
+	for (int y = 0; y < height; y++)
+		for (int x = 0; x < width; x++) {
+			const uint8_t* p = source(x, y);
+			Y[(size_t)y * width + x] = (uint8_t)((77 * p[0] + 150 * p[1] + 29 * p[2] + 128) >> 8);
+		}
+
+	for (int y = 0; y < ch; y++)
+		for (int x = 0; x < cw; x++) {
+			int r = 0, g = 0, b = 0;
+			for (int i = 0; i < 4; i++) {
+				const uint8_t* p = source(x * 2 + (i & 1), y * 2 + (i >> 1));
+				r += p[0]; g += p[1]; b += p[2];
+			}
+			r = (r + 2) / 4; g = (g + 2) / 4; b = (b + 2) / 4;
+			U[(size_t)y * cw + x] = (uint8_t)std::clamp(((-43 * r - 85 * g + 128 * b + 128) >> 8) + 128, 0, 255);
+			V[(size_t)y * cw + x] = (uint8_t)std::clamp(((128 * r - 107 * g - 21 * b + 128) >> 8) + 128, 0, 255);
+		}
+}
+
+void FrameCapture::renderInMenu()
+{
+	bool busy = this->recording || this->closing;
+	if (busy)
+		ImGui::Text("Encoder: %s", encoder_names[this->encoder]);
+	else
+		ImGui::Combo("Encoder", (int*)&this->encoder, encoder_names, 3);
+	ImGui::SliderInt("Max queued frames", &this->max_queued, 1, 32);
+
+	if (!busy && ImGui::Button("Start recording"))
+		start();
+	else if (this->recording && ImGui::Button("Stop recording"))
+		stop();
+	else if (this->closing)
+		ImGui::Text("Writing the queued frames...");
+
+	ImGui::Text("Captured: %d, written: %d, dropped: %d", this->captured.load(), this->written.load(), this->dropped.load() + this->readback.dropped);
+	ImGui::Text("Queue: %d / %d, encode: %.2f ms", this->queued.load(), this->max_queued, this->avg_encode_ms.load());
+	ImGui::Text("Written: %.1f MB", this->bytes_written.load() / (1024.f * 1024.f));
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "framereadback.h"
+#include <string>
+#include <map>
+#include <atomic>
+
+// Records the frames to disk without blocking the render loop: FrameReadback brings them back a couple of
+// frames late, they wait in a bounded queue and ThreadPool workers encode and write them. When the queue is
+// full (the disk or the encoder can't keep up) frames are dropped and counted instead of stalling.
+// Image sequences (TGA with RLE, PNG) are written in any order, the Y4M stream is written in frame order.
+class FrameCapture
+{
+public:
+	enum eEncoder { ENCODER_TGA, ENCODER_PNG, ENCODER_Y4M };
+
+	eEncoder encoder = ENCODER_TGA;
+	std::string folder = "captures";
+	int max_queued = 8; // frames read back and not written yet
+	int fps = 30; // of the Y4M stream
+
+	// Stats, updated by the workers
+	std::atomic<int> captured{ 0 }; // accepted into the queue
+	std::atomic<int> dropped{ 0 }; // queue full, a different size than the stream or the stream failed
+	std::atomic<int> written{ 0 };
+	std::atomic<size_t> bytes_written{ 0 };
+	std::atomic<float> avg_encode_ms{ 0.f };
+
+	FrameCapture();
+	~FrameCapture();
+
+	// New folder (image sequences) or file (Y4M) under folder
+	bool start();
+	// Frames already read back are still written, the stream is closed when the queue is empty
+	void stop();
+	bool isRecording() const { return this->recording; }
+
+	// Render thread, once the frame is drawn (before the GUI so it is not captured)
+	void update();
+	void renderInMenu();
+
+private:
+	FrameReadback readback;
+	bool recording = false;
+	bool closing = false;
+	int session = 0;
+	std::string path; // folder or Y4M file of the session
+
+	// Y4M stream, size fixed by its first frame
+	FILE* stream = NULL;
+	int stream_width = 0;
+	int stream_height = 0;
+	std::map<int, std::vector<uint8_t>> pending; // encoded, waiting for earlier frames
+	int next_write = 0;
+	int next_sequence = 0;
+
+	std::atomic<int> queued{ 0 };
+	std::mutex write_mutex; // stream, pending frames and the encode average
+
+	void encode(const FrameReadback::sFrame& frame, int sequence); // in a worker
+	void finishStream();
+
+	static void encodeTGA(const FrameReadback::sFrame& frame, std::vector<uint8_t>& out);
+	static void encodePNG(const FrameReadback::sFrame& frame, std::vector<uint8_t>& out);
+	static void encodeYUV(const FrameReadback::sFrame& frame, int width, int height, std::vector<uint8_t>& out);
+};
@@ -0,0 +1,152 @@
+#include "framereadback.h"
+
+#include <chrono>
+#include <cstring>
+
+FrameReadback::FrameReadback(eFormat format)
+{
+	this->format = format;
+}
+
+FrameReadback::~FrameReadback()
+{
+	for (int i = 0; i < NUM_BUFFERS; i++) {
+		if (this->reads[i].fence)
+			glDeleteSync(this->reads[i].fence);
+		if (this->reads[i].pbo)
+			glDeleteBuffers(1, &this->reads[i].pbo);
+	}
+}
+
+const char* FrameReadback::GetFormatName(eFormat format)
+{
+	switch (format) {
+	case RGB10A2: return "RGB10A2";
+	case DEPTH32F: return "R32F depth";
+	default: return "RGBA8";
+	}
+}
+
+bool FrameReadback::request(int frame, int x, int y, int width, int height)
+{
+	this->requested++;
+
+	// Not polled yet, reading again would wait for the GPU
+	if (this->in_flight == NUM_BUFFERS) {
+		this->dropped++;
+		return false;
+	}
+
+	if (!width || !height) {
+		GLint viewport[4];
+		glGetIntegerv(GL_VIEWPORT, viewport);
+		x = viewport[0];
+		y = viewport[1];
+		width = viewport[2];
+		height = viewport[3];
+	}
+
+	sRead& read = this->reads[this->head];
+	size_t size = (size_t)width * height * 4;
+
+	if (!read.pbo)
+		glGenBuffers(1, &read.pbo);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, read.pbo);
+	if (read.capacity < size) {
+		glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+		read.capacity = size;
+	}
+
+	// Into the buffer, the call returns without waiting for the frame to finish
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	switch (this->format) {
+	case RGB10A2: glReadPixels(x, y, width, height, GL_RGBA, GL_UNSIGNED_INT_2_10_10_10_REV, 0); break;
+	case DEPTH32F: glReadPixels(x, y, width, height, GL_DEPTH_COMPONENT, GL_FLOAT, 0); break;
+	default: glReadPixels(x, y, width, height, GL_RGBA, GL_UNSIGNED_BYTE, 0); break;
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	read.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	read.frame = frame;
+	read.format = this->format;
+	read.width = width;
+	read.height = height;
+
+	this->head = (this->head + 1) % NUM_BUFFERS;
+	this->in_flight++;
+	return true;
+}
+
+bool FrameReadback::poll(sFrame& frame)
+{
+	if (!this->in_flight)
+		return false;
+
+	sRead& read = this->reads[this->tail];
+	GLenum result = glClientWaitSync(read.fence, 0, 0);
+	if (result != GL_ALREADY_SIGNALED && result != GL_CONDITION_SATISFIED)
+		return false;
+
+	auto start = std::chrono::steady_clock::now();
+	size_t size = (size_t)read.width * read.height * 4;
+
+	frame.frame = read.frame;
+	frame.width = read.width;
+	frame.height = read.height;
+	frame.format = read.format;
+
+	// Reuse the storage of a recycled frame
+	if (frame.pixels.capacity() < size) {
+		std::lock_guard<std::mutex> lock(this->pool_mutex);
+		for (size_t i = 0; i < this->pool.size(); i++) {
+			if (this->pool[i].capacity() >= size) {
+				frame.pixels.swap(this->pool[i]);
+				this->pool.erase(this->pool.begin() + i);
+				break;
+			}
+		}
+	}
+	frame.pixels.resize(size);
+
+	// The fence has signaled, mapping does not wait
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, read.pbo);
+	void* ptr = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+	if (ptr) {
+		memcpy(frame.pixels.data(), ptr, size);
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	glDeleteSync(read.fence);
+	read.fence = 0;
+	this->tail = (this->tail + 1) % NUM_BUFFERS;
+	this->in_flight--;
+
+	this->copy_ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+	if (!ptr) {
+		std::cout << "[ERROR]: Cannot map readback buffer" << std::endl;
+		return false;
+	}
+
+	this->completed++;
+	return true;
+}
+
+void FrameReadback::flush()
+{
+	for (int i = 0; i < this->in_flight; i++) {
+		sRead& read = this->reads[(this->tail + i) % NUM_BUFFERS];
+		glClientWaitSync(read.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+	}
+}
+
+void FrameReadback::recycle(sFrame& frame)
+{
+	if (frame.pixels.capacity() == 0)
+		return;
+
+	std::lock_guard<std::mutex> lock(this->pool_mutex);
+	if (this->pool.size() < NUM_BUFFERS * 2)
+		this->pool.push_back(std::move(frame.pixels));
+	frame.pixels = std::vector<uint8_t>();
+}
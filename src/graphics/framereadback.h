@@ -0,0 +1,69 @@
+#pragma once
+
+#include "../framework/includes.h"
+#include <vector>
+#include <mutex>
+#include <cstdint>
+
+// Reads the framebuffer back without stalling: glReadPixels goes to a pixel pack buffer and returns at once,
+// the frame is mapped NUM_BUFFERS - 1 frames later, when its fence has signaled. The pixels are copied to
+// pooled host buffers that can be handed to other threads and recycled from any of them.
+// Rows are bottom-up, like glReadPixels.
+class FrameReadback
+{
+public:
+	enum eFormat { RGBA8, RGB10A2, DEPTH32F }; // 4 bytes per pixel all of them
+
+	static const int NUM_BUFFERS = 3; // frame N is read while N-1 and N-2 are in flight
+
+	struct sFrame {
+		int frame = -1; // as passed to request
+		int width = 0;
+		int height = 0;
+		eFormat format = RGBA8;
+		std::vector<uint8_t> pixels;
+	};
+
+	eFormat format; // of the next requests
+
+	// Stats
+	int requested = 0;
+	int completed = 0;
+	int dropped = 0; // requests with every buffer still in flight
+	float copy_ms = 0.f; // map and copy of the last completed frame
+
+	FrameReadback(eFormat format = RGBA8);
+	~FrameReadback();
+
+	// Render thread, after drawing: starts reading the region of the current read framebuffer.
+	// width or height 0 reads the viewport. Returns false (dropped) when every buffer is still in flight
+	bool request(int frame, int x = 0, int y = 0, int width = 0, int height = 0);
+	// Render thread: oldest completed read, false if the next one is not done yet
+	bool poll(sFrame& frame);
+	// Waits for every read in flight (they can be polled after)
+	void flush();
+	// Gives the pixels of a polled frame back to the pool, thread safe
+	void recycle(sFrame& frame);
+	int getInFlight() const { return this->in_flight; }
+
+	static const char* GetFormatName(eFormat format);
+
+private:
+	struct sRead {
+		GLuint pbo = 0;
+		size_t capacity = 0;
+		GLsync fence = 0;
+		int frame = -1;
+		eFormat format = RGBA8;
+		int width = 0;
+		int height = 0;
+	};
+
+	sRead reads[NUM_BUFFERS];
+	int head = 0; // next buffer to read into
+	int tail = 0; // oldest read in flight
+	int in_flight = 0;
+
+	std::vector<std::vector<uint8_t>> pool;
+	std::mutex pool_mutex;
+};
@@ -0,0 +1,76 @@
+#include "lightbuffer.h"
+
+#include "shader.h"
+#include "mesh.h"
+#include "../framework/light.h"
+
+#include <algorithm>
+
+LightBuffer::LightBuffer() { }
+
+LightBuffer::~LightBuffer()
+{
+	if (this->ubo)
+		glDeleteBuffers(1, &this->ubo);
+}
+
+LightBuffer* LightBuffer::Get()
+{
+	static LightBuffer* buffer = new LightBuffer();
+	return buffer;
+}
+
+void LightBuffer::update(const std::vector<Light*>& lights)
+{
+	if (!this->ubo) {
+		glGenBuffers(1, &this->ubo);
+		glBindBuffer(GL_UNIFORM_BUFFER, this->ubo);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(this->lights), NULL, GL_DYNAMIC_DRAW);
+	}
+
+	this->num_lights = std::min((int)lights.size(), MAX_LIGHTS);
+	if ((int)lights.size() > MAX_LIGHTS) {
+		static bool warned = false;
+		if (!warned) std::cout << "[ERROR]: More than " << MAX_LIGHTS << " lights, the rest are ignored" << std::endl;
+		warned = true;
+	}
+
+	for (int i = 0; i < this->num_lights; i++) {
+		Light* light = lights[i];
+		this->lights[i].position = glm::vec4(glm::vec3(light->model[3]), light->radius);
+		this->lights[i].color = glm::vec4(glm::vec3(light->material->color) * light->intensity, 1.f);
+	}
+
+	glBindBuffer(GL_UNIFORM_BUFFER, this->ubo);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, this->num_lights * sizeof(sLightData), this->lights);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+	// Nothing else uses the binding point, the programs are linked to it in Shader::compile
+	glBindBufferBase(GL_UNIFORM_BUFFER, Shader::LIGHTS_BINDING, this->ubo);
+}
+
+int LightBuffer::setUniforms(Shader* shader, Mesh* mesh, const glm::mat4& model)
+{
+	BoundingBox box = transformBoundingBox(model, mesh->box);
+	glm::vec3 box_min = box.center - box.halfsize;
+	glm::vec3 box_max = box.center + box.halfsize;
+
+	// Sphere against box: distance from the light to the closest point of the box
+	int indices[MAX_LIGHTS];
+	int count = 0;
+	for (int i = 0; i < this->num_lights; i++) {
+		glm::vec3 position = glm::vec3(this->lights[i].position);
+		float radius = this->lights[i].position.w;
+
+		glm::vec3 closest = glm::clamp(position, box_min, box_max);
+		glm::vec3 d = position - closest;
+		if (radius <= 0.f || glm::dot(d, d) <= radius * radius)
+			indices[count++] = i;
+	}
+
+	shader->setUniform("u_num_lights", count);
+	if (count)
+		shader->setUniform1Array("u_light_indices", indices, count);
+
+	return count;
+}
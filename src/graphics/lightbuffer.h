@@ -0,0 +1,42 @@
+#pragma once
+
+#include "../framework/includes.h"
+#include <vector>
+
+#include <glm/vec4.hpp>
+#include <glm/mat4x4.hpp>
+
+class Light;
+class Mesh;
+class Shader;
+
+// All the lights of the scene in one std140 uniform buffer (block "Lights"), uploaded once per frame.
+// Every draw gets the indices of the lights whose influence sphere touches its world bounding box,
+// so the shaders handle any number of lights in a single pass and only pay for the ones that reach the node.
+class LightBuffer
+{
+public:
+	static const int MAX_LIGHTS = 16; // same as MAX_LIGHTS in the shaders
+
+	int num_lights = 0; // in the buffer, light_list order
+
+	LightBuffer();
+	~LightBuffer();
+
+	// Shared by every material
+	static LightBuffer* Get();
+
+	void update(const std::vector<Light*>& lights);
+
+	// Uploads u_num_lights / u_light_indices, returns the number of lights affecting the node
+	int setUniforms(Shader* shader, Mesh* mesh, const glm::mat4& model);
+
+private:
+	struct sLightData {
+		glm::vec4 position; // world, w: radius (0 reaches everything)
+		glm::vec4 color; // rgb * intensity
+	};
+
+	GLuint ubo = 0;
+	sLightData lights[MAX_LIGHTS];
+};
@@ -0,0 +1,106 @@
+#include "lightvolume.h"
+
+#include "fbo.h"
+#include "texture.h"
+#include "shader.h"
+#include "mesh.h"
+#include "material.h"
+#include "volumesequence.h"
+#include "../framework/light.h"
+
+#include <chrono>
+
+bool LightVolume::sState::operator==(const sState& o) const
+{
+	return local_light_position == o.local_light_position && box_min == o.box_min && box_max == o.box_max &&
+		volume_type == o.volume_type && absorption == o.absorption && scattering == o.scattering &&
+		step_length == o.step_length && noise_scale == o.noise_scale && density == o.density && frame == o.frame;
+}
+
+LightVolume::LightVolume(int resolution)
+{
+	this->resolution = resolution;
+}
+
+LightVolume::~LightVolume()
+{
+	if (this->fbo)
+		delete this->fbo;
+	if (this->texture)
+		delete this->texture;
+}
+
+bool LightVolume::update(VolumeMaterial* material, Mesh* mesh, const glm::mat4& model, Light* light)
+{
+	glm::vec3 light_position = glm::vec3(light->model[3][0], light->model[3][1], light->model[3][2]);
+	glm::vec4 local = glm::inverse(model) * glm::vec4(light_position, 1.f);
+
+	sState current;
+	current.local_light_position = glm::vec3(local.x, local.y, local.z) / local.w;
+	current.box_min = mesh->aabb_min;
+	current.box_max = mesh->aabb_max;
+	current.volume_type = material->volume_type;
+	current.absorption = material->absorption_coefficient;
+	current.scattering = material->scattering_coefficient;
+	current.step_length = material->step_length;
+	current.noise_scale = material->volume_type == 1 ? material->noise_scale : 0.f;
+	current.density = material->sparse ? (const void*)material->sparse : (const void*)material->texture;
+	current.frame = material->sequence ? material->sequence->current_frame : -1;
+
+	if (this->valid && current == this->state)
+		return true;
+
+	if (!this->texture) {
+		this->texture = new Texture();
+		this->texture->create3D(this->resolution, this->resolution, this->resolution, GL_RED, GL_FLOAT, false, (float*)NULL, GL_R16F);
+		this->fbo = new FBO();
+	}
+
+	// Same density variant as the material
+	this->shader = Shader::Get("res/shaders/quad.vs", "res/shaders/light_volume.fs", material->getShaderMacros().c_str());
+
+	if (!this->shader)
+		return false;
+
+	auto start = std::chrono::steady_clock::now();
+
+	// Plain overwrite of every texel
+	GLboolean depth_test = glIsEnabled(GL_DEPTH_TEST);
+	GLboolean cull_face = glIsEnabled(GL_CULL_FACE);
+	GLboolean blend = glIsEnabled(GL_BLEND);
+	glDisable(GL_DEPTH_TEST);
+	glDisable(GL_CULL_FACE);
+	glDisable(GL_BLEND);
+
+	this->shader->enable();
+	material->setDensityUniforms(this->shader, mesh);
+	this->shader->setUniform("u_local_light_position", current.local_light_position);
+
+	Mesh* quad = Mesh::getQuad();
+	bool ok = true;
+	for (int z = 0; z < this->resolution && ok; z++) {
+		ok = this->fbo->setTextureLayer(this->texture, z);
+		this->fbo->bind();
+		this->shader->setUniform("u_slice", (z + 0.5f) / this->resolution);
+		quad->render(GL_TRIANGLES);
+		this->fbo->unbind();
+	}
+
+	this->shader->disable();
+
+	if (depth_test) glEnable(GL_DEPTH_TEST);
+	if (cull_face) glEnable(GL_CULL_FACE);
+	if (blend) glEnable(GL_BLEND);
+
+	this->build_time = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+	this->state = current;
+	this->valid = ok;
+	this->rebuilds++;
+
+	return this->valid;
+}
+
+void LightVolume::renderInMenu()
+{
+	ImGui::Text("Light volume: %d^3, %d rebuilds, last %.2f ms", this->resolution, this->rebuilds, this->build_time);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "../framework/includes.h"
+
+#include <glm/vec3.hpp>
+#include <glm/matrix.hpp>
+
+class Texture;
+class FBO;
+class Shader;
+class Mesh;
+class Light;
+class VolumeMaterial;
+
+// Transmittance from the light to every point of the volume box, stored in a 3D texture so the
+// single scattering march does one fetch per step instead of a secondary ray.
+// Rendered on the GPU one slice at a time, and only when the light, density or coefficients change.
+class LightVolume
+{
+public:
+	Texture* texture = NULL;
+	int resolution;
+	bool valid = false;
+
+	// Stats
+	int rebuilds = 0;
+	float build_time = 0.f; // ms, CPU time to issue the slices
+
+	LightVolume(int resolution = 64);
+	~LightVolume();
+
+	// Returns true when the texture is ready to be used
+	bool update(VolumeMaterial* material, Mesh* mesh, const glm::mat4& model, Light* light);
+	void renderInMenu();
+
+private:
+	// Everything the transmittance depends on
+	struct sState {
+		glm::vec3 local_light_position;
+		glm::vec3 box_min;
+		glm::vec3 box_max;
+		int volume_type = -1;
+		float absorption = 0.f;
+		float scattering = 0.f;
+		float step_length = 0.f;
+		float noise_scale = 0.f;
+		const void* density = NULL; // texture or sparse grid
+		int frame = -1; // animated sequences
+		bool operator==(const sState& o) const;
+	};
+
+	sState state;
+	FBO* fbo = NULL;
+	Shader* shader = NULL;
+};
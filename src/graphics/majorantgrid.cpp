@@ -0,0 +1,88 @@
+#include "majorantgrid.h"
+
+#include "texture.h"
+#include "shader.h"
+#include "sparsevolume.h"
+
+#include <algorithm>
+
+MajorantGrid::MajorantGrid() { }
+
+MajorantGrid::~MajorantGrid()
+{
+	if (this->texture)
+		delete this->texture;
+}
+
+void MajorantGrid::build(const float* data, int resolution, int cell)
+{
+	this->dims = glm::ivec3((resolution + cell - 1) / cell);
+	this->cell_size = glm::vec3((float)cell / resolution);
+	this->values.assign((size_t)this->dims.x * this->dims.y * this->dims.z, 0.f);
+
+	// Every voxel raises the cells it is in and, because the sampler filters across cell borders,
+	// the cells its neighbours are in
+	for (int z = 0; z < resolution; z++) {
+		for (int y = 0; y < resolution; y++) {
+			for (int x = 0; x < resolution; x++) {
+				float value = std::clamp(data[x + resolution * (y + resolution * z)], 0.f, 1.f);
+				if (value <= 0.f)
+					continue;
+
+				glm::ivec3 lo = glm::max(glm::ivec3(x - 1, y - 1, z - 1) / cell, glm::ivec3(0));
+				glm::ivec3 hi = glm::min(glm::ivec3(x + 1, y + 1, z + 1) / cell, this->dims - 1);
+				for (int k = lo.z; k <= hi.z; k++)
+					for (int j = lo.y; j <= hi.y; j++)
+						for (int i = lo.x; i <= hi.x; i++) {
+							float& m = this->values[i + this->dims.x * (j + this->dims.y * k)];
+							m = std::max(m, value);
+						}
+			}
+		}
+	}
+
+	upload();
+}
+
+void MajorantGrid::build(SparseVolume* sparse)
+{
+	const int D = SparseVolume::INTERNAL_DIM;
+	this->dims = (sparse->dims + SparseVolume::LEAF_DIM - 1) / SparseVolume::LEAF_DIM;
+	this->cell_size = glm::vec3((float)SparseVolume::LEAF_DIM) / glm::vec3(sparse->dims); // one leaf
+	this->values.assign((size_t)this->dims.x * this->dims.y * this->dims.z, 0.f);
+
+	// Voxels are fetched without filtering, the max of the leaf is enough
+	for (int n = 0; n < (int)sparse->root.size(); n++) {
+		if (sparse->root[n] == SparseVolume::EMPTY)
+			continue;
+		glm::ivec3 node(n % sparse->root_dims.x, (n / sparse->root_dims.x) % sparse->root_dims.y, n / (sparse->root_dims.x * sparse->root_dims.y));
+		const uint32_t* children = &sparse->internal_nodes[(size_t)sparse->root[n] * SparseVolume::INTERNAL_SIZE + 2];
+
+		for (int c = 0; c < SparseVolume::INTERNAL_CHILDREN; c++) {
+			glm::ivec3 leaf = node * D + glm::ivec3(c % D, (c / D) % D, c / (D * D));
+			if (children[c] == SparseVolume::EMPTY || leaf.x >= this->dims.x || leaf.y >= this->dims.y || leaf.z >= this->dims.z)
+				continue;
+
+			const uint8_t* voxels = &sparse->leaves[(size_t)children[c] * SparseVolume::LEAF_SIZE];
+			uint8_t max_value = *std::max_element(voxels, voxels + SparseVolume::LEAF_SIZE);
+			this->values[leaf.x + this->dims.x * (leaf.y + this->dims.y * leaf.z)] = max_value / 255.f;
+		}
+	}
+
+	upload();
+}
+
+void MajorantGrid::upload()
+{
+	// Full float, a rounded down bound would bias the estimators
+	if (!this->texture)
+		this->texture = new Texture();
+	this->texture->create3D(this->dims.x, this->dims.y, this->dims.z, GL_RED, GL_FLOAT, false, this->values.data(), GL_R32F);
+}
+
+void MajorantGrid::setUniforms(Shader* shader, int slot)
+{
+	shader->setUniform("u_majorant", this->texture, slot);
+	shader->setUniform3("u_majorant_dims", this->dims.x, this->dims.y, this->dims.z);
+	shader->setUniform("u_majorant_cell_size", this->cell_size);
+}
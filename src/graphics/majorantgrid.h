@@ -0,0 +1,35 @@
+#pragma once
+
+#include "../framework/includes.h"
+#include <vector>
+
+#include <glm/vec3.hpp>
+
+class Texture;
+class Shader;
+class SparseVolume;
+
+// Coarse upper bound of the density (max per cell) for delta and ratio tracking. Tentative collisions
+// are drawn with the bound of the cell they are in, so empty cells are crossed without a single lookup
+// and thin regions take long steps.
+class MajorantGrid
+{
+public:
+	glm::ivec3 dims = glm::ivec3(0);
+	glm::vec3 cell_size = glm::vec3(1.f); // extent of a cell over the box, the last cells can go past it
+	std::vector<float> values;
+	Texture* texture = NULL;
+
+	MajorantGrid();
+	~MajorantGrid();
+
+	// Cells of cell^3 voxels of a dense grid, values are clamped to [0, 1] like the R8 texture
+	void build(const float* data, int resolution, int cell);
+	// One cell per leaf of the sparse grid
+	void build(SparseVolume* sparse);
+
+	void setUniforms(Shader* shader, int slot);
+
+private:
+	void upload();
+};
@@ -1,12 +1,36 @@
 #include "material.h"
 
 #include "application.h"
+#include "volumesequence.h"
+#include "sparsevolume.h"
+#include "noisevolume.h"
+#include "lightvolume.h"
+#include "transferfunction.h"
+#include "fbo.h"
+#include "accumulationbuffer.h"
+#include "raysetup.h"
+#include "lightbuffer.h"
+#include "majorantgrid.h"
 
 #include <istream>
 #include <fstream>
 #include <algorithm>
 #include "ImGuizmo.h"
 
+void Material::setSceneDepthUniforms(Camera* camera)
+{
+	// Opaques are drawn first into Application::scene_fbo, without it nothing is clipped
+	FBO* scene = Application::instance->scene_fbo;
+	Texture* depth = scene && scene->depth_texture ? scene->depth_texture : Texture::getWhiteTexture();
+
+	// Size of the current target, the volumes may be drawn at a lower resolution than the scene
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+
+	this->shader->setUniform("u_scene_depth", depth, 7);
+	this->shader->setUniform("u_viewport_size", glm::vec2(viewport[2], viewport[3]));
+}
+
 FlatMaterial::FlatMaterial(glm::vec4 color)
 {
 	this->color = color;
@@ -17,9 +41,7 @@ FlatMaterial::~FlatMaterial() { }
 
 void FlatMaterial::setUniforms(Camera* camera, glm::mat4 model)
 {
-	// Upload node uniforms
-	this->shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-	this->shader->setUniform("u_camera_position", camera->eye);
+	// Upload node uniforms, the camera is in the Frame block
 	this->shader->setUniform("u_model", model);
 
 	this->shader->setUniform("u_color", this->color);
@@ -89,9 +111,7 @@ StandardMaterial::~StandardMaterial() { }
 
 void StandardMaterial::setUniforms(Camera* camera, glm::mat4 model)
 {
-	// Upload node uniforms
-	this->shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-	this->shader->setUniform("u_camera_position", camera->eye);
+	// Upload node uniforms, the camera is in the Frame block
 	this->shader->setUniform("u_model", model);
 
 	this->shader->setUniform("u_color", this->color);
@@ -103,44 +123,19 @@ void StandardMaterial::setUniforms(Camera* camera, glm::mat4 model)
 
 void StandardMaterial::render(Mesh* mesh, glm::mat4 model, Camera* camera)
 {
-	bool first_pass = true;
 	if (mesh && this->shader)
 	{
 		// Enable shader
 		this->shader->enable();
 
-		// Multi pass render
-		int num_lights = (int)Application::instance->light_list.size();
-		for (int nlight = -1; nlight < num_lights; nlight++)
-		{
-			if (nlight == -1) { nlight++; } // hotfix
-
-			// Upload uniforms
-			setUniforms(camera, model);
-
-			// Upload light uniforms
-			if (!first_pass) {
-				glBlendFunc(GL_SRC_ALPHA, GL_ONE);
-				glDepthFunc(GL_LEQUAL);
-			}
-			this->shader->setUniform("u_ambient_light", Application::instance->ambient_light * (float)first_pass);
+		// Upload uniforms
+		setUniforms(camera, model);
 
-			if (num_lights > 0) {
-				Light* light = Application::instance->light_list[nlight];
-				light->setUniforms(this->shader, model);
-			}
-			else {
-				// Set some uniforms in case there is no light
-				this->shader->setUniform("u_light_intensity", 1.f);
-				this->shader->setUniform("u_light_shininess", 1.f);
-				this->shader->setUniform("u_light_color", glm::vec4(0.f));
-			}
+		// Every light that reaches the node, in a single pass
+		LightBuffer::Get()->setUniforms(this->shader, mesh, model);
 
-			// Do the draw call
-			mesh->render(GL_TRIANGLES);
-            
-			first_pass = false;
-		}
+		// Do the draw call
+		mesh->render(GL_TRIANGLES);
 
 		// Disable shader
 		this->shader->disable();
@@ -163,6 +158,13 @@ void StandardMaterial::renderInMenu()
 	if (!this->show_normals) ImGui::ColorEdit3("Color", (float*)&this->color);
 }
 
+// One per shader_type
+static const char* volume_shaders[] = {
+	"res/shaders/volume.fs",
+	"res/shaders/volume_emission.fs",
+	"res/shaders/volume_emission_scattering.fs"
+};
+
 VolumeMaterial::VolumeMaterial(glm::vec4 color, float absorption, float scattering, int volume_type)
 {
     this->color = color;
@@ -170,249 +172,668 @@ VolumeMaterial::VolumeMaterial(glm::vec4 color, float absorption, float scatteri
     this->scattering_coefficient = scattering;
     this->volume_type = volume_type;
 
-    // We use a specific shader for volume rendering
-	if (this->shader_type == 0) {
-		this->shader = Shader::Get("res/shaders/basic.vs", "res/shaders/volume.fs");
-	}
-	else if (this->shader_type == 1) {
-		this->shader = Shader::Get("res/shaders/basic.vs", "res/shaders/volume_emission.fs");
-	}
+    // We use a specific shader for volume rendering, render() picks the variant for the current settings
+	this->shader = Shader::Get("res/shaders/quad.vs", volume_shaders[this->shader_type], getShaderMacros().c_str());
 }
 
-VolumeMaterial::~VolumeMaterial() { }
+VolumeMaterial::~VolumeMaterial()
+{
+	if (this->sequence)
+		delete this->sequence;
+	if (this->sparse)
+		delete this->sparse;
+	if (this->noise)
+		delete this->noise;
+	if (this->light_volume)
+		delete this->light_volume;
+	if (this->stats_fbo)
+		delete this->stats_fbo;
+	if (this->accumulation)
+		delete this->accumulation;
+	if (this->ray_setup)
+		delete this->ray_setup;
+	if (this->hull)
+		delete this->hull;
+	if (this->majorant)
+		delete this->majorant;
+}
 
 void VolumeMaterial::setUniforms(Mesh* mesh, Camera* camera, glm::mat4 model)
 {
-    // Base class uniforms
-    this->shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-    this->shader->setUniform("u_camera_position", camera->eye);
+    // Base class uniforms, the camera is in the Frame block
     this->shader->setUniform("u_model", model);
-	this->shader->setUniform("u_box_min", mesh->aabb_min);
-	this->shader->setUniform("u_box_max", mesh->aabb_max);
+	this->shader->setUniform("u_inv_model", glm::inverse(model));
+
+	// Scalar parameters in one block, uploaded again only when one of them changes
+	sMaterialBlock data = {};
+	data.color = this->color;
+	data.box_min = mesh->aabb_min;
+	data.absorption_coefficient = this->absorption_coefficient;
+	data.box_max = mesh->aabb_max;
+	data.scattering_coefficient = this->scattering_coefficient;
+	data.step_length = this->step_length;
+	data.noise_scale = this->noise_scale;
+	data.g_value = this->g_value;
+	data.min_transmittance = this->min_transmittance; // early termination
+	data.max_step_scale = getMaxStepScale(); // adaptive stepping
+
+	UniformRing* ring = UniformRing::Get();
+	if (!ring->isValid(this->block) || memcmp(&data, &this->block_data, sizeof(data)) != 0) {
+		this->block = ring->upload(&data, sizeof(data));
+		this->block_data = data;
+	}
+	ring->bind(this->block, Shader::MATERIAL_BINDING);
 
-    this->shader->setUniform("u_color", this->color);
+	setSceneDepthUniforms(camera);
+	this->ray_setup->setUniforms(this->shader, 8);
+	setDensityUniforms(this->shader, mesh);
 
-    // Extra uniform for absorption
-    this->shader->setUniform("u_absorption_coefficient", this->absorption_coefficient);
+	LightBuffer::Get()->setUniforms(this->shader, mesh, model);
 
-	// Extra uniform for scattering
-	this->shader->setUniform("u_scattering_coefficient", this->scattering_coefficient);
+	// Jittered first sample (JITTER variant), the pattern moves every accumulated frame
+	if (this->jitter) {
+		this->shader->setUniform("u_blue_noise", Texture::getBlueNoiseTexture(), 6);
+		this->shader->setUniform("u_frame_offset", this->progressive && this->accumulation ? this->accumulation->getFrameOffset() : 0.f);
+	}
+
+	// Stochastic integration, a new random sequence every accumulated frame
+	if (useDeltaTracking()) {
+		this->shader->setUniform("u_frame_index", this->accumulation ? this->accumulation->num_frames : 0);
+		if (this->volume_type == 2)
+			this->majorant->setUniforms(this->shader, 10);
+	}
+
+	// Precomputed shadowing toward the light (Complete Model only)
+	if (isLightVolumeReady()) {
+		this->shader->setUniform("u_light_transmittance", this->light_volume->texture, 5);
+	}
+}
+
+// Everything needed to evaluate the density, shared with the light volume pass (the volume shaders
+// read the scalars from the Material block instead)
+void VolumeMaterial::setDensityUniforms(Shader* shader, Mesh* mesh)
+{
+	shader->setUniform("u_box_min", mesh->aabb_min);
+	shader->setUniform("u_box_max", mesh->aabb_max);
 
-	// Background color uniform
-	this->shader->setUniform("u_background_color", Application::instance->background_color);
+    // Extra uniform for absorption
+    shader->setUniform("u_absorption_coefficient", this->absorption_coefficient);
 
-	// Volume type uniform
-	this->shader->setUniform("u_volume_type", this->volume_type);
+	// Extra uniform for scattering
+	shader->setUniform("u_scattering_coefficient", this->scattering_coefficient);
 
 	// Step length uniform
-	this->shader->setUniform("u_step_length", this->step_length);
+	shader->setUniform("u_step_length", this->step_length);
 
 	// Noise properties for heterogeneous volumes
-	this->shader->setUniform("noise_scale", this->noise_scale);
+	shader->setUniform("noise_scale", this->noise_scale);
+
+	// Baked noise (BAKED_NOISE variant)
+	if (this->noise_ready) {
+		shader->setUniform("u_noise_texture", this->noise->texture, 4);
+	}
 
-	Light* light = Application::instance->light_list[0];
-	light->setUniforms(this->shader, model);
 	// Set texture only if it exists
 	if (this->texture) {
-		this->shader->setUniform("u_texture", this->texture, 0);
+		shader->setUniform("u_texture", this->texture, 0);
+	}
+
+	// Sparse VDB tables go after the dense texture (SPARSE_GRID variant)
+	if (this->sparse) {
+		this->sparse->setUniforms(shader, 1);
+	}
+}
+
+std::string VolumeMaterial::getShaderMacros(bool light_volume_ready)
+{
+	// Only the code path in use gets compiled, instead of branching on uniforms per sample
+	std::string macros = "#define VOLUME_TYPE " + std::to_string(this->volume_type) + "\n";
+	if (this->volume_type == 1 && this->noise_ready)
+		macros += "#define BAKED_NOISE\n";
+	if (this->volume_type == 2 && this->sparse)
+		macros += "#define SPARSE_GRID\n";
+	if (light_volume_ready)
+		macros += "#define LIGHT_VOLUME\n";
+	if (this->jitter)
+		macros += "#define JITTER\n";
+	if (useDeltaTracking()) {
+		macros += "#define DELTA_TRACKING\n";
+		if (this->volume_type == 2)
+			macros += "#define MAJORANT_GRID\n";
+	}
+	return macros;
+}
+
+bool VolumeMaterial::isLightVolumeReady()
+{
+	return this->shader_type == 2 && this->use_light_volume && this->light_volume && this->light_volume->valid && !useDeltaTracking();
+}
+
+// Homogeneous and noise volumes are bounded by the coefficients alone, VDB volumes need the grid
+bool VolumeMaterial::useDeltaTracking()
+{
+	return this->delta_tracking && this->shader_type == 2 && (this->volume_type != 2 || this->majorant);
+}
+
+// Per frame work before drawing, MultiVolume::render calls it once for every visible volume, batched or not
+void VolumeMaterial::update(Mesh* mesh, glm::mat4 model)
+{
+	// Animated volumes swap the texture content when the next frame is ready
+	if (this->sequence)
+		this->sequence->update(glfwGetTime());
+
+	// Baked noise, snoise is still evaluated per step while the first bake is running
+	this->noise_ready = false;
+	if (mesh && this->volume_type == 1 && this->baked_noise) {
+		if (!this->noise)
+			this->noise = new NoiseVolume();
+		this->noise_ready = this->noise->update(this->noise_scale, mesh->aabb_min, mesh->aabb_max);
+	}
+
+	// Shadowing toward the light, only recomputed when something it depends on changed
+	if (mesh && this->shader_type == 2 && this->use_light_volume && !useDeltaTracking() && !Application::instance->light_list.empty()) {
+		if (!this->light_volume)
+			this->light_volume = new LightVolume();
+		this->light_volume->update(this, mesh, model, Application::instance->light_list[0]);
 	}
+}
 
-	this->shader->setUniform("g_value", this->g_value);
+// Only what the interleaved march of MultiVolume supports: no scattering, no sparse traversal, no accumulation,
+// no tight hull (the batch marches the whole box)
+bool VolumeMaterial::canBatch()
+{
+	return this->shader_type < 2 && !this->sparse && !this->progressive && !this->show_stats && (this->volume_type != 1 || this->noise_ready) &&
+		!(this->volume_type == 2 && this->use_hull && !this->occupancy.empty());
 }
 
 void VolumeMaterial::render(Mesh* mesh, glm::mat4 model, Camera* camera)
 {
+	// Compiled the first time a combination is used, then cached by Shader::Get
+	std::string macros = getShaderMacros(isLightVolumeReady());
+	this->shader = Shader::Get("res/shaders/quad.vs", volume_shaders[this->shader_type], macros.c_str());
+
 	if (mesh && this->shader) {
-		// Enable shader
-		this->shader->enable();
+		// Entry and exit points at the resolution of the current target, the march is a full screen pass
+		if (!this->ray_setup)
+			this->ray_setup = new RaySetup();
+		this->ray_setup->render(getProxy(mesh), model, camera);
+
+		// Delta tracking takes one path per pixel and frame, it only converges when accumulated
+		if (isAccumulating()) {
+			renderProgressive(mesh, model, camera);
+		}
+		else {
+			// Enable shader
+			this->shader->enable();
 
-		// Upload uniforms
-		setUniforms(mesh, camera, model);
+			// Upload uniforms
+			setUniforms(mesh, camera, model);
 
-		// Do the draw call
-		mesh->render(GL_TRIANGLES);
+			// Do the draw call
+			Mesh::getQuad()->render(GL_TRIANGLES);
+
+			this->shader->disable();
+		}
 
+		if (this->show_stats)
+			updateStats(mesh, model, camera);
+	}
+}
+
+// Averages jittered frames into the accumulation buffer and composites the result over the scene
+void VolumeMaterial::renderProgressive(Mesh* mesh, glm::mat4 model, Camera* camera)
+{
+	if (!this->accumulation)
+		this->accumulation = new AccumulationBuffer();
+
+	// Restart when anything the image depends on changes, or while a widget is being dragged
+	std::vector<float> state = getAccumulationState(model, camera);
+	if (state != this->accumulation_state || ImGui::IsAnyItemActive()) {
+		this->accumulation->reset();
+		this->accumulation_state = state;
+	}
+
+	// Same resolution as the target the volumes are drawn to
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+
+	if (this->accumulation->begin(viewport[2], viewport[3])) {
+		this->shader->enable();
+		setUniforms(mesh, camera, model);
+		Mesh::getQuad()->render(GL_TRIANGLES);
 		this->shader->disable();
+
+		this->accumulation->end();
+	}
+
+	this->accumulation->draw();
+
+	// Depth of the proxy geometry, the upsample pass tests it against the opaque scene
+	Shader* depth_shader = Shader::Get("res/shaders/basic.vs", "res/shaders/flat.fs");
+	if (depth_shader) {
+		glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+		depth_shader->enable();
+		depth_shader->setUniform("u_model", model);
+		depth_shader->setUniform("u_color", this->color);
+		getProxy(mesh)->render(GL_TRIANGLES);
+		depth_shader->disable();
+		glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
 	}
 }
 
-void VolumeMaterial::renderInMenu()
+std::vector<float> VolumeMaterial::getAccumulationState(glm::mat4 model, Camera* camera)
 {
-	if (ImGui::Combo("Shader Type", &this->shader_type, "Absorption Only\0Absorption + Emission\0Complete Model\0")) {
-		if (this->shader_type == 0) {
-			this->shader = Shader::Get("res/shaders/basic.vs", "res/shaders/volume.fs");
-		}
-		else if (this->shader_type == 1) {
-			this->shader = Shader::Get("res/shaders/basic.vs", "res/shaders/volume_emission.fs");
-		}
-		else if (this->shader_type == 2) {
-			this->shader = Shader::Get("res/shaders/basic.vs", "res/shaders/volume_emission_scattering.fs");
-		}
+	Application* app = Application::instance;
+
+	std::vector<float> state;
+	auto add = [&](const float* values, int count) { state.insert(state.end(), values, values + count); };
+
+	add(glm::value_ptr(camera->viewprojection_matrix), 16);
+	add(glm::value_ptr(model), 16);
+	add(glm::value_ptr(this->color), 4);
+
+	float params[] = {
+		this->absorption_coefficient, this->scattering_coefficient, this->step_length, this->noise_scale, this->g_value,
+		this->quality, this->min_transmittance, (float)this->volume_type, (float)this->shader_type, (float)this->jitter,
+		(float)useDeltaTracking(),
+		(float)app->window_width, (float)app->window_height,
+		(float)(this->sequence ? this->sequence->current_frame : -1),
+		(float)(this->light_volume ? this->light_volume->rebuilds : 0),
+		(float)(this->noise ? this->noise->bakes : 0)
+	};
+	add(params, sizeof(params) / sizeof(float));
+
+	for (Light* light : app->light_list) {
+		add(glm::value_ptr(light->model), 16);
+		add(glm::value_ptr(light->material->color), 4); // what LightBuffer uploads
+		add(&light->intensity, 1);
+		add(&light->radius, 1);
+	}
+
+	// Opaque nodes clip the rays
+	for (SceneNode* node : app->node_list) {
+		if (node->material && !node->material->isVolume() && node->visible)
+			add(glm::value_ptr(node->model), 16);
+	}
+
+	return state;
+}
+
+// Geometry rasterized by the ray setup, the occupancy hull for VDB volumes and the node mesh otherwise
+Mesh* VolumeMaterial::getProxy(Mesh* mesh)
+{
+	if (this->volume_type != 2 || !this->use_hull || this->occupancy.empty())
+		return mesh;
+
+	if (!this->hull)
+		this->hull = RaySetup::createHull(this->occupancy, this->occupancy_dims, mesh->aabb_min, mesh->aabb_max);
+	return this->hull;
+}
+
+// Draws the volume again into a small float target with the RAY_STATS variant and averages it on the CPU.
+// Stalls the pipeline on the readback, only meant for tuning quality against frame time
+void VolumeMaterial::updateStats(Mesh* mesh, glm::mat4 model, Camera* camera)
+{
+	Shader* shader = Shader::Get("res/shaders/quad.vs", volume_shaders[this->shader_type], (getShaderMacros(isLightVolumeReady()) + "#define RAY_STATS\n").c_str());
+	if (!shader)
+		return;
+
+	// A quarter of the resolution is enough for an average
+	int width = std::max(Application::instance->window_width / 4, 1);
+	int height = std::max(Application::instance->window_height / 4, 1);
+	if (!this->stats_fbo || this->stats_fbo->width != width || this->stats_fbo->height != height) {
+		if (!this->stats_fbo)
+			this->stats_fbo = new FBO();
+		this->stats_fbo->create(width, height, 1, GL_RGBA, GL_FLOAT, false, GL_RGBA32F);
 	}
+
+	GLboolean blend = glIsEnabled(GL_BLEND);
+	GLfloat clear_color[4];
+	glGetFloatv(GL_COLOR_CLEAR_VALUE, clear_color);
+	glDisable(GL_BLEND);
+
+	this->stats_fbo->bind();
+	glClearColor(0.f, 0.f, 0.f, 0.f);
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	Shader* main_shader = this->shader;
+	this->shader = shader;
+	shader->enable();
+	setUniforms(mesh, camera, model);
+	Mesh::getQuad()->render(GL_TRIANGLES);
+	shader->disable();
+	this->shader = main_shader;
+
+	std::vector<float> pixels((size_t)width * height * 4);
+	glReadPixels(0, 0, width, height, GL_RGBA, GL_FLOAT, pixels.data());
+	this->stats_fbo->unbind();
+
+	if (blend) glEnable(GL_BLEND);
+	glClearColor(clear_color[0], clear_color[1], clear_color[2], clear_color[3]);
+
+	double samples = 0.0, rays = 0.0, light_samples = 0.0;
+	for (size_t i = 0; i < pixels.size(); i += 4) {
+		samples += pixels[i];
+		rays += pixels[i + 1];
+		light_samples += pixels[i + 2];
+	}
+	this->avg_samples = rays > 0.0 ? (float)(samples / rays) : 0.f;
+	this->avg_light_samples = rays > 0.0 ? (float)(light_samples / rays) : 0.f;
+}
+
+void VolumeMaterial::renderInMenu()
+{
+	ImGui::Combo("Shader Type", &this->shader_type, "Absorption Only\0Absorption + Emission\0Complete Model\0");
 	ImGui::ColorEdit4("Color", (float*)&this->color);
 	ImGui::SliderFloat("Step Length", &this->step_length, 0.001f, 0.500f);
+	ImGui::SliderFloat("Quality", &this->quality, 0.0f, 1.0f);
+	ImGui::SliderFloat("Early Termination", &this->min_transmittance, 0.0f, 0.1f);
+	ImGui::Checkbox("Ray Stats", &this->show_stats);
+	if (this->show_stats) {
+		ImGui::Text("Samples per ray: %.1f (light: %.1f)", this->avg_samples, this->avg_light_samples);
+	}
+	ImGui::Checkbox("Jitter", &this->jitter);
+	ImGui::Checkbox("Progressive", &this->progressive);
+	if (this->progressive && this->accumulation) {
+		this->accumulation->renderInMenu();
+	}
+	if (!this->occupancy.empty()) {
+		ImGui::Checkbox("Tight Hull", &this->use_hull);
+	}
 	ImGui::SliderFloat("Absorption Coefficient", &this->absorption_coefficient, 0.0f, 5.0f);
 	ImGui::SliderFloat("Scattering Coefficient", &this->scattering_coefficient, 0.0f, 5.0f);
 	ImGui::Combo("Volume Type", &this->volume_type, "Homogeneous\0Heterogeneous\0VDB-based\0");
 	ImGui::SliderFloat("Noise Scale", &this->noise_scale, 0.0f, 10.0f);
+	ImGui::Checkbox("Baked Noise", &this->baked_noise);
+	if (this->noise && this->baked_noise && this->volume_type == 1) {
+		this->noise->renderInMenu();
+	}
 	ImGui::SliderFloat("Scattering Anisotropy (g)", &this->g_value, -1.0f, 1.0f);
+	if (this->shader_type == 2) {
+		ImGui::Checkbox("Delta Tracking", &this->delta_tracking);
+		if (this->delta_tracking && !useDeltaTracking()) {
+			ImGui::Text("No majorant grid for this volume");
+		}
+		ImGui::Checkbox("Light Volume", &this->use_light_volume);
+		if (this->light_volume && this->use_light_volume) {
+			this->light_volume->renderInMenu();
+		}
+	}
+
+	if (this->sparse && ImGui::TreeNode("Sparse Grid")) {
+		this->sparse->renderInMenu();
+		ImGui::TreePop();
+	}
+
+	if (this->sequence && ImGui::TreeNode("VDB Sequence")) {
+		this->sequence->renderInMenu();
+		ImGui::TreePop();
+	}
 }
 
-void VolumeMaterial::loadVDB(std::string file_path)
+void VolumeMaterial::loadVDB(std::string file_path, bool sparse)
 {
 	easyVDB::OpenVDBReader* vdbReader = new easyVDB::OpenVDBReader();
 	vdbReader->read(file_path);
 
+	// Keep the grid tree-shaped, no dense texture at all
+	if (sparse) {
+		if (this->sparse)
+			delete this->sparse;
+
+		this->sparse = new SparseVolume();
+		if (vdbReader->gridsSize == 0 || !this->sparse->build(vdbReader->grids[0])) {
+			std::cout << "[ERROR]: Empty VDB grid in " << file_path << std::endl;
+		}
+
+		// One cell per leaf, only active leaves hold density
+		this->occupancy_dims = (this->sparse->dims + SparseVolume::LEAF_DIM - 1) / SparseVolume::LEAF_DIM;
+		this->occupancy.assign((size_t)this->occupancy_dims.x * this->occupancy_dims.y * this->occupancy_dims.z, 0);
+		for (int n = 0; n < (int)this->sparse->root.size(); n++) {
+			if (this->sparse->root[n] == SparseVolume::EMPTY)
+				continue;
+			glm::ivec3 node(n % this->sparse->root_dims.x, (n / this->sparse->root_dims.x) % this->sparse->root_dims.y, n / (this->sparse->root_dims.x * this->sparse->root_dims.y));
+			const uint32_t* children = &this->sparse->internal_nodes[(size_t)this->sparse->root[n] * SparseVolume::INTERNAL_SIZE + 2];
+			for (int c = 0; c < SparseVolume::INTERNAL_CHILDREN; c++) {
+				glm::ivec3 leaf = node * SparseVolume::INTERNAL_DIM + glm::ivec3(c % SparseVolume::INTERNAL_DIM, (c / SparseVolume::INTERNAL_DIM) % SparseVolume::INTERNAL_DIM, c / (SparseVolume::INTERNAL_DIM * SparseVolume::INTERNAL_DIM));
+				if (children[c] != SparseVolume::EMPTY && leaf.x < this->occupancy_dims.x && leaf.y < this->occupancy_dims.y && leaf.z < this->occupancy_dims.z)
+					this->occupancy[leaf.x + this->occupancy_dims.x * (leaf.y + this->occupancy_dims.y * leaf.z)] = 1;
+			}
+		}
+		if (this->hull) {
+			delete this->hull;
+			this->hull = NULL;
+		}
+
+		if (!this->majorant)
+			this->majorant = new MajorantGrid();
+		this->majorant->build(this->sparse);
+
+		this->volume_type = 2;
+		delete vdbReader;
+		return;
+	}
+
 	// now, read the grid from the vdbReader and store the data in a 3D texture
 	estimate3DTexture(vdbReader);
 }
 
-void VolumeMaterial::estimate3DTexture(easyVDB::OpenVDBReader* vdbReader)
+void VolumeMaterial::loadVDBSequence(std::string folder)
 {
-	int resolution = 128;
-	float radius = 2.0;
+	if (this->sequence)
+		delete this->sequence;
+
+	this->sequence = new VolumeSequence();
+	if (!this->sequence->load(folder)) {
+		delete this->sequence;
+		this->sequence = NULL;
+		return;
+	}
 
-	int convertedGrids = 0;
-	int convertedVoxels = 0;
+	this->texture = this->sequence->texture;
+	this->volume_type = 2;
 
-	int totalGrids = vdbReader->gridsSize;
-	int totalVoxels = totalGrids * pow(resolution, 3);
+	// Frames change under it, a static bound would be wrong
+	if (this->majorant) {
+		delete this->majorant;
+		this->majorant = NULL;
+	}
+}
 
-	float resolutionInv = 1.0f / resolution;
-	int resolutionPow2 = pow(resolution, 2);
+void VolumeMaterial::estimate3DTexture(easyVDB::OpenVDBReader* vdbReader)
+{
+	int resolution = 128;
 	int resolutionPow3 = pow(resolution, 3);
 
+	int totalGrids = vdbReader->gridsSize;
+
 	// read all grids data and convert to texture
 	for (unsigned int i = 0; i < totalGrids; i++) {
 		easyVDB::Grid& grid = vdbReader->grids[i];
 		float* data = new float[resolutionPow3];
-		memset(data, 0, sizeof(float) * resolutionPow3);
-
-		// Bbox
-		easyVDB::Bbox bbox = easyVDB::Bbox();
-		bbox = grid.getPreciseWorldBbox();
-		glm::vec3 target = bbox.getCenter();
-		glm::vec3 size = bbox.getSize();
-		glm::vec3 step = size * resolutionInv;
-
-		grid.transform->applyInverseTransformMap(step);
-		target = target - (size * 0.5f);
-		grid.transform->applyInverseTransformMap(target);
-		target = target + (step * 0.5f);
-
-		int x = 0;
-		int y = 0;
-		int z = 0;
-
-		for (unsigned int j = 0; j < resolutionPow3; j++) {
-			int baseX = x;
-			int baseY = y;
-			int baseZ = z;
-			int baseIndex = baseX + baseY * resolution + baseZ * resolutionPow2;
-
-			if (target.x >= 40 && target.y >= 40.33 && target.z >= 10.36) {
-				int a = 0;
-			}
 
-			float value = grid.getValue(target);
+		voxelizeGrid(grid, resolution, data);
+
+		// now we create the texture with the data
+		// use this: https://www.khronos.org/opengl/wiki/OpenGL_Type
+		// and this: https://registry.khronos.org/OpenGL-Refpages/gl4/html/glTexImage3D.xhtml
+		this->texture = new Texture();
+		this->texture->create3D(resolution, resolution, resolution, GL_RED, GL_FLOAT, false, data, GL_R8);
+
+		// Cells of 4^3 voxels with any density, for the ray setup hull
+		const int cell = 4;
+		this->occupancy_dims = glm::ivec3(resolution / cell);
+		this->occupancy.assign((size_t)this->occupancy_dims.x * this->occupancy_dims.y * this->occupancy_dims.z, 0);
+		for (int v = 0; v < resolutionPow3; v++) {
+			if (data[v] <= 0.f)
+				continue;
+			int x = (v % resolution) / cell, y = ((v / resolution) % resolution) / cell, z = (v / (resolution * resolution)) / cell;
+			this->occupancy[x + this->occupancy_dims.x * (y + this->occupancy_dims.y * z)] = 1;
+		}
+		if (this->hull) {
+			delete this->hull;
+			this->hull = NULL;
+		}
 
-			int cellBleed = radius;
+		// Density bound per cell for delta tracking
+		if (!this->majorant)
+			this->majorant = new MajorantGrid();
+		this->majorant->build(data, resolution, cell);
 
-			if (cellBleed) {
-				for (int sx = -cellBleed; sx < cellBleed; sx++) {
-					for (int sy = -cellBleed; sy < cellBleed; sy++) {
-						for (int sz = -cellBleed; sz < cellBleed; sz++) {
-							if (x + sx < 0.0 || x + sx >= resolution ||
-								y + sy < 0.0 || y + sy >= resolution ||
-								z + sz < 0.0 || z + sz >= resolution) {
-								continue;
-							}
+		delete[] data;
+	}
+}
 
-							int targetIndex = baseIndex + sx + sy * resolution + sz * resolutionPow2;
+// Samples the grid in a resolution^3 lattice covering its world bbox. Only touches CPU memory,
+// so it can be called from worker threads (see VolumeSequence).
+void VolumeMaterial::voxelizeGrid(easyVDB::Grid& grid, int resolution, float* data)
+{
+	float radius = 2.0;
 
-							float offset = std::max(0.0, std::min(1.0, 1.0 - std::hypot(sx, sy, sz) / (radius / 2.0)));
-							float dataValue = offset * value * 255.f;
+	float resolutionInv = 1.0f / resolution;
+	int resolutionPow2 = pow(resolution, 2);
+	int resolutionPow3 = pow(resolution, 3);
 
-							data[targetIndex] += dataValue;
-							data[targetIndex] = std::min((float)data[targetIndex], 255.f);
+	memset(data, 0, sizeof(float) * resolutionPow3);
+
+	// Bbox
+	easyVDB::Bbox bbox = easyVDB::Bbox();
+	bbox = grid.getPreciseWorldBbox();
+	glm::vec3 target = bbox.getCenter();
+	glm::vec3 size = bbox.getSize();
+	glm::vec3 step = size * resolutionInv;
+
+	grid.transform->applyInverseTransformMap(step);
+	target = target - (size * 0.5f);
+	grid.transform->applyInverseTransformMap(target);
+	target = target + (step * 0.5f);
+
+	int x = 0;
+	int y = 0;
+	int z = 0;
+
+	for (unsigned int j = 0; j < resolutionPow3; j++) {
+		int baseX = x;
+		int baseY = y;
+		int baseZ = z;
+		int baseIndex = baseX + baseY * resolution + baseZ * resolutionPow2;
+
+		float value = grid.getValue(target);
+
+		int cellBleed = radius;
+
+		if (cellBleed) {
+			for (int sx = -cellBleed; sx < cellBleed; sx++) {
+				for (int sy = -cellBleed; sy < cellBleed; sy++) {
+					for (int sz = -cellBleed; sz < cellBleed; sz++) {
+						if (x + sx < 0.0 || x + sx >= resolution ||
+							y + sy < 0.0 || y + sy >= resolution ||
+							z + sz < 0.0 || z + sz >= resolution) {
+							continue;
 						}
-					}
-				}
-			}
-			else {
-				float dataValue = value * 255.f;
 
-				data[baseIndex] += dataValue;
-				data[baseIndex] = std::min((float)data[baseIndex], 255.f);
-			}
+						int targetIndex = baseIndex + sx + sy * resolution + sz * resolutionPow2;
 
-			convertedVoxels++;
+						float offset = std::max(0.0, std::min(1.0, 1.0 - std::hypot(sx, sy, sz) / (radius / 2.0)));
+						float dataValue = offset * value * 255.f;
 
-			if (z >= resolution) {
-				break;
+						data[targetIndex] += dataValue;
+						data[targetIndex] = std::min((float)data[targetIndex], 255.f);
+					}
+				}
 			}
+		}
+		else {
+			float dataValue = value * 255.f;
 
-			x++;
-			target.x += step.x;
-
-			if (x >= resolution) {
-				x = 0;
-				target.x -= step.x * resolution;
+			data[baseIndex] += dataValue;
+			data[baseIndex] = std::min((float)data[baseIndex], 255.f);
+		}
 
-				y++;
-				target.y += step.y;
-			}
+		if (z >= resolution) {
+			break;
+		}
 
-			if (y >= resolution) {
-				y = 0;
-				target.y -= step.y * resolution;
+		x++;
+		target.x += step.x;
 
-				z++;
-				target.z += step.z;
-			}
+		if (x >= resolution) {
+			x = 0;
+			target.x -= step.x * resolution;
 
-			// yield
+			y++;
+			target.y += step.y;
 		}
 
-		// now we create the texture with the data
-		// use this: https://www.khronos.org/opengl/wiki/OpenGL_Type
-		// and this: https://registry.khronos.org/OpenGL-Refpages/gl4/html/glTexImage3D.xhtml
-		this->texture = new Texture();
-		this->texture->create3D(resolution, resolution, resolution, GL_RED, GL_FLOAT, false, data, GL_R8);
-    }
+		if (y >= resolution) {
+			y = 0;
+			target.y -= step.y * resolution;
+
+			z++;
+			target.z += step.z;
+		}
+	}
 }
 
 MedicalMaterial::MedicalMaterial(glm::vec4 color)
 {
 	this->color = color;
-	this->shader = Shader::Get("res/shaders/basic.vs", "res/shaders/medical_volume.fs");
+	this->shader = Shader::Get("res/shaders/quad.vs", "res/shaders/medical_volume.fs");
+	this->transfer_function = new TransferFunction();
+}
+
+MedicalMaterial::~MedicalMaterial()
+{
+	delete this->transfer_function;
+	if (this->ray_setup)
+		delete this->ray_setup;
 }
-MedicalMaterial::~MedicalMaterial() { }
 
 void MedicalMaterial::setUniforms(Mesh* mesh, Camera* camera, glm::mat4 model)
 {
-	// Upload node uniforms
-	this->shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-	this->shader->setUniform("u_camera_position", camera->eye);
+	// Upload node uniforms, the camera is in the Frame block
 	this->shader->setUniform("u_model", model);
+	this->shader->setUniform("u_inv_model", glm::inverse(model));
 	this->shader->setUniform("u_box_min", mesh->aabb_min);
 	this->shader->setUniform("u_box_max", mesh->aabb_max);
 	this->shader->setUniform("u_step_length", this->step_length);
-	this->shader->setUniform("u_background_color", Application::instance->background_color);
+	setSceneDepthUniforms(camera);
+	this->ray_setup->setUniforms(this->shader, 8);
 
 	this->shader->setUniform("u_color", this->color);
-	this->shader->setUniform("u_cutoff", this->cutoff);
-	this->shader->setUniform("u_plane", this->plane);
+
+	this->shader->setUniform("u_num_clip_planes", this->num_clip_planes);
+	if (this->num_clip_planes)
+		this->shader->setUniform4Array("u_clip_planes", glm::value_ptr(this->clip_planes[0]), this->num_clip_planes);
+
+	// The shader intersects the unit box, so it gets the inverse of the crop box transform
+	this->shader->setUniform("u_use_crop_box", this->use_crop_box);
+	if (this->use_crop_box) {
+		glm::mat4 crop;
+		ImGuizmo::RecomposeMatrixFromComponents(glm::value_ptr(this->crop_center), glm::value_ptr(this->crop_rotation), glm::value_ptr(this->crop_size), glm::value_ptr(crop));
+		this->shader->setUniform("u_crop_matrix", glm::inverse(crop));
+	}
 
 	// Set texture only if it exists
 	if (this->texture) {
 		this->shader->setUniform("u_texture", this->texture, 0);
 	}
+
+	this->shader->setUniform("u_use_preintegration", this->preintegrated);
+	this->transfer_function->setUniforms(this->shader, 1);
 }
 
 void MedicalMaterial::render(Mesh* mesh, glm::mat4 model, Camera* camera)
 {
+	// Only the entries touched by the last edit (or all of them after a step change)
+	this->transfer_function->update(this->step_length, this->preintegrated);
+
 	if (mesh && this->shader) {
+		// Entry and exit points, then the march as a full screen pass
+		if (!this->ray_setup)
+			this->ray_setup = new RaySetup();
+		this->ray_setup->render(mesh, model, camera);
+
 		// Enable shader
 		this->shader->enable();
 
@@ -420,7 +841,7 @@ void MedicalMaterial::render(Mesh* mesh, glm::mat4 model, Camera* camera)
 		setUniforms(mesh, camera, model);
 
 		// Do the draw call
-		mesh->render(GL_TRIANGLES);
+		Mesh::getQuad()->render(GL_TRIANGLES);
 
 		this->shader->disable();
 	}
@@ -429,9 +850,37 @@ void MedicalMaterial::render(Mesh* mesh, glm::mat4 model, Camera* camera)
 void MedicalMaterial::renderInMenu()
 {
 	ImGui::Text("Material Type: %s", std::string("Medical Volume").c_str());
-	ImGui::DragFloat3("Plane", (float*)&this->plane, 1.f, -1.f, 1.f);
-	ImGui::SliderFloat("Cutoff", &this->cutoff, -1.0f, 1.0f);
 	ImGui::SliderFloat("Step Length", &this->step_length, 0.001f, 0.500f);
+	ImGui::Checkbox("Pre-integrated", &this->preintegrated);
+
+	if (ImGui::TreeNode("Clipping")) {
+		for (int i = 0; i < this->num_clip_planes; i++) {
+			ImGui::PushID(i);
+			ImGui::DragFloat3("Normal", (float*)&this->clip_planes[i], 0.01f, -1.f, 1.f);
+			ImGui::SliderFloat("Offset", &this->clip_planes[i].w, -1.f, 1.f);
+			if (ImGui::SmallButton("Remove")) {
+				for (int j = i; j < this->num_clip_planes - 1; j++)
+					this->clip_planes[j] = this->clip_planes[j + 1];
+				this->num_clip_planes--;
+			}
+			ImGui::PopID();
+		}
+		if (this->num_clip_planes < MAX_CLIP_PLANES && ImGui::Button("Add Clip Plane"))
+			this->clip_planes[this->num_clip_planes++] = glm::vec4(1.f, 0.f, 0.f, 0.f);
+
+		ImGui::Checkbox("Crop Box", &this->use_crop_box);
+		if (this->use_crop_box) {
+			ImGui::DragFloat3("Center", (float*)&this->crop_center, 0.01f, -1.f, 1.f);
+			ImGui::DragFloat3("Size", (float*)&this->crop_size, 0.01f, 0.01f, 1.f);
+			ImGui::DragFloat3("Rotation", (float*)&this->crop_rotation, 1.f, -180.f, 180.f);
+		}
+		ImGui::TreePop();
+	}
 
 	ImGui::ColorEdit3("Color", (float*)&this->color);
+
+	if (ImGui::TreeNode("Transfer Function")) {
+		this->transfer_function->renderInMenu();
+		ImGui::TreePop();
+	}
 }
@@ -8,11 +8,22 @@
 #include "mesh.h"
 #include "texture.h"
 #include "shader.h"
+#include "uniformring.h"
 
 #include "../libraries/easyVDB/src/openvdbReader.h"
 #include "../libraries/easyVDB/src/grid.h"
 #include "../libraries/easyVDB/src/bbox.h"
 
+class VolumeSequence;
+class SparseVolume;
+class NoiseVolume;
+class LightVolume;
+class TransferFunction;
+class FBO;
+class AccumulationBuffer;
+class RaySetup;
+class MajorantGrid;
+
 class Material {
 public:
 
@@ -23,6 +34,12 @@ public:
 	virtual void setUniforms(Camera* camera, glm::mat4 model) = 0;
 	virtual void render(Mesh* mesh, glm::mat4 model, Camera* camera) = 0;
 	virtual void renderInMenu() = 0;
+
+	// Volumes are ray marched into the DynamicResolution target instead of the scene
+	virtual bool isVolume() { return false; }
+
+	// Depth of the opaque scene, volume rays stop at its surface
+	void setSceneDepthUniforms(Camera* camera);
 };
 
 class FlatMaterial : public Material {
@@ -73,27 +90,106 @@ public:
 	float noise_scale = 3.0f;
 	float g_value = 0.0f; // Scattering anisotropy
 
+	VolumeSequence* sequence = NULL; // animated VDB, streams into this->texture
+	SparseVolume* sparse = NULL; // VDB traversed in the shader instead of a dense texture
+	NoiseVolume* noise = NULL; // heterogeneous density baked to a texture
+	bool baked_noise = true;
+	bool noise_ready = false; // there is a baked texture, at the previous noise_scale while a new bake runs
+	LightVolume* light_volume = NULL; // transmittance toward the light for the Complete Model
+	bool use_light_volume = true;
+
+	float quality = 0.5f; // 1: always step_length, lower values take longer steps where the density is flat
+	float min_transmittance = 0.01f; // rays stop once less than this reaches the camera
+
+	// Average samples per ray, measured with the RAY_STATS variant
+	bool show_stats = false;
+	float avg_samples = 0.f;
+	float avg_light_samples = 0.f;
+	FBO* stats_fbo = NULL;
+
+	bool jitter = true; // blue noise offset of the first sample, instead of the same step grid for every ray
+	bool progressive = false; // keep averaging jittered frames while nothing changes
+	AccumulationBuffer* accumulation = NULL;
+	std::vector<float> accumulation_state;
+
+	RaySetup* ray_setup = NULL; // entry and exit points of the rays, rasterized every frame
+	std::vector<uint8_t> occupancy; // cells of the VDB with any density, to fit the hull
+	glm::ivec3 occupancy_dims = glm::ivec3(0);
+	Mesh* hull = NULL; // tighter proxy than the box, built from occupancy
+	bool use_hull = true;
+
+	bool delta_tracking = false; // unbiased delta / ratio tracking instead of the fixed step march (Complete Model)
+	MajorantGrid* majorant = NULL; // density bound per cell for the VDB volumes
+
+	// Block "Material" of the volume shaders (std140), uploaded to the UniformRing when it changes
+	struct sMaterialBlock {
+		glm::vec4 color;
+		glm::vec3 box_min;
+		float absorption_coefficient;
+		glm::vec3 box_max;
+		float scattering_coefficient;
+		float step_length;
+		float noise_scale;
+		float g_value;
+		float min_transmittance;
+		float max_step_scale;
+		float padding[3];
+	};
+	sMaterialBlock block_data = {};
+	UniformRing::sAllocation block;
+
     VolumeMaterial(glm::vec4 color = glm::vec4(0.f), float absorption_coefficient = 0.5f, float scattering_coefficient = 0.5f, int volume_type = 0);
     ~VolumeMaterial();
 
 	void render(Mesh* mesh, glm::mat4 model, Camera* camera) override;
+	bool isVolume() override { return true; }
+	void update(Mesh* mesh, glm::mat4 model);
+	bool canBatch();
     void setUniforms(Mesh* mesh, Camera* camera, glm::mat4 model);
+	void setDensityUniforms(Shader* shader, Mesh* mesh);
     void renderInMenu() override;
 
-	void loadVDB(std::string file_path);
+	// Defines of the program variant for the current settings, shared with the light volume pass
+	std::string getShaderMacros(bool light_volume_ready = false);
+	bool isLightVolumeReady();
+	bool useDeltaTracking();
+	float getMaxStepScale() { return 1.f + 7.f * (1.f - this->quality); } // longest adaptive step over step_length
+	bool isAccumulating() { return this->progressive || useDeltaTracking(); } // frames are averaged at a fixed resolution
+	void updateStats(Mesh* mesh, glm::mat4 model, Camera* camera);
+	void renderProgressive(Mesh* mesh, glm::mat4 model, Camera* camera);
+	std::vector<float> getAccumulationState(glm::mat4 model, Camera* camera);
+	Mesh* getProxy(Mesh* mesh);
+
+	void loadVDB(std::string file_path, bool sparse = false);
+	void loadVDBSequence(std::string folder);
 	void estimate3DTexture(easyVDB::OpenVDBReader* vdbReader);
+
+	static void voxelizeGrid(easyVDB::Grid& grid, int resolution, float* data);
 };
 
 class MedicalMaterial : public FlatMaterial {
 public:
+	static const int MAX_CLIP_PLANES = 4; // same as in medical_volume.fs
+
 	float step_length = 0.04f;
-	glm::vec3 plane = glm::vec3(0.f);
-	float cutoff = 0.0f;
+
+	// Clipping in local space, trimmed from the ray interval before marching
+	glm::vec4 clip_planes[MAX_CLIP_PLANES]; // xyz = normal, w = offset, keeps dot(normal, p) >= offset
+	int num_clip_planes = 0;
+	bool use_crop_box = false;
+	glm::vec3 crop_center = glm::vec3(0.f);
+	glm::vec3 crop_size = glm::vec3(1.f); // half extents
+	glm::vec3 crop_rotation = glm::vec3(0.f); // degrees
+
+	TransferFunction* transfer_function = NULL;
+	bool preintegrated = true; // allows much longer steps without slab artifacts
+	RaySetup* ray_setup = NULL;
 	MedicalMaterial(glm::vec4 color = glm::vec4(1.f));
 	~MedicalMaterial();
 
 	void setUniforms(Mesh* mesh, Camera* camera, glm::mat4 model);
 	void render(Mesh* mesh, glm::mat4 model, Camera* camera);
+	bool isVolume() { return true; }
 	void renderInMenu();
 
 	//void loadDCMs(std::string file_path);
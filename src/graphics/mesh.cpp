@@ -44,9 +44,9 @@ BoundingBox transformBoundingBox(const glm::mat4 m, const BoundingBox& box)
 		if (corner.z < box_min.z) box_min.z = corner.z;
 
 		//box_max.setMax(corner);
-		if (corner.x > box_min.x) box_min.x = corner.x;
-		if (corner.y > box_min.y) box_min.y = corner.y;
-		if (corner.z > box_min.z) box_min.z = corner.z;
+		if (corner.x > box_max.x) box_max.x = corner.x;
+		if (corner.y > box_max.y) box_max.y = corner.y;
+		if (corner.z > box_max.z) box_max.z = corner.z;
 	}
 
 	glm::vec3 halfsize = (box_max - box_min) * 0.5f;
@@ -0,0 +1,115 @@
+#include "multivolume.h"
+
+#include "material.h"
+#include "noisevolume.h"
+#include "fbo.h"
+#include "../framework/scenenode.h"
+#include "../application.h"
+
+#include <algorithm>
+
+void MultiVolume::render(const std::vector<SceneNode*>& nodes, Camera* camera, std::vector<SceneNode*>& others)
+{
+	std::vector<SceneNode*> batch;
+	VolumeMaterial* first = NULL;
+	for (SceneNode* node : nodes) {
+		if (!node->visible || !node->mesh || !node->material || !node->material->isVolume())
+			continue;
+
+		// The only update of the frame, VolumeMaterial::render does not repeat it
+		VolumeMaterial* material = dynamic_cast<VolumeMaterial*>(node->material);
+		if (material)
+			material->update(node->mesh, node->model);
+
+		// Jitter and early termination are shared by the pass, they have to match the first volume of the batch
+		bool compatible = material && material->canBatch() && batch.size() < MAX_VOLUMES &&
+			(!first || (material->jitter == first->jitter && material->min_transmittance == first->min_transmittance));
+		if (this->enabled && compatible) {
+			if (!first)
+				first = material;
+			batch.push_back(node);
+		}
+		else
+			others.push_back(node);
+	}
+
+	this->num_volumes = (int)batch.size();
+	if (batch.size() < 2) {
+		others.insert(others.end(), batch.begin(), batch.end());
+		this->num_volumes = 0;
+		return;
+	}
+
+	Shader* shader = Shader::Get("res/shaders/quad.vs", "res/shaders/multi_volume.fs", first->jitter ? "#define JITTER\n" : "");
+	if (!shader)
+		return;
+
+	glm::mat4 inv_models[MAX_VOLUMES];
+	float box_min[MAX_VOLUMES * 3], box_max[MAX_VOLUMES * 3];
+	float colors[MAX_VOLUMES * 3];
+	float absorption[MAX_VOLUMES];
+	int sources[MAX_VOLUMES];
+	int units[MAX_VOLUMES] = { 0, 1, 2, 3 }; // every sampler of the array is uploaded, also the unused ones
+	float step_lengths[MAX_VOLUMES];
+	float max_step_scales[MAX_VOLUMES];
+
+	for (int i = 0; i < this->num_volumes; i++) {
+		SceneNode* node = batch[i];
+		VolumeMaterial* material = (VolumeMaterial*)node->material;
+
+		inv_models[i] = glm::inverse(node->model);
+		memcpy(&box_min[i * 3], &node->mesh->aabb_min, sizeof(glm::vec3));
+		memcpy(&box_max[i * 3], &node->mesh->aabb_max, sizeof(glm::vec3));
+
+		// Absorption only volumes emit nothing
+		glm::vec3 emission = material->shader_type == 1 ? glm::vec3(material->color) : glm::vec3(0.f);
+		memcpy(&colors[i * 3], &emission, sizeof(glm::vec3));
+		absorption[i] = material->absorption_coefficient;
+		step_lengths[i] = material->step_length;
+		max_step_scales[i] = material->getMaxStepScale();
+
+		// 0: homogeneous, 1: baked noise, 2: dense texture
+		Texture* texture = NULL;
+		sources[i] = material->volume_type;
+		if (material->volume_type == 1)
+			texture = material->noise->texture;
+		else if (material->volume_type == 2)
+			texture = material->texture;
+
+		Shader::BindTexture(i, GL_TEXTURE_3D, texture ? texture->texture_id : 0);
+	}
+
+	FBO* scene = Application::instance->scene_fbo;
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+
+	shader->enable();
+	shader->setUniform("u_num_volumes", this->num_volumes);
+	shader->setMatrix44Array("u_inv_models", inv_models, this->num_volumes);
+	shader->setUniform3Array("u_box_min", box_min, this->num_volumes);
+	shader->setUniform3Array("u_box_max", box_max, this->num_volumes);
+	shader->setUniform3Array("u_emission", colors, this->num_volumes);
+	shader->setUniform1Array("u_absorption", absorption, this->num_volumes);
+	shader->setUniform1Array("u_density_source", sources, this->num_volumes);
+	shader->setUniform1Array("u_textures", units, MAX_VOLUMES);
+
+	shader->setUniform1Array("u_step_lengths", step_lengths, this->num_volumes);
+	shader->setUniform1Array("u_max_step_scales", max_step_scales, this->num_volumes);
+
+	shader->setUniform("u_min_transmittance", first->min_transmittance);
+	shader->setUniform("u_viewport_size", glm::vec2(viewport[2], viewport[3]));
+	shader->setUniform("u_scene_depth", scene && scene->depth_texture ? scene->depth_texture : Texture::getWhiteTexture(), 7);
+	if (first->jitter) {
+		shader->setUniform("u_blue_noise", Texture::getBlueNoiseTexture(), 6);
+		shader->setUniform("u_frame_offset", 0.f); // batched volumes do not accumulate
+	}
+
+	Mesh::getQuad()->render(GL_TRIANGLES);
+	shader->disable();
+}
+
+void MultiVolume::renderInMenu()
+{
+	ImGui::Checkbox("Enabled", &this->enabled);
+	ImGui::Text("Volumes in the shared pass: %d / %d", this->num_volumes, MAX_VOLUMES);
+}
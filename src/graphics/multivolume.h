@@ -0,0 +1,25 @@
+#pragma once
+
+#include "../framework/includes.h"
+#include <vector>
+
+class SceneNode;
+class Camera;
+
+// Marches all the volume nodes of the frame in a single full screen pass. Every pixel intersects the boxes,
+// sorts the intervals by entry and walks them front to back in one loop, adding the extinction and emission of
+// the volumes that overlap at each step. Overlaps composite correctly, empty space between intervals is skipped
+// and early termination is shared, so the cost follows the depth complexity and not the number of nodes.
+class MultiVolume
+{
+public:
+	static const int MAX_VOLUMES = 4; // per pass, limited by the sampler array of the shader
+
+	bool enabled = true;
+	int num_volumes = 0; // in the last pass
+
+	// Updates every visible volume node once for the frame and draws the ones it can (see VolumeMaterial::canBatch),
+	// the rest are appended to "others" to be drawn on their own. A single volume keeps its own pass, which has more features
+	void render(const std::vector<SceneNode*>& nodes, Camera* camera, std::vector<SceneNode*>& others);
+	void renderInMenu();
+};
@@ -0,0 +1,248 @@
+#include "noisevolume.h"
+
+#include "texture.h"
+#include "textureupload.h"
+#include "../framework/threadpool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <thread>
+
+#include <glm/common.hpp>
+
+// GLSL helpers of snoise, the vec4 overloads work on 4 voxels at once (one per lane) for snoise4
+static inline float mod289(float x) { return x - 289.f * std::floor(x / 289.f); }
+static inline float permute(float x) { return mod289((x * 34.f + 1.f) * x); }
+static inline float taylorInvSqrt(float r) { return 1.79284291400159f - 0.85373472095314f * r; }
+static inline glm::vec4 mod289(const glm::vec4& x) { return x - 289.f * glm::floor(x / 289.f); }
+static inline glm::vec4 permute(const glm::vec4& x) { return mod289((x * 34.f + 1.f) * x); }
+static inline glm::vec4 taylorInvSqrt(const glm::vec4& r) { return 1.79284291400159f - 0.85373472095314f * r; }
+
+NoiseVolume::NoiseVolume(int resolution)
+{
+	this->resolution = resolution;
+}
+
+NoiseVolume::~NoiseVolume()
+{
+	// The bake job writes into this->data, the upload reads it
+	while (this->busy.load() && !this->finished.load() && !this->upload)
+		std::this_thread::yield();
+	if (this->upload)
+		TextureUploadQueue::Get()->finish(this->upload);
+
+	if (this->texture)
+		delete this->texture;
+	if (this->staging)
+		delete this->staging;
+}
+
+float NoiseVolume::snoise(const glm::vec3& v)
+{
+	const float Cx = 1.f / 6.f;
+	const float Cy = 1.f / 3.f;
+
+	// First corner
+	glm::vec3 i = glm::floor(v + (v.x + v.y + v.z) * Cy);
+	glm::vec3 x0 = v - i + (i.x + i.y + i.z) * Cx;
+
+	// Other corners
+	glm::vec3 g(x0.x >= x0.y ? 1.f : 0.f, x0.y >= x0.z ? 1.f : 0.f, x0.z >= x0.x ? 1.f : 0.f);
+	glm::vec3 l = 1.f - g;
+	glm::vec3 lzxy(l.z, l.x, l.y);
+	glm::vec3 i1 = glm::min(g, lzxy);
+	glm::vec3 i2 = glm::max(g, lzxy);
+
+	glm::vec3 x[4];
+	x[0] = x0;
+	x[1] = x0 - i1 + Cx;
+	x[2] = x0 - i2 + 2.f * Cx;
+	x[3] = x0 - 1.f + 3.f * Cx;
+
+	// Permutations
+	i = glm::vec3(mod289(i.x), mod289(i.y), mod289(i.z));
+	float oz[4] = { 0.f, i1.z, i2.z, 1.f };
+	float oy[4] = { 0.f, i1.y, i2.y, 1.f };
+	float ox[4] = { 0.f, i1.x, i2.x, 1.f };
+
+	float result = 0.f;
+	for (int k = 0; k < 4; k++) {
+		float p = permute(permute(permute(i.z + oz[k]) + i.y + oy[k]) + i.x + ox[k]);
+
+		// Gradients: 7x7 points over a square, mapped onto an octahedron
+		const float n = 1.f / 7.f;
+		float j = p - 49.f * std::floor(p * n * n);
+		float gx_ = std::floor(j * n);
+		float gy_ = std::floor(j - 7.f * gx_);
+
+		float gx = gx_ * 2.f * n + (0.5f * n - 1.f);
+		float gy = gy_ * 2.f * n + (0.5f * n - 1.f);
+		float h = 1.f - std::abs(gx) - std::abs(gy);
+
+		float sh = h <= 0.f ? -1.f : 0.f;
+		gx += (std::floor(gx) * 2.f + 1.f) * sh;
+		gy += (std::floor(gy) * 2.f + 1.f) * sh;
+
+		glm::vec3 grad(gx, gy, h);
+		grad *= taylorInvSqrt(glm::dot(grad, grad));
+
+		// Mix final noise value
+		float m = std::max(0.6f - glm::dot(x[k], x[k]), 0.f);
+		m = m * m;
+		result += m * m * glm::dot(grad, x[k]);
+	}
+
+	return 42.f * result;
+}
+
+// Same steps as snoise with the branches turned into step(), so every operation is the same over the 4 lanes
+// and the compiler can keep them in SIMD registers
+glm::vec4 NoiseVolume::snoise4(const glm::vec4& vx, const glm::vec4& vy, const glm::vec4& vz)
+{
+	const float Cx = 1.f / 6.f;
+	const float Cy = 1.f / 3.f;
+
+	// First corner
+	glm::vec4 s = (vx + vy + vz) * Cy;
+	glm::vec4 ix = glm::floor(vx + s);
+	glm::vec4 iy = glm::floor(vy + s);
+	glm::vec4 iz = glm::floor(vz + s);
+	glm::vec4 t = (ix + iy + iz) * Cx;
+	glm::vec4 x0x = vx - ix + t;
+	glm::vec4 x0y = vy - iy + t;
+	glm::vec4 x0z = vz - iz + t;
+
+	// Other corners, g = step(x0.yzx, x0.xyz) and l.zxy against it
+	glm::vec4 gx = glm::step(x0y, x0x);
+	glm::vec4 gy = glm::step(x0z, x0y);
+	glm::vec4 gz = glm::step(x0x, x0z);
+	glm::vec4 lx = 1.f - gx;
+	glm::vec4 ly = 1.f - gy;
+	glm::vec4 lz = 1.f - gz;
+	glm::vec4 i1x = glm::min(gx, lz), i1y = glm::min(gy, lx), i1z = glm::min(gz, ly);
+	glm::vec4 i2x = glm::max(gx, lz), i2y = glm::max(gy, lx), i2z = glm::max(gz, ly);
+
+	glm::vec4 x[4] = { x0x, x0x - i1x + Cx, x0x - i2x + 2.f * Cx, x0x - 1.f + 3.f * Cx };
+	glm::vec4 y[4] = { x0y, x0y - i1y + Cx, x0y - i2y + 2.f * Cx, x0y - 1.f + 3.f * Cx };
+	glm::vec4 z[4] = { x0z, x0z - i1z + Cx, x0z - i2z + 2.f * Cx, x0z - 1.f + 3.f * Cx };
+
+	// Permutations
+	ix = mod289(ix);
+	iy = mod289(iy);
+	iz = mod289(iz);
+	glm::vec4 oz[4] = { glm::vec4(0.f), i1z, i2z, glm::vec4(1.f) };
+	glm::vec4 oy[4] = { glm::vec4(0.f), i1y, i2y, glm::vec4(1.f) };
+	glm::vec4 ox[4] = { glm::vec4(0.f), i1x, i2x, glm::vec4(1.f) };
+
+	glm::vec4 result(0.f);
+	for (int k = 0; k < 4; k++) {
+		glm::vec4 p = permute(permute(permute(iz + oz[k]) + iy + oy[k]) + ix + ox[k]);
+
+		// Gradients: 7x7 points over a square, mapped onto an octahedron
+		const float n = 1.f / 7.f;
+		glm::vec4 j = p - 49.f * glm::floor(p * n * n);
+		glm::vec4 gx_ = glm::floor(j * n);
+		glm::vec4 gy_ = glm::floor(j - 7.f * gx_);
+
+		glm::vec4 grad_x = gx_ * 2.f * n + (0.5f * n - 1.f);
+		glm::vec4 grad_y = gy_ * 2.f * n + (0.5f * n - 1.f);
+		glm::vec4 h = 1.f - glm::abs(grad_x) - glm::abs(grad_y);
+
+		glm::vec4 sh = -glm::step(h, glm::vec4(0.f)); // -1 where h <= 0
+		grad_x += (glm::floor(grad_x) * 2.f + 1.f) * sh;
+		grad_y += (glm::floor(grad_y) * 2.f + 1.f) * sh;
+		glm::vec4 norm = taylorInvSqrt(grad_x * grad_x + grad_y * grad_y + h * h);
+
+		// Mix final noise value
+		glm::vec4 m = glm::max(0.6f - (x[k] * x[k] + y[k] * y[k] + z[k] * z[k]), 0.f);
+		m = m * m;
+		result += m * m * norm * (grad_x * x[k] + grad_y * y[k] + h * z[k]);
+	}
+
+	return 42.f * result;
+}
+
+bool NoiseVolume::update(float scale, const glm::vec3& box_min, const glm::vec3& box_max)
+{
+	sBakeParams wanted;
+	wanted.scale = scale;
+	wanted.box_min = box_min;
+	wanted.box_max = box_max;
+
+	// Upload a finished bake into the staging texture, in the background
+	if (this->finished.load()) {
+		if (!this->staging) {
+			this->staging = new Texture();
+			this->staging->create3D(this->resolution, this->resolution, this->resolution, GL_RED, GL_FLOAT, false, (float*)NULL, GL_R16F);
+		}
+		this->upload = TextureUploadQueue::Get()->enqueue(this->staging, this->data.data());
+		this->finished.store(false);
+	}
+
+	// And swap it in once it is complete
+	if (this->upload && TextureUploadQueue::Get()->isComplete(this->upload)) {
+		std::swap(this->texture, this->staging);
+		this->baked = this->baking;
+		this->bakes++;
+		this->upload = 0;
+		this->busy.store(false);
+	}
+
+	// Start a new one if the parameters changed, only one bake in flight
+	if (!(this->baked == wanted) && !this->busy.load()) {
+		this->baking = wanted;
+		this->busy.store(true);
+		ThreadPool::Get()->enqueue([this]() { bake(); });
+	}
+
+	return this->texture != NULL;
+}
+
+// Runs in a worker thread
+void NoiseVolume::bake()
+{
+	auto start = std::chrono::steady_clock::now();
+
+	int res = this->resolution;
+	this->data.resize((size_t)res * res * res);
+
+	glm::vec3 box_min = this->baking.box_min;
+	glm::vec3 texel = (this->baking.box_max - this->baking.box_min) / (float)res;
+	float scale = this->baking.scale;
+
+	// Texel centers, the sampler maps them back to the same local positions. Slices go to the workers and
+	// each row is evaluated 4 voxels at a time with snoise4, the rest of the row one by one
+	ThreadPool::Get()->parallelFor(0, res, [&](int begin, int end) {
+		const glm::vec4 lanes(0.5f, 1.5f, 2.5f, 3.5f);
+		for (int z = begin; z < end; z++) {
+			for (int y = 0; y < res; y++) {
+				float* row = &this->data[((size_t)z * res + y) * res];
+				glm::vec4 py((box_min.y + (y + 0.5f) * texel.y) * scale);
+				glm::vec4 pz((box_min.z + (z + 0.5f) * texel.z) * scale);
+
+				int x = 0;
+				for (; x + 4 <= res; x += 4) {
+					glm::vec4 px = (box_min.x + ((float)x + lanes) * texel.x) * scale;
+					glm::vec4 value = snoise4(px, py, pz);
+					row[x] = value.x;
+					row[x + 1] = value.y;
+					row[x + 2] = value.z;
+					row[x + 3] = value.w;
+				}
+				for (; x < res; x++) {
+					glm::vec3 point = box_min + (glm::vec3((float)x, (float)y, (float)z) + 0.5f) * texel;
+					row[x] = snoise(point * scale);
+				}
+			}
+		}
+	}, 1);
+
+	this->bake_time = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+	this->finished.store(true);
+}
+
+void NoiseVolume::renderInMenu()
+{
+	ImGui::Text("Baked noise: %d^3, %.1f ms%s", this->resolution, this->bake_time, this->busy.load() ? " (baking...)" : "");
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "../framework/includes.h"
+#include "textureupload.h"
+#include <vector>
+#include <atomic>
+
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+
+class Texture;
+
+// Simplex noise baked into a 3D texture over the volume box, so heterogeneous volumes
+// do one fetch per sample instead of evaluating snoise. Baking runs in the ThreadPool and
+// the result goes to a staging texture through the TextureUploadQueue, swapped in once complete,
+// so the previous texture stays valid (at the old scale) until then.
+class NoiseVolume
+{
+public:
+	Texture* texture = NULL;
+	int resolution;
+	float bake_time = 0.f; // ms
+	int bakes = 0; // swapped in so far, the texture changes with it
+
+	NoiseVolume(int resolution = 128);
+	~NoiseVolume();
+
+	// Call every frame from the render thread. Returns true once there is a texture to sample, it can still
+	// be the previous bake while the one for the new parameters is running
+	bool update(float scale, const glm::vec3& box_min, const glm::vec3& box_max);
+	void renderInMenu();
+
+	// Same result as snoise() in the volume shaders (stegu/webgl-noise)
+	static float snoise(const glm::vec3& v);
+	// snoise of 4 points at once, as structure of arrays (the x, y and z of the 4 points), used by the bake
+	static glm::vec4 snoise4(const glm::vec4& vx, const glm::vec4& vy, const glm::vec4& vz);
+
+private:
+	struct sBakeParams {
+		float scale = -1.f;
+		glm::vec3 box_min;
+		glm::vec3 box_max;
+		bool operator==(const sBakeParams& o) const { return scale == o.scale && box_min == o.box_min && box_max == o.box_max; }
+	};
+
+	sBakeParams baked; // in the texture
+	sBakeParams baking; // in the worker
+	std::vector<float> data;
+	Texture* staging = NULL;
+	TextureUploadQueue::Ticket upload = 0;
+	std::atomic<bool> busy{ false };
+	std::atomic<bool> finished{ false };
+
+	void bake();
+};
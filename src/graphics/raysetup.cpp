@@ -0,0 +1,149 @@
+#include "raysetup.h"
+
+#include "fbo.h"
+#include "mesh.h"
+#include "shader.h"
+#include "texture.h"
+#include "../framework/camera.h"
+
+RaySetup::RaySetup() { }
+
+RaySetup::~RaySetup()
+{
+	if (this->entry)
+		delete this->entry;
+	if (this->exit)
+		delete this->exit;
+}
+
+void RaySetup::render(Mesh* proxy, glm::mat4 model, Camera* camera)
+{
+	Shader* shader = Shader::Get("res/shaders/basic.vs", "res/shaders/ray_setup.fs");
+	if (!shader || !proxy)
+		return;
+
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+
+	if (!this->entry || this->entry->width != viewport[2] || this->entry->height != viewport[3]) {
+		if (!this->entry) {
+			this->entry = new FBO();
+			this->exit = new FBO();
+		}
+		this->entry->create(viewport[2], viewport[3], 1, GL_RGBA, GL_FLOAT, true, GL_RGBA32F);
+		this->exit->create(viewport[2], viewport[3], 1, GL_RGBA, GL_FLOAT, true, GL_RGBA32F);
+	}
+
+	GLfloat clear_color[4];
+	GLint depth_func, cull_face;
+	glGetFloatv(GL_COLOR_CLEAR_VALUE, clear_color);
+	glGetIntegerv(GL_DEPTH_FUNC, &depth_func);
+	glGetIntegerv(GL_CULL_FACE_MODE, &cull_face);
+	GLboolean depth_test = glIsEnabled(GL_DEPTH_TEST);
+	GLboolean cull = glIsEnabled(GL_CULL_FACE);
+	GLboolean blend = glIsEnabled(GL_BLEND);
+
+	glEnable(GL_DEPTH_TEST);
+	glEnable(GL_CULL_FACE);
+	glDisable(GL_BLEND);
+	glClearColor(0.f, 0.f, 0.f, 0.f);
+
+	shader->enable();
+	shader->setUniform("u_model", model);
+
+	// Nearest front face
+	this->entry->bind();
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	glDepthFunc(GL_LESS);
+	glCullFace(GL_BACK);
+	proxy->render(GL_TRIANGLES);
+	this->entry->unbind();
+
+	// Farthest back face
+	this->exit->bind();
+	glClearDepth(0.0);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	glClearDepth(1.0);
+	glDepthFunc(GL_GREATER);
+	glCullFace(GL_FRONT);
+	proxy->render(GL_TRIANGLES);
+	this->exit->unbind();
+
+	shader->disable();
+
+	glClearColor(clear_color[0], clear_color[1], clear_color[2], clear_color[3]);
+	glDepthFunc(depth_func);
+	glCullFace(cull_face);
+	if (!depth_test) glDisable(GL_DEPTH_TEST);
+	if (!cull) glDisable(GL_CULL_FACE);
+	if (blend) glEnable(GL_BLEND);
+}
+
+void RaySetup::setUniforms(Shader* shader, int first_slot)
+{
+	shader->setUniform("u_ray_entry", this->entry->color_textures[0], first_slot);
+	shader->setUniform("u_ray_exit", this->exit->color_textures[0], first_slot + 1);
+}
+
+Mesh* RaySetup::createHull(const std::vector<uint8_t>& cells, const glm::ivec3& dims, const glm::vec3& box_min, const glm::vec3& box_max)
+{
+	auto index = [&](int x, int y, int z) { return x + dims.x * (y + dims.y * z); };
+
+	// Grow by one cell
+	std::vector<uint8_t> grown(cells.size(), 0);
+	for (int z = 0; z < dims.z; z++)
+		for (int y = 0; y < dims.y; y++)
+			for (int x = 0; x < dims.x; x++) {
+				if (!cells[index(x, y, z)])
+					continue;
+				for (int dz = std::max(z - 1, 0); dz <= std::min(z + 1, dims.z - 1); dz++)
+					for (int dy = std::max(y - 1, 0); dy <= std::min(y + 1, dims.y - 1); dy++)
+						for (int dx = std::max(x - 1, 0); dx <= std::min(x + 1, dims.x - 1); dx++)
+							grown[index(dx, dy, dz)] = 1;
+			}
+
+	auto occupied = [&](int x, int y, int z) {
+		if (x < 0 || y < 0 || z < 0 || x >= dims.x || y >= dims.y || z >= dims.z)
+			return false;
+		return grown[index(x, y, z)] != 0;
+	};
+
+	Mesh* hull = new Mesh();
+	glm::vec3 cell_size = (box_max - box_min) / glm::vec3(dims);
+
+	// One quad per face towards an empty cell, counter clockwise seen from outside
+	for (int z = 0; z < dims.z; z++)
+		for (int y = 0; y < dims.y; y++)
+			for (int x = 0; x < dims.x; x++) {
+				if (!occupied(x, y, z))
+					continue;
+
+				for (int axis = 0; axis < 3; axis++) {
+					for (int side = 0; side < 2; side++) {
+						glm::ivec3 neighbor(x, y, z);
+						neighbor[axis] += side ? 1 : -1;
+						if (occupied(neighbor.x, neighbor.y, neighbor.z))
+							continue;
+
+						// Corners of the face, u and v span it so that u x v points outwards
+						int u = (axis + 1) % 3;
+						int v = (axis + 2) % 3;
+						if (!side)
+							std::swap(u, v);
+
+						glm::vec3 origin = box_min + glm::vec3(x, y, z) * cell_size;
+						origin[axis] += side ? cell_size[axis] : 0.f;
+						glm::vec3 du(0.f), dv(0.f);
+						du[u] = cell_size[u];
+						dv[v] = cell_size[v];
+
+						glm::vec3 corners[6] = { origin, origin + du, origin + du + dv, origin, origin + du + dv, origin + dv };
+						hull->vertices.insert(hull->vertices.end(), corners, corners + 6);
+					}
+				}
+			}
+
+	hull->updateBoundingBox();
+	hull->uploadToVRAM();
+	return hull;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "../framework/includes.h"
+#include <vector>
+#include <cstdint>
+
+#include <glm/vec3.hpp>
+#include <glm/matrix.hpp>
+
+class FBO;
+class Mesh;
+class Shader;
+class Camera;
+
+// Entry and exit points of the view rays, rasterized from the proxy geometry instead of a ray/box test per fragment.
+// The nearest front faces go to "entry" and the farthest back faces to "exit", as local positions with w = 1 where covered.
+// The volume shaders are then run as a full screen pass, so rays starting inside the volume are handled too.
+class RaySetup
+{
+public:
+	FBO* entry = NULL;
+	FBO* exit = NULL;
+
+	RaySetup();
+	~RaySetup();
+
+	// Rasterizes the proxy at the size of the current viewport
+	void render(Mesh* proxy, glm::mat4 model, Camera* camera);
+
+	// Binds entry and exit to consecutive texture units starting at first_slot
+	void setUniforms(Shader* shader, int first_slot);
+
+	// Faces between occupied and empty cells of a grid laid over the box, a tighter proxy than the box itself.
+	// Cells are grown by one so the trilinear footprint of the border voxels stays inside
+	static Mesh* createHull(const std::vector<uint8_t>& cells, const glm::ivec3& dims, const glm::vec3& box_min, const glm::vec3& box_max);
+};
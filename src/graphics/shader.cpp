@@ -7,8 +7,20 @@
 #include <functional> 
 #include <cctype>
 #include <locale>
+#include <chrono>
+#include <fstream>
+#include <filesystem>
+#include <cstdio>
+#include <thread>
+#include <mutex>
 
 #include "texture.h"
+#include "../framework/threadpool.h"
+
+// KHR_parallel_shader_compile, missing in older headers
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
 
 std::string Shader::s_shader_atlas_filename;
 std::map<std::string, std::string> Shader::s_shaders_atlas;
@@ -16,6 +28,109 @@ std::map<std::string, std::string> Shader::s_shaders_atlas;
 
 //typedef unsigned int GLhandle;
 
+// Macros have to go after the #version line, which must be the first statement of the source.
+// #line keeps the line numbers of the compile errors matching the file
+static std::string insertMacros(const std::string& code, const std::string& macros)
+{
+	size_t pos = 0;
+	size_t version = code.find("#version");
+	if (version != std::string::npos)
+	{
+		pos = code.find('\n', version);
+		pos = pos == std::string::npos ? code.size() : pos + 1;
+	}
+	int line = (int)std::count(code.begin(), code.begin() + pos, '\n') + 1;
+	return code.substr(0, pos) + macros + "\n#line " + std::to_string(line) + "\n" + code.substr(pos);
+}
+
+// Text of the shader files by path, read again only when the write time changes. Shared by every
+// variant that includes the same modules and by the hot reload workers
+struct sSourceFile {
+	std::filesystem::file_time_type time;
+	std::string text;
+};
+static std::map<std::string, sSourceFile> s_source_cache;
+static std::mutex s_source_mutex;
+
+static bool readSourceFile(const std::string& path, std::string& text)
+{
+	std::error_code error;
+	std::filesystem::file_time_type time = std::filesystem::last_write_time(path, error);
+
+	std::lock_guard<std::mutex> lock(s_source_mutex);
+	auto it = s_source_cache.find(path);
+	if (!error && it != s_source_cache.end() && it->second.time == time) {
+		text = it->second.text;
+		return true;
+	}
+
+	if (!readFile(path, text))
+		return false;
+	s_source_cache[path] = { time, text };
+	return true;
+}
+
+// Expands #include "file" (relative to the including file) recursively. Every file goes in once per stage,
+// like #pragma once. #line keeps the compile errors on the right line, the source string number is the
+// position of the file in included. files collects every file read, for the hot reload
+static bool expandIncludes(const std::string& path, std::string& out, std::vector<std::string>& included, std::vector<std::string>& files)
+{
+	std::string text;
+	if (!readSourceFile(path, text))
+		return false;
+
+	int index = (int)included.size();
+	included.push_back(path);
+	if (std::find(files.begin(), files.end(), path) == files.end())
+		files.push_back(path);
+
+	size_t pos = 0;
+	int line = 1;
+	while (pos < text.size()) {
+		size_t end = text.find('\n', pos);
+		end = end == std::string::npos ? text.size() : end + 1;
+
+		size_t first = text.find_first_not_of(" \t", pos);
+		if (first < end && text.compare(first, 8, "#include") == 0) {
+			size_t open = text.find('"', first);
+			size_t close = open < end ? text.find('"', open + 1) : std::string::npos;
+			if (close >= end) {
+				std::cout << "[ERROR]: Malformed #include in " << path << ":" << line << std::endl;
+				return false;
+			}
+
+			std::string name = text.substr(open + 1, close - open - 1);
+			std::string child = (std::filesystem::path(path).parent_path() / name).lexically_normal().generic_string();
+			if (std::find(included.begin(), included.end(), child) == included.end()) {
+				std::string module;
+				int child_index = (int)included.size();
+				if (!expandIncludes(child, module, included, files)) {
+					std::cout << "[ERROR]: Cannot include " << child << " in " << path << std::endl;
+					return false;
+				}
+				out += "#line 1 " + std::to_string(child_index) + "\n" + module + "\n";
+				out += "#line " + std::to_string(line + 1) + " " + std::to_string(index) + "\n";
+			}
+			else
+				out += "\n"; // already in, keep the line count
+		}
+		else
+			out.append(text, pos, end - pos);
+
+		pos = end;
+		line++;
+	}
+	return true;
+}
+
+// FNV-1a 64, with a separator so "ab" + "c" and "a" + "bc" differ
+static uint64_t hashBytes(uint64_t h, const char* data, size_t size)
+{
+	for (size_t i = 0; i < size; i++) { h ^= (uint8_t)data[i]; h *= 1099511628211ull; }
+	h ^= 0xFF;
+	return h * 1099511628211ull;
+}
+
 #ifdef LOAD_EXTENSIONS_MANUALLY
 
 REGISTER_GLEXT(GLhandle, glCreateProgramObject, void)
@@ -55,8 +170,18 @@ REGISTER_GLEXT(void, glUniformMatrix4fv, GLint location, GLsizei count, GLboolea
 #endif
 
 std::map<std::string, Shader*> Shader::s_Shaders;
+std::map<std::string, Shader::sAlias> Shader::s_aliases;
 bool Shader::s_ready = false;
 Shader* Shader::current = NULL;
+Shader::sStateStats Shader::stats;
+Shader::sStateStats Shader::last_stats;
+GLenum Shader::s_unit_targets[Shader::MAX_TEXTURE_UNITS] = { GL_NONE };
+GLuint Shader::s_unit_textures[Shader::MAX_TEXTURE_UNITS] = { 0 };
+int Shader::s_active_unit = -1;
+Shader::sCompileStats Shader::compile_stats;
+bool Shader::s_use_binary_cache = true;
+std::string Shader::s_binary_cache_folder = "shader_cache";
+bool Shader::s_reload_on_save = false;
 
 Shader::Shader()
 {
@@ -68,6 +193,15 @@ Shader::Shader()
 
 Shader::~Shader()
 {
+	// A worker may be reading the sources of a rebuild
+	if (this->rebuild) {
+		while (!this->rebuild->sources_ready.load())
+			std::this_thread::yield();
+		glDeleteProgram(this->rebuild->program);
+		glDeleteShader(this->rebuild->vs);
+		glDeleteShader(this->rebuild->fs);
+		delete this->rebuild;
+	}
 	release();
 }
 
@@ -89,18 +223,24 @@ bool Shader::load(const std::string& vsf, const std::string& psf, const char* ma
 	bool printMacros = false;
 
 	std::cout << " + Shader loading: Vertex: " << vsf << "  Pixel: " << psf << "  " << (macros && printMacros ? macros : "") << std::endl;
+	if (macros)
+		this->macros = macros;
+
 	std::string vsm, psm;
-	if (!readFile(vsf, vsm) || !readFile(psf, psm))
+	std::vector<std::string> files;
+	if (!readSources(vsm, psm, files))
 		return false;
 
 	//printf("Vertex shader from memory:\n%s\n", vsm.c_str());
 	//printf("Fragment shader from memory:\n%s\n", psm.c_str());
-	if (macros)
-	{
-		vsm = macros + vsm;
-		psm = macros + psm;
-		this->macros = macros;
-	}
+
+	return loadSources(vsm, psm, files);
+}
+
+bool Shader::loadSources(const std::string& vsm, const std::string& psm, const std::vector<std::string>& files)
+{
+	setSourceFiles(files);
+	source_hash = HashSources(vsm, psm);
 
 	if (!compileFromMemory(vsm, psm))
 		return false;
@@ -126,21 +266,322 @@ Shader* Shader::Get(const char* vsf, const char* psf, const char* macros)
 		return NULL;
 
 	Shader* sh = new Shader();
-	if (!sh->load(vsf, psf, macros))
+	sh->setFilenames(vsf, psf);
+	if (macros)
+		sh->macros = macros;
+
+	std::string vsm, psm;
+	std::vector<std::string> files;
+	if (!sh->readSources(vsm, psm, files)) {
+		delete sh;
+		return NULL;
+	}
+
+	// Variants that preprocess to the same source (macros that change nothing) share one program
+	uint64_t hash = HashSources(vsm, psm);
+	for (auto& other : s_Shaders) {
+		if (other.second->compiled && other.second->source_hash == hash) {
+			delete sh;
+			compile_stats.deduplicated++;
+			s_Shaders[name] = other.second;
+			s_aliases[name] = { vsf, psf, macros ? macros : "" };
+			return other.second;
+		}
+	}
+
+	std::cout << " + Shader loading: Vertex: " << vsf << "  Pixel: " << psf << std::endl;
+	if (!sh->loadSources(vsm, psm, files)) {
+		delete sh;
 		return NULL;
+	}
 	s_Shaders[name] = sh;
 	return sh;
 }
 
+void Shader::CheckAliases()
+{
+	for (auto it = s_aliases.begin(); it != s_aliases.end();) {
+		Shader* shared = s_Shaders[it->first];
+
+		Shader* probe = new Shader();
+		probe->setFilenames(it->second.vsf, it->second.psf);
+		probe->macros = it->second.macros;
+		std::string vsm, psm;
+		std::vector<std::string> files;
+		bool same = !probe->readSources(vsm, psm, files) || HashSources(vsm, psm) == shared->source_hash;
+		delete probe;
+		if (same) {
+			it++;
+			continue;
+		}
+
+		// Split: Get compiles it again (or finds another variant it matches now).
+		// The materials fetch their variant every frame, so they pick the new one up
+		std::string name = it->first;
+		sAlias alias = it->second;
+		it = s_aliases.erase(it);
+		s_Shaders.erase(name);
+		std::cout << " + Shader variant no longer shared: " << alias.psf << std::endl;
+		Get(alias.vsf.c_str(), alias.psf.c_str(), alias.macros.c_str());
+	}
+}
+
+uint64_t Shader::HashSources(const std::string& vsm, const std::string& psm)
+{
+	uint64_t h = hashBytes(14695981039346656037ull, vsm.data(), vsm.size());
+	return hashBytes(h, psm.data(), psm.size());
+}
+
 void Shader::ReloadAll()
 {
-	for (std::map<std::string, Shader*>::iterator it = s_Shaders.begin(); it != s_Shaders.end(); it++)
+	// Deduplicated variants appear under several names
+	std::vector<Shader*> done;
+	for (std::map<std::string, Shader*>::iterator it = s_Shaders.begin(); it != s_Shaders.end(); it++) {
+		if (std::find(done.begin(), done.end(), it->second) != done.end())
+			continue;
 		it->second->recompile();
+		done.push_back(it->second);
+	}
+	CheckAliases();
 	if (!s_shader_atlas_filename.empty())
 		LoadAtlas(s_shader_atlas_filename.c_str());
 	std::cout << "Shaders recompiled" << std::endl;
 }
 
+bool Shader::readSources(std::string& vsm, std::string& psm, std::vector<std::string>& files) const
+{
+	files.clear();
+	vsm.clear();
+	psm.clear();
+
+	std::vector<std::string> vs_included, ps_included;
+	if (!expandIncludes(vs_filename, vsm, vs_included, files) || !expandIncludes(ps_filename, psm, ps_included, files))
+		return false;
+
+	if (macros.size())
+	{
+		vsm = insertMacros(vsm, macros);
+		psm = insertMacros(psm, macros);
+	}
+	return true;
+}
+
+void Shader::setSourceFiles(const std::vector<std::string>& files)
+{
+	source_files.clear();
+	for (const std::string& file : files) {
+		std::error_code error;
+		source_files.push_back({ file, std::filesystem::last_write_time(file, error) });
+	}
+}
+
+bool Shader::sourcesChanged()
+{
+	for (auto& file : source_files) {
+		std::error_code error;
+		if (std::filesystem::last_write_time(file.first, error) != file.second)
+			return true;
+	}
+	return false;
+}
+
+int Shader::ReloadChanged()
+{
+	int count = 0;
+	for (auto& it : s_Shaders) {
+		Shader* sh = it.second;
+		if (sh->from_atlas || sh->rebuild || sh->source_files.empty() || !sh->sourcesChanged())
+			continue;
+
+		sRebuild* r = new sRebuild();
+		r->start = std::chrono::steady_clock::now();
+		sh->rebuild = r;
+
+		ThreadPool::Get()->enqueue([sh, r]() {
+			r->read_ok = sh->readSources(r->vsm, r->psm, r->files);
+			r->sources_ready.store(true);
+		});
+		count++;
+	}
+
+	if (count)
+		std::cout << " + Shader reload: " << count << " programs with changed files" << std::endl;
+	return count;
+}
+
+void Shader::UpdateRebuilds()
+{
+	if (s_reload_on_save) {
+		static auto last_check = std::chrono::steady_clock::now();
+		auto now = std::chrono::steady_clock::now();
+		if (now - last_check > std::chrono::milliseconds(500)) {
+			last_check = now;
+			ReloadChanged();
+		}
+	}
+
+	bool rebuilt = false;
+	for (auto& it : s_Shaders) {
+		Shader* sh = it.second;
+		sRebuild* r = sh->rebuild;
+		if (!r || !r->sources_ready.load())
+			continue;
+
+		// Sources read, start compiling and check again next frame
+		if (!r->issued) {
+			sh->setSourceFiles(r->files);
+			if (r->read_ok) {
+				sh->issueRebuild();
+				continue;
+			}
+		}
+		else if (!sh->isRebuildLinked())
+			continue;
+		else {
+			sh->finishRebuild();
+			rebuilt = true;
+		}
+
+		delete r;
+		sh->rebuild = NULL;
+	}
+
+	if (rebuilt)
+		CheckAliases();
+}
+
+void Shader::issueRebuild()
+{
+	// Compiler threads of the driver, glLinkProgram returns without waiting for them
+	static int parallel = -1;
+	if (parallel == -1) {
+		parallel = hasGLExtension("GL_KHR_parallel_shader_compile") ? 1 : 0;
+		if (parallel)
+			glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+	}
+
+	sRebuild* r = this->rebuild;
+	r->program = glCreateProgram();
+	r->vs = glCreateShader(GL_VERTEX_SHADER);
+	r->fs = glCreateShader(GL_FRAGMENT_SHADER);
+
+	const char* vs_code = r->vsm.c_str();
+	const char* fs_code = r->psm.c_str();
+	glShaderSource(r->vs, 1, &vs_code, NULL);
+	glShaderSource(r->fs, 1, &fs_code, NULL);
+	glCompileShader(r->vs);
+	glCompileShader(r->fs);
+
+	glAttachShader(r->program, r->vs);
+	glAttachShader(r->program, r->fs);
+	if (s_use_binary_cache && SupportsProgramBinaries())
+		glProgramParameteri(r->program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	glLinkProgram(r->program);
+
+	r->issued = true;
+}
+
+bool Shader::isRebuildLinked()
+{
+	// Without the extension the status query waits for the link, one frame after it was issued
+	static bool parallel = hasGLExtension("GL_KHR_parallel_shader_compile");
+	if (!parallel)
+		return true;
+
+	GLint done = GL_FALSE;
+	glGetProgramiv(this->rebuild->program, GL_COMPLETION_STATUS_KHR, &done);
+	return done == GL_TRUE;
+}
+
+void Shader::finishRebuild()
+{
+	sRebuild* r = this->rebuild;
+
+	GLint linked = 0;
+	glGetProgramiv(r->program, GL_LINK_STATUS, &linked);
+	if (!linked) {
+		log.clear();
+		saveShaderInfoLog(r->vs);
+		saveShaderInfoLog(r->fs);
+		saveProgramInfoLog(r->program);
+		glDeleteProgram(r->program);
+		glDeleteShader(r->vs);
+		glDeleteShader(r->fs);
+		std::cout << " * Shader reload failed, keeping the previous program: " << ps_filename << std::endl;
+		return;
+	}
+
+	// Swap, the old program goes away only now
+	release();
+	program = r->program;
+	vs = r->vs;
+	fs = r->fs;
+
+	source_hash = HashSources(r->vsm, r->psm);
+	if (s_use_binary_cache && SupportsProgramBinaries())
+		saveBinary(getBinaryKey(r->vsm, r->psm));
+	finishLink();
+
+	float ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - r->start).count();
+	std::cout << " + Shader reloaded: " << vs_filename << " " << ps_filename << " (" << ms << " ms)" << std::endl;
+}
+
+void Shader::BenchmarkUniformLookups(int iterations)
+{
+	double map_ms = 0.0, table_ms = 0.0;
+	size_t lookups = 0;
+	GLint checksum = 0; // keeps the loops from being optimized away
+
+	for (auto& it : s_Shaders) {
+		Shader* sh = it.second;
+		if (!sh->compiled)
+			continue;
+
+		// Names as the materials would pass them, ids hashed up front like the compiler does for literals
+		std::vector<std::string> names;
+		GLint count = 0, max_length = 0;
+		glGetProgramiv(sh->program, GL_ACTIVE_UNIFORMS, &count);
+		glGetProgramiv(sh->program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &max_length);
+		std::vector<char> name(max_length + 1);
+		for (GLint i = 0; i < count; i++) {
+			GLint size = 0;
+			GLenum type = 0;
+			glGetActiveUniform(sh->program, i, max_length, NULL, &size, &type, name.data());
+			names.push_back(name.data());
+		}
+		if (names.empty())
+			continue;
+
+		std::vector<UniformID> ids;
+		for (const std::string& n : names)
+			ids.push_back(UniformID::FromName(n.c_str()));
+
+		// Own table, the shader one keeps pointers to the caller strings
+		loctable table;
+		for (const std::string& n : names)
+			sh->getLocation(n.c_str(), &table);
+
+		auto start = std::chrono::steady_clock::now();
+		for (int k = 0; k < iterations; k++)
+			for (const std::string& n : names)
+				checksum += sh->getLocation(n.c_str(), &table);
+		auto middle = std::chrono::steady_clock::now();
+		for (int k = 0; k < iterations; k++)
+			for (const UniformID& id : ids)
+				checksum += sh->getLocation(id);
+		auto end = std::chrono::steady_clock::now();
+
+		map_ms += std::chrono::duration<double, std::milli>(middle - start).count();
+		table_ms += std::chrono::duration<double, std::milli>(end - middle).count();
+		lookups += names.size() * iterations;
+	}
+
+	if (!lookups)
+		return;
+	std::cout << " + Uniform lookups: " << lookups << " per path, map " << map_ms * 1e6 / lookups << " ns, hashed "
+		<< table_ms * 1e6 / lookups << " ns (" << map_ms / std::max(table_ms, 1e-9) << "x) [" << checksum << "]" << std::endl;
+}
+
 //functions to trim strings
 static inline std::string trim(std::string str) {
 	size_t startpos = str.find_first_not_of(" \t\r\n");
@@ -239,8 +680,8 @@ bool Shader::LoadAtlas(const char* filename)
 			continue;
 		}
 
-		vs_code = macros + "\n" + vs_code;
-		fs_code = macros + "\n" + fs_code;
+		vs_code = insertMacros(vs_code, macros);
+		fs_code = insertMacros(fs_code, macros);
 
 		Shader* shader = NULL;
 		auto it = s_Shaders.find(name);
@@ -303,6 +744,20 @@ bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
 		exit(0);
 	}
 
+	auto start = std::chrono::steady_clock::now();
+	compile_stats.programs++;
+
+	// Same source, macros and driver as a previous run: no compiler involved
+	uint64_t key = 0;
+	if (s_use_binary_cache && SupportsProgramBinaries()) {
+		key = getBinaryKey(vsm, psm);
+		if (loadBinary(key)) {
+			compile_stats.from_cache++;
+			compile_stats.ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			return finishLink();
+		}
+	}
+
 	program = glCreateProgram();
 	assert(glGetError() == GL_NO_ERROR);
 
@@ -318,6 +773,9 @@ bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
 		return false;
 	}
 
+	if (key)
+		glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+
 	glLinkProgram(program);
 	assert(glGetError() == GL_NO_ERROR);
 
@@ -333,15 +791,127 @@ bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
 		return false;
 	}
 
+	if (key)
+		saveBinary(key);
+	compile_stats.ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+	return finishLink();
+}
+
+// Common to compiled and cached programs
+bool Shader::finishLink()
+{
 #ifdef _DEBUG
 	validate();
 #endif
 
+	buildUniformTable();
+
+	setUniformBlock("Lights", LIGHTS_BINDING);
+	setUniformBlock("Frame", FRAME_BINDING);
+	setUniformBlock("Material", MATERIAL_BINDING);
+
 	compiled = true;
 
 	return true;
 }
 
+bool Shader::SupportsProgramBinaries()
+{
+	// Core in 4.1, some drivers expose no formats at all
+	static GLint formats = -1;
+	if (formats == -1)
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	return formats > 0;
+}
+
+uint64_t Shader::getBinaryKey(const std::string& vsm, const std::string& psm)
+{
+	// Sources and driver, a driver update invalidates every binary
+	uint64_t h = HashSources(vsm, psm);
+	GLenum strings[3] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+	for (int i = 0; i < 3; i++) {
+		const char* s = (const char*)glGetString(strings[i]);
+		if (s)
+			h = hashBytes(h, s, strlen(s));
+	}
+	return h;
+}
+
+std::string Shader::getBinaryPath(uint64_t key)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)key);
+	return s_binary_cache_folder + "/" + name;
+}
+
+bool Shader::loadBinary(uint64_t key)
+{
+	std::ifstream file(getBinaryPath(key), std::ios::binary);
+	if (!file)
+		return false;
+
+	// File: binary format (GLenum) followed by the program binary
+	GLenum format = 0;
+	if (!file.read((char*)&format, sizeof(format)))
+		return false;
+	std::vector<char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	if (data.empty())
+		return false;
+
+	program = glCreateProgram();
+	glProgramBinary(program, format, data.data(), (GLsizei)data.size());
+
+	// Drivers may reject binaries of their own (format changes), compile from source then
+	GLint linked = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	if (!linked) {
+		glDeleteProgram(program);
+		program = 0;
+		glGetError();
+		std::cout << " * Program binary rejected, compiling " << ps_filename << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+void Shader::saveBinary(uint64_t key)
+{
+	GLint length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0)
+		return;
+
+	std::vector<char> data(length);
+	GLenum format = 0;
+	glGetProgramBinary(program, length, &length, &format, data.data());
+
+	std::error_code error;
+	std::filesystem::create_directories(s_binary_cache_folder, error);
+
+	std::ofstream file(getBinaryPath(key), std::ios::binary);
+	if (!file) {
+		std::cout << "[ERROR]: Cannot write the program binary cache in " << s_binary_cache_folder << std::endl;
+		return;
+	}
+	file.write((const char*)&format, sizeof(format));
+	file.write(data.data(), length);
+}
+
+void Shader::ClearBinaryCache()
+{
+	std::error_code error;
+	std::uintmax_t count = std::filesystem::remove_all(s_binary_cache_folder, error);
+	std::cout << " + Program binary cache cleared (" << (count ? count - 1 : 0) << " files)" << std::endl;
+}
+
+void Shader::PrintCompileStats(const char* label)
+{
+	std::cout << " + " << label << ": " << compile_stats.programs << " programs in " << compile_stats.ms << " ms, "
+		<< compile_stats.from_cache << " from the binary cache (" << (compile_stats.from_cache ? "warm" : "cold") << " start)" << std::endl;
+}
+
 bool Shader::validate()
 {
 	glValidateProgram(program);
@@ -433,6 +1003,9 @@ void Shader::release()
 	}
 
 	locations.clear();
+	uniform_table.clear();
+	uniform_mask = 0;
+	uniform_values.clear();
 
 	compiled = false;
 }
@@ -511,6 +1084,91 @@ void Shader::saveProgramInfoLog(GLuint obj)
 	}
 }
 
+void Shader::buildUniformTable()
+{
+	GLint count = 0, max_length = 0;
+	glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &count);
+	glGetProgramiv(program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &max_length);
+
+	uint32_t size = 16;
+	while (size < (uint32_t)count * 4) // arrays go in twice, "name" and "name[0]"
+		size *= 2;
+	uniform_table.assign(size, sUniformSlot());
+	uniform_mask = size - 1;
+	uniform_values.assign(count, std::vector<uint8_t>());
+
+	auto insert = [&](const char* name, GLint location, int index) {
+		uint32_t hash = UniformID::Hash(name);
+		for (uint32_t i = hash & uniform_mask;; i = (i + 1) & uniform_mask) {
+			sUniformSlot& slot = uniform_table[i];
+			if (!slot.used) {
+				slot.hash = hash;
+				slot.name = name;
+				slot.location = location;
+				slot.index = index;
+				slot.used = true;
+				return;
+			}
+		}
+	};
+
+	std::vector<char> name(max_length + 1);
+	for (GLint i = 0; i < count; i++) {
+		GLint size_array = 0;
+		GLenum type = 0;
+		glGetActiveUniform(program, i, max_length, NULL, &size_array, &type, name.data());
+
+		// Members of uniform blocks have no location
+		GLint location = glGetUniformLocation(program, name.data());
+		if (location == -1)
+			continue;
+		insert(name.data(), location, i);
+
+		// Arrays are reported as "name[0]", callers use the bare name
+		std::string bare = name.data();
+		if (bare.size() > 3 && bare.compare(bare.size() - 3, 3, "[0]") == 0)
+			insert(bare.substr(0, bare.size() - 3).c_str(), location, i);
+	}
+}
+
+const Shader::sUniformSlot* Shader::findUniform(UniformID id)
+{
+	if (uniform_table.empty())
+		return NULL;
+
+	for (uint32_t i = id.hash & uniform_mask;; i = (i + 1) & uniform_mask) {
+		const sUniformSlot& slot = uniform_table[i];
+		if (!slot.used)
+			return NULL;
+		if (slot.hash == id.hash && slot.name == id.name)
+			return &slot;
+	}
+}
+
+GLint Shader::getLocation(UniformID id)
+{
+	const sUniformSlot* slot = findUniform(id);
+	return slot ? slot->location : -1;
+}
+
+GLint Shader::getChangedLocation(UniformID id, const void* data, size_t size)
+{
+	const sUniformSlot* slot = findUniform(id);
+	if (!slot)
+		return -1;
+
+	// Program uniforms persist until the next link, the copy stays valid while the table exists
+	std::vector<uint8_t>& value = uniform_values[slot->index];
+	if (value.size() == size && memcmp(value.data(), data, size) == 0) {
+		stats.uniforms_skipped++;
+		return -1;
+	}
+
+	value.assign((const uint8_t*)data, (const uint8_t*)data + size);
+	stats.uniforms_issued++;
+	return slot->location;
+}
+
 GLint Shader::getLocation(const char* varname, loctable* table)
 {
 	if (varname == 0 || table == 0)
@@ -562,11 +1220,51 @@ int Shader::getUniformLocation(const char* varname)
 	return loc;
 }
 
-void Shader::setTexture(const char* varname, Texture* tex, int slot)
+void Shader::setTexture(UniformID id, Texture* tex, int slot)
+{
+	BindTexture(slot, tex->texture_type, tex->texture_id);
+	setUniform1(id, slot);
+}
+
+void Shader::BindTexture(int slot, GLenum target, GLuint texture_id)
 {
-	glBindTexture(tex->texture_type, tex->texture_id);
-	glActiveTexture(GL_TEXTURE0 + slot);
-	setUniform1(varname, slot);
+	assert(slot < MAX_TEXTURE_UNITS);
+	if (s_unit_textures[slot] == texture_id && s_unit_targets[slot] == target) {
+		stats.textures_skipped++;
+		return;
+	}
+
+	if (s_active_unit != slot) {
+		glActiveTexture(GL_TEXTURE0 + slot);
+		s_active_unit = slot;
+	}
+	glBindTexture(target, texture_id);
+	s_unit_targets[slot] = target;
+	s_unit_textures[slot] = texture_id;
+	stats.textures_issued++;
+}
+
+void Shader::InvalidateTextureCache()
+{
+	for (int i = 0; i < MAX_TEXTURE_UNITS; i++)
+		s_unit_targets[i] = GL_NONE;
+	s_active_unit = -1;
+}
+
+void Shader::BeginFrame()
+{
+	last_stats = stats;
+	stats = sStateStats();
+	InvalidateTextureCache();
+	UpdateRebuilds();
+}
+
+void Shader::setUniformBlock(const char* blockname, int binding)
+{
+	GLuint index = glGetUniformBlockIndex(program, blockname);
+	if (index == GL_INVALID_INDEX)
+		return;
+	glUniformBlockBinding(program, index, binding);
 }
 
 /*
@@ -580,162 +1278,169 @@ void Shader::setTexture(const char* varname, unsigned int tex)
 }
 */
 
-void Shader::setUniform1(const char* varname, bool input1)
+void Shader::setUniform1(UniformID id, bool input1)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc, varname);
+	int value = input1;
+	GLint loc = getChangedLocation(id, &value, sizeof(value));
+	CHECK_SHADER_VAR(loc, id.name);
 	glUniform1i(loc, input1);
 	assert(glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform1(const char* varname, int input1)
+void Shader::setUniform1(UniformID id, int input1)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc, varname);
+	GLint loc = getChangedLocation(id, &input1, sizeof(input1));
+	CHECK_SHADER_VAR(loc, id.name);
 	glUniform1i(loc, input1);
 	assert(glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform2(const char* varname, int input1, int input2)
+void Shader::setUniform2(UniformID id, int input1, int input2)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc, varname);
+	int values[] = { input1, input2 };
+	GLint loc = getChangedLocation(id, values, sizeof(values));
+	CHECK_SHADER_VAR(loc, id.name);
 	glUniform2i(loc, input1, input2);
 	assert(glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform3(const char* varname, int input1, int input2, int input3)
+void Shader::setUniform3(UniformID id, int input1, int input2, int input3)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc, varname);
+	int values[] = { input1, input2, input3 };
+	GLint loc = getChangedLocation(id, values, sizeof(values));
+	CHECK_SHADER_VAR(loc, id.name);
 	glUniform3i(loc, input1, input2, input3);
 	assert(glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform4(const char* varname, const int input1, const int input2, const int input3, const int input4)
+void Shader::setUniform4(UniformID id, const int input1, const int input2, const int input3, const int input4)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc, varname);
+	int values[] = { input1, input2, input3, input4 };
+	GLint loc = getChangedLocation(id, values, sizeof(values));
+	CHECK_SHADER_VAR(loc, id.name);
 	glUniform4i(loc, input1, input2, input3, input4);
 	assert(glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform1Array(const char* varname, const int* input, const int count)
+void Shader::setUniform1Array(UniformID id, const int* input, const int count)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc, varname);
+	GLint loc = getChangedLocation(id, input, count * sizeof(*input));
+	CHECK_SHADER_VAR(loc, id.name);
 	glUniform1iv(loc, count, input);
 	assert(glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform2Array(const char* varname, const int* input, const int count)
+void Shader::setUniform2Array(UniformID id, const int* input, const int count)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc, varname);
+	GLint loc = getChangedLocation(id, input, count * 2 * sizeof(*input));
+	CHECK_SHADER_VAR(loc, id.name);
 	glUniform2iv(loc, count, input);
 	assert(glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform3Array(const char* varname, const int* input, const int count)
+void Shader::setUniform3Array(UniformID id, const int* input, const int count)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc, varname);
+	GLint loc = getChangedLocation(id, input, count * 3 * sizeof(*input));
+	CHECK_SHADER_VAR(loc, id.name);
 	glUniform3iv(loc, count, input);
 	assert(glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform4Array(const char* varname, const int* input, const int count)
+void Shader::setUniform4Array(UniformID id, const int* input, const int count)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc, varname);
+	GLint loc = getChangedLocation(id, input, count * 4 * sizeof(*input));
+	CHECK_SHADER_VAR(loc, id.name);
 	glUniform4iv(loc, count, input);
 	assert(glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform1(const char* varname, const float input1)
+void Shader::setUniform1(UniformID id, const float input1)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc, varname);
+	GLint loc = getChangedLocation(id, &input1, sizeof(input1));
+	CHECK_SHADER_VAR(loc, id.name);
 	glUniform1f(loc, input1);
 	assert(glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform2(const char* varname, const float input1, const float input2)
+void Shader::setUniform2(UniformID id, const float input1, const float input2)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc, varname);
+	float values[] = { input1, input2 };
+	GLint loc = getChangedLocation(id, values, sizeof(values));
+	CHECK_SHADER_VAR(loc, id.name);
 	glUniform2f(loc, input1, input2);
 	assert(glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform3(const char* varname, const float input1, const float input2, const float input3)
+void Shader::setUniform3(UniformID id, const float input1, const float input2, const float input3)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc, varname);
+	float values[] = { input1, input2, input3 };
+	GLint loc = getChangedLocation(id, values, sizeof(values));
+	CHECK_SHADER_VAR(loc, id.name);
 	glUniform3f(loc, input1, input2, input3);
 	assert(glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform4(const char* varname, const float input1, const float input2, const float input3, const float input4)
+void Shader::setUniform4(UniformID id, const float input1, const float input2, const float input3, const float input4)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc, varname);
+	float values[] = { input1, input2, input3, input4 };
+	GLint loc = getChangedLocation(id, values, sizeof(values));
+	CHECK_SHADER_VAR(loc, id.name);
 	glUniform4f(loc, input1, input2, input3, input4);
 	checkGLErrors();
 }
 
-void Shader::setUniform1Array(const char* varname, const float* input, const int count)
+void Shader::setUniform1Array(UniformID id, const float* input, const int count)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc, varname);
+	GLint loc = getChangedLocation(id, input, count * sizeof(*input));
+	CHECK_SHADER_VAR(loc, id.name);
 	glUniform1fv(loc, count, input);
 	assert(glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform2Array(const char* varname, const float* input, const int count)
+void Shader::setUniform2Array(UniformID id, const float* input, const int count)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc, varname);
+	GLint loc = getChangedLocation(id, input, count * 2 * sizeof(*input));
+	CHECK_SHADER_VAR(loc, id.name);
 	glUniform2fv(loc, count, input);
 	assert(glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform3Array(const char* varname, const float* input, const int count)
+void Shader::setUniform3Array(UniformID id, const float* input, const int count)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc, varname);
+	GLint loc = getChangedLocation(id, input, count * 3 * sizeof(*input));
+	CHECK_SHADER_VAR(loc, id.name);
 	glUniform3fv(loc, count, input);
 	assert(glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform4Array(const char* varname, const float* input, const int count)
+void Shader::setUniform4Array(UniformID id, const float* input, const int count)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc, varname);
+	GLint loc = getChangedLocation(id, input, count * 4 * sizeof(*input));
+	CHECK_SHADER_VAR(loc, id.name);
 	glUniform4fv(loc, count, input);
 	assert(glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setMatrix44(const char* varname, const float* m)
+void Shader::setMatrix44(UniformID id, const float* m)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc, varname);
+	GLint loc = getChangedLocation(id, m, 16 * sizeof(float));
+	CHECK_SHADER_VAR(loc, id.name);
 	glUniformMatrix4fv(loc, 1, GL_FALSE, m);
 	assert(glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setMatrix44(const char* varname, const glm::mat4& m)
+void Shader::setMatrix44(UniformID id, const glm::mat4& m)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc, varname);
+	GLint loc = getChangedLocation(id, glm::value_ptr(m), sizeof(m));
+	CHECK_SHADER_VAR(loc, id.name);
 	glUniformMatrix4fv(loc, 1, GL_FALSE, glm::value_ptr(m));
 	assert(glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setMatrix44Array(const char* varname, glm::mat4* m_array, int num)
+void Shader::setMatrix44Array(UniformID id, glm::mat4* m_array, int num)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc, varname);
+	GLint loc = getChangedLocation(id, m_array, num * sizeof(glm::mat4));
+	CHECK_SHADER_VAR(loc, id.name);
 	glUniformMatrix4fv(loc, num, GL_FALSE, (GLfloat*)m_array);
 	assert(glGetError() == GL_NO_ERROR);
 }
@@ -9,6 +9,9 @@
 #include <vector>
 #include <map>
 #include <cassert>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
 
 #include <glm/vec3.hpp>
 #include <glm/matrix.hpp>
@@ -23,6 +26,29 @@
 
 class Texture;
 
+// Uniform name and its FNV-1a hash. String literals convert implicitly and are hashed at compile time,
+// so setUniform("u_model", ...) costs a probe in the flat table of the program instead of string compares.
+struct UniformID
+{
+	uint32_t hash;
+	const char* name;
+
+	consteval UniformID(const char* name) : hash(Hash(name)), name(name) { }
+
+	// Names only known at runtime
+	static UniformID FromName(const char* name) { return UniformID(name, Hash(name)); }
+
+	static constexpr uint32_t Hash(const char* s)
+	{
+		uint32_t h = 2166136261u;
+		while (*s) { h ^= (uint8_t)*s++; h *= 16777619u; }
+		return h;
+	}
+
+private:
+	constexpr UniformID(const char* name, uint32_t hash) : hash(hash), name(name) { }
+};
+
 class Shader
 {
 	int last_slot;
@@ -55,52 +81,60 @@ public:
 	virtual bool IsAttribute(const char* varname) { return (getAttribLocation(varname) != -1); } //attribute exist
 
 	//upload
-	void setUniform(const char* varname, bool input) { assert(current == this); setUniform1(varname, input); }
-	void setUniform(const char* varname, int input) { assert(current == this); setUniform1(varname, input); }
-	void setUniform(const char* varname, float input) { assert(current == this); setUniform1(varname, input); }
-	void setUniform(const char* varname, const glm::vec2& input) { assert(current == this); setUniform2(varname, input.x, input.y); }
-	void setUniform(const char* varname, const glm::vec3& input) { assert(current == this); setUniform3(varname, input.x, input.y, input.z); }
-	void setUniform(const char* varname, const glm::vec4& input) { assert(current == this); setUniform4(varname, input.x, input.y, input.z, input.w); }
-	void setUniform(const char* varname, const glm::mat4& input) { assert(current == this); setMatrix44(varname, input); }
-	void setUniform(const char* varname, std::vector<glm::mat4>& m_vector) { assert(current == this && m_vector.size()); setMatrix44Array(varname, &m_vector[0], static_cast<int>(m_vector.size())); }
+	void setUniform(UniformID id, bool input) { assert(current == this); setUniform1(id, input); }
+	void setUniform(UniformID id, int input) { assert(current == this); setUniform1(id, input); }
+	void setUniform(UniformID id, float input) { assert(current == this); setUniform1(id, input); }
+	void setUniform(UniformID id, const glm::vec2& input) { assert(current == this); setUniform2(id, input.x, input.y); }
+	void setUniform(UniformID id, const glm::vec3& input) { assert(current == this); setUniform3(id, input.x, input.y, input.z); }
+	void setUniform(UniformID id, const glm::vec4& input) { assert(current == this); setUniform4(id, input.x, input.y, input.z, input.w); }
+	void setUniform(UniformID id, const glm::mat4& input) { assert(current == this); setMatrix44(id, input); }
+	void setUniform(UniformID id, std::vector<glm::mat4>& m_vector) { assert(current == this && m_vector.size()); setMatrix44Array(id, &m_vector[0], static_cast<int>(m_vector.size())); }
 
 	//for textures you must specify an slot (a number from 0 to 16) where this texture is stored in the shader
-	void setUniform(const char* varname, Texture* texture, int slot) { assert(current == this); setTexture(varname, texture, slot); }
+	void setUniform(UniformID id, Texture* texture, int slot) { assert(current == this); setTexture(id, texture, slot); }
 
 
-	virtual void setInt(const char* varname, const int& input) { setUniform1(varname, input); }
-	virtual void setFloat(const char* varname, const float& input) { setUniform1(varname, input); }
-	virtual void setVector3(const char* varname, const glm::vec3& input) { setUniform3(varname, input.x, input.y, input.z); }
-	virtual void setMatrix44(const char* varname, const float* m);
-	virtual void setMatrix44(const char* varname, const glm::mat4& m);
-	virtual void setMatrix44Array(const char* varname, glm::mat4* m_array, int num);
+	virtual void setInt(UniformID id, const int& input) { setUniform1(id, input); }
+	virtual void setFloat(UniformID id, const float& input) { setUniform1(id, input); }
+	virtual void setVector3(UniformID id, const glm::vec3& input) { setUniform3(id, input.x, input.y, input.z); }
+	virtual void setMatrix44(UniformID id, const float* m);
+	virtual void setMatrix44(UniformID id, const glm::mat4& m);
+	virtual void setMatrix44Array(UniformID id, glm::mat4* m_array, int num);
 
-	virtual void setUniform1Array(const char* varname, const float* input, const int count);
-	virtual void setUniform2Array(const char* varname, const float* input, const int count);
-	virtual void setUniform3Array(const char* varname, const float* input, const int count);
-	virtual void setUniform4Array(const char* varname, const float* input, const int count);
+	virtual void setUniform1Array(UniformID id, const float* input, const int count);
+	virtual void setUniform2Array(UniformID id, const float* input, const int count);
+	virtual void setUniform3Array(UniformID id, const float* input, const int count);
+	virtual void setUniform4Array(UniformID id, const float* input, const int count);
 
-	virtual void setUniform1Array(const char* varname, const int* input, const int count);
-	virtual void setUniform2Array(const char* varname, const int* input, const int count);
-	virtual void setUniform3Array(const char* varname, const int* input, const int count);
-	virtual void setUniform4Array(const char* varname, const int* input, const int count);
+	virtual void setUniform1Array(UniformID id, const int* input, const int count);
+	virtual void setUniform2Array(UniformID id, const int* input, const int count);
+	virtual void setUniform3Array(UniformID id, const int* input, const int count);
+	virtual void setUniform4Array(UniformID id, const int* input, const int count);
 
-	virtual void setUniform1(const char* varname, const bool input1);
+	virtual void setUniform1(UniformID id, const bool input1);
 
-	virtual void setUniform1(const char* varname, const int input1);
-	virtual void setUniform2(const char* varname, const int input1, const int input2);
-	virtual void setUniform3(const char* varname, const int input1, const int input2, const int input3);
-	virtual void setUniform3(const char* varname, const glm::vec3& input) { setUniform3(varname, input.x, input.y, input.z); }
-	virtual void setUniform4(const char* varname, const int input1, const int input2, const int input3, const int input4);
+	virtual void setUniform1(UniformID id, const int input1);
+	virtual void setUniform2(UniformID id, const int input1, const int input2);
+	virtual void setUniform3(UniformID id, const int input1, const int input2, const int input3);
+	virtual void setUniform3(UniformID id, const glm::vec3& input) { setUniform3(id, input.x, input.y, input.z); }
+	virtual void setUniform4(UniformID id, const int input1, const int input2, const int input3, const int input4);
 
-	virtual void setUniform1(const char* varname, const float input);
-	virtual void setUniform2(const char* varname, const float input1, const float input2);
-	virtual void setUniform3(const char* varname, const float input1, const float input2, const float input3);
-	virtual void setUniform4(const char* varname, const glm::vec4& input) { setUniform4(varname, input.x, input.y, input.z, input.w); }
-	virtual void setUniform4(const char* varname, const float input1, const float input2, const float input3, const float input4);
+	virtual void setUniform1(UniformID id, const float input);
+	virtual void setUniform2(UniformID id, const float input1, const float input2);
+	virtual void setUniform3(UniformID id, const float input1, const float input2, const float input3);
+	virtual void setUniform4(UniformID id, const glm::vec4& input) { setUniform4(id, input.x, input.y, input.z, input.w); }
+	virtual void setUniform4(UniformID id, const float input1, const float input2, const float input3, const float input4);
 
 	//virtual void setTexture(const char* varname, const unsigned int tex) ;
-	virtual void setTexture(const char* varname, Texture* texture, int slot);
+	virtual void setTexture(UniformID id, Texture* texture, int slot);
+
+	// Links a uniform block to a buffer binding point, ignored if the program has no such block
+	void setUniformBlock(const char* blockname, int binding);
+
+	// Binding points of the shared std140 blocks, every program that declares them is linked to these
+	static const int LIGHTS_BINDING = 0; // LightBuffer
+	static const int FRAME_BINDING = 1; // camera and scene, once per frame (UniformRing)
+	static const int MATERIAL_BINDING = 2; // per material, uploaded when it changes (UniformRing)
 
 	virtual int getAttribLocation(const char* varname);
 	virtual int getUniformLocation(const char* varname);
@@ -113,7 +147,18 @@ public:
 
 	static Shader* Get(const char* vsf, const char* psf = NULL, const char* macros = NULL);
 	static void ReloadAll();
+	// Hot reload: rebuilds in the background the programs whose files changed since they were loaded,
+	// each one keeps its current program until the new one links. Returns the number of rebuilds started
+	static int ReloadChanged();
+	// Called every frame by BeginFrame, swaps in the programs that finished linking
+	static void UpdateRebuilds();
+	static bool s_reload_on_save; // check the file times twice per second instead of waiting for ReloadChanged
 	static std::map<std::string, Shader*> s_Shaders;
+	// Names that Get served with the program of another variant (same preprocessed source). Checked again
+	// after every rebuild: an edit that makes them differ gives the name its own Shader
+	struct sAlias { std::string vsf, psf, macros; };
+	static std::map<std::string, sAlias> s_aliases;
+	static void CheckAliases();
 
 	//this is a way to load a single file that contains all the shaders 
 	//to know more about the file format, it is based in this https://github.com/jagenjo/rendeer.js/tree/master/guides#the-shaders but with tiny differences
@@ -123,6 +168,46 @@ public:
 
 	static Shader* getDefaultShader(std::string name);
 
+	// Redundant state elimination: uniforms keep a shadow copy per program and texture units remember
+	// what they hold, unchanged values skip the GL call. Counted per frame
+	struct sStateStats {
+		int uniforms_issued = 0;
+		int uniforms_skipped = 0;
+		int textures_issued = 0;
+		int textures_skipped = 0;
+	};
+	static sStateStats stats; // frame in progress
+	static sStateStats last_stats; // previous frame
+
+	static const int MAX_TEXTURE_UNITS = 32;
+
+	// Rolls the counters and forgets the texture units, anything may have been bound between frames (ImGui)
+	static void BeginFrame();
+	// Binds through the unit cache, use it instead of glActiveTexture + glBindTexture
+	static void BindTexture(int slot, GLenum target, GLuint texture_id);
+	// Call after binding textures outside BindTexture (uploads, FBO setup) or deleting them
+	static void InvalidateTextureCache();
+
+	// Times the name map against the hashed table for every uniform of the loaded shaders, prints the result
+	static void BenchmarkUniformLookups(int iterations = 100000);
+
+	// Linked programs are saved with glGetProgramBinary, keyed by the final source (macros included) and the
+	// driver, and loaded back with glProgramBinary. A miss or a rejected binary compiles from source
+	struct sCompileStats {
+		int programs = 0;
+		int from_cache = 0;
+		int deduplicated = 0; // Get calls served by a program with the same preprocessed source
+		double ms = 0.0; // compiling, linking or loading binaries
+	};
+	static sCompileStats compile_stats;
+	static bool s_use_binary_cache;
+	static std::string s_binary_cache_folder;
+
+	static bool SupportsProgramBinaries();
+	static void ClearBinaryCache();
+	// Startup report, a start without binaries is cold
+	static void PrintCompileStats(const char* label);
+
 protected:
 
 	std::string info_log;
@@ -138,10 +223,47 @@ protected:
 	void saveProgramInfoLog(GLuint obj);
 
 	bool validate();
+	bool finishLink();
+	void buildUniformTable();
+
+	// Final source of both stages: #include expanded and macros inserted. files gets every file that was read
+	// (includes too), so a change in a shared module reloads every program using it.
+	// Only reads members set at load, so it runs in the workers
+	bool readSources(std::string& vsm, std::string& psm, std::vector<std::string>& files) const;
+	bool loadSources(const std::string& vsm, const std::string& psm, const std::vector<std::string>& files);
+	static uint64_t HashSources(const std::string& vsm, const std::string& psm);
+	uint64_t source_hash = 0;
+	void setSourceFiles(const std::vector<std::string>& files);
+	bool sourcesChanged();
+
+	// Background rebuild. The workers read the sources, the render thread issues the compile
+	// (asynchronous with KHR_parallel_shader_compile) and swaps the program once it is linked
+	struct sRebuild {
+		std::atomic<bool> sources_ready{ false };
+		bool read_ok = false;
+		std::string vsm, psm;
+		std::vector<std::string> files;
+		GLuint program = 0;
+		GLuint vs = 0;
+		GLuint fs = 0;
+		bool issued = false;
+		std::chrono::steady_clock::time_point start;
+	};
+	sRebuild* rebuild = NULL;
+	std::vector<std::pair<std::string, std::filesystem::file_time_type>> source_files; // with their time at load
+
+	void issueRebuild();
+	bool isRebuildLinked();
+	void finishRebuild();
 
-	GLuint vs;
-	GLuint fs;
-	GLuint program;
+	uint64_t getBinaryKey(const std::string& vsm, const std::string& psm);
+	std::string getBinaryPath(uint64_t key);
+	bool loadBinary(uint64_t key);
+	void saveBinary(uint64_t key);
+
+	GLuint vs = 0;
+	GLuint fs = 0;
+	GLuint program = 0;
 	std::string log;
 
 	//this is a hack to speed up shader usage (save info locally)
@@ -156,7 +278,29 @@ private:
 	};
 	typedef std::map<const char*, int, ltstr> loctable;
 
+	// Active uniforms by hash, filled once after linking. Open addressing, power of two size at most half full.
+	// The name is only compared when the hashes match, so names that collide still find their own slot
+	struct sUniformSlot {
+		uint32_t hash = 0;
+		std::string name;
+		GLint location = -1;
+		int index = -1; // in uniform_values, shared by "name" and "name[0]"
+		bool used = false;
+	};
+	std::vector<sUniformSlot> uniform_table;
+	uint32_t uniform_mask = 0;
+	std::vector<std::vector<uint8_t>> uniform_values; // last upload of every active uniform
+
+	static GLenum s_unit_targets[MAX_TEXTURE_UNITS];
+	static GLuint s_unit_textures[MAX_TEXTURE_UNITS];
+	static int s_active_unit;
+
+	const sUniformSlot* findUniform(UniformID id);
+	// Location to upload to, -1 if the uniform does not exist or already holds these bytes
+	GLint getChangedLocation(UniformID id, const void* data, size_t size);
+
 public:
-	GLint getLocation(const char* varname, loctable* table);
+	GLint getLocation(UniformID id);
+	GLint getLocation(const char* varname, loctable* table); // by name, for runtime strings
 	loctable locations;
 };
\ No newline at end of file
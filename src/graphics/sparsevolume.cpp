@@ -0,0 +1,195 @@
+#include "sparsevolume.h"
+
+#include "shader.h"
+#include "../framework/threadpool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+SparseVolume::SparseVolume() { }
+
+SparseVolume::~SparseVolume()
+{
+	if (this->textures[0]) {
+		glDeleteTextures(3, this->textures);
+		glDeleteBuffers(3, this->buffers);
+		Shader::InvalidateTextureCache();
+	}
+}
+
+bool SparseVolume::build(easyVDB::Grid& grid, int max_resolution)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	// Index space bounds of the grid (same box that voxelizeGrid maps to the cube)
+	easyVDB::Bbox bbox = grid.getPreciseWorldBbox();
+	glm::vec3 corner_a = bbox.getCenter() - bbox.getSize() * 0.5f;
+	glm::vec3 corner_b = bbox.getCenter() + bbox.getSize() * 0.5f;
+	grid.transform->applyInverseTransformMap(corner_a);
+	grid.transform->applyInverseTransformMap(corner_b);
+
+	glm::vec3 index_min = glm::min(corner_a, corner_b);
+	glm::vec3 index_size = glm::max(corner_a, corner_b) - index_min;
+
+	// One texel per index space voxel, unless the grid is too big
+	float longest = std::max(index_size.x, std::max(index_size.y, index_size.z));
+	float scale = longest > max_resolution ? max_resolution / longest : 1.f;
+	this->dims = glm::max(glm::ivec3(glm::ceil(index_size * scale)), glm::ivec3(1));
+	this->root_dims = (this->dims + NODE_DIM - 1) / NODE_DIM;
+
+	glm::vec3 stride = index_size / glm::vec3(this->dims);
+	int num_root = this->root_dims.x * this->root_dims.y * this->root_dims.z;
+
+	// Active leaves of every internal node, in child order
+	struct sNodeBuild {
+		uint64_t mask = 0;
+		std::vector<uint8_t> leaves;
+	};
+	std::vector<sNodeBuild> nodes(num_root);
+
+	// Grid::getValue goes through the accessor cache of the grid, it is not safe to share between workers.
+	// Each chunk samples its own copy of the grid, so the workers read in parallel without a lock
+	ThreadPool::Get()->parallelFor(0, num_root, [&](int begin, int end) {
+		easyVDB::Grid accessor = grid;
+		float values[LEAF_SIZE];
+		uint8_t leaf[LEAF_SIZE];
+		for (int n = begin; n < end; n++) {
+			glm::ivec3 node(n % this->root_dims.x, (n / this->root_dims.x) % this->root_dims.y, n / (this->root_dims.x * this->root_dims.y));
+
+			for (int c = 0; c < INTERNAL_CHILDREN; c++) {
+				glm::ivec3 child(c % INTERNAL_DIM, (c / INTERNAL_DIM) % INTERNAL_DIM, c / (INTERNAL_DIM * INTERNAL_DIM));
+				glm::ivec3 origin = node * NODE_DIM + child * LEAF_DIM;
+
+				if (origin.x >= this->dims.x || origin.y >= this->dims.y || origin.z >= this->dims.z)
+					continue;
+
+				for (int v = 0; v < LEAF_SIZE; v++) {
+					glm::ivec3 voxel = origin + glm::ivec3(v % LEAF_DIM, (v / LEAF_DIM) % LEAF_DIM, v / (LEAF_DIM * LEAF_DIM));
+					values[v] = 0.f;
+					if (voxel.x < this->dims.x && voxel.y < this->dims.y && voxel.z < this->dims.z)
+						values[v] = accessor.getValue(index_min + (glm::vec3(voxel) + 0.5f) * stride);
+				}
+
+				bool active = false;
+				for (int v = 0; v < LEAF_SIZE; v++) {
+					leaf[v] = quantize(values[v]);
+					active = active || leaf[v] != 0;
+				}
+
+				if (active) {
+					nodes[n].mask |= (uint64_t)1 << c;
+					nodes[n].leaves.insert(nodes[n].leaves.end(), leaf, leaf + LEAF_SIZE);
+				}
+			}
+		}
+	});
+
+	// Flatten into the linear tables
+	this->root.assign(num_root, EMPTY);
+	this->internal_nodes.clear();
+	this->leaves.clear();
+	this->num_internal = 0;
+	this->num_leaves = 0;
+
+	for (int n = 0; n < num_root; n++) {
+		sNodeBuild& node = nodes[n];
+		if (!node.mask)
+			continue;
+
+		this->root[n] = this->num_internal++;
+		this->internal_nodes.push_back((uint32_t)(node.mask & 0xFFFFFFFF));
+		this->internal_nodes.push_back((uint32_t)(node.mask >> 32));
+
+		for (int c = 0; c < INTERNAL_CHILDREN; c++) {
+			bool active = node.mask & ((uint64_t)1 << c);
+			this->internal_nodes.push_back(active ? this->num_leaves++ : EMPTY);
+		}
+
+		this->leaves.insert(this->leaves.end(), node.leaves.begin(), node.leaves.end());
+		std::vector<uint8_t>().swap(node.leaves);
+	}
+
+	this->build_time = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+	std::cout << " + Sparse grid: " << this->dims.x << "x" << this->dims.y << "x" << this->dims.z << " voxels, "
+		<< this->num_internal << " internal nodes, " << this->num_leaves << " leaves (" << getMemoryUsage() / 1024 << " KB)" << std::endl;
+
+	upload();
+	return this->num_leaves > 0;
+}
+
+// As the dense path: voxelizeGrid scales the density by 255 and the float upload to the R8 texture clamps it
+// to [0, 1] and rounds to the nearest step
+uint8_t SparseVolume::quantize(float value)
+{
+	return (uint8_t)std::lround(std::clamp(value * 255.f, 0.f, 1.f) * 255.f);
+}
+
+void SparseVolume::upload()
+{
+	if (!this->textures[0]) {
+		glGenBuffers(3, this->buffers);
+		glGenTextures(3, this->textures);
+	}
+
+	// Empty buffers are not allowed, keep at least one element
+	uint32_t empty_node = EMPTY;
+	uint8_t empty_leaf = 0;
+
+	const void* data[3] = {
+		this->root.data(),
+		this->internal_nodes.empty() ? (const void*)&empty_node : this->internal_nodes.data(),
+		this->leaves.empty() ? (const void*)&empty_leaf : this->leaves.data()
+	};
+	size_t sizes[3] = {
+		this->root.size() * sizeof(uint32_t),
+		std::max((size_t)1, this->internal_nodes.size()) * sizeof(uint32_t),
+		std::max((size_t)1, this->leaves.size())
+	};
+	GLenum formats[3] = { GL_R32UI, GL_R32UI, GL_R8 };
+
+	for (int i = 0; i < 3; i++) {
+		glBindBuffer(GL_TEXTURE_BUFFER, this->buffers[i]);
+		glBufferData(GL_TEXTURE_BUFFER, sizes[i], data[i], GL_STATIC_DRAW);
+
+		glBindTexture(GL_TEXTURE_BUFFER, this->textures[i]);
+		glTexBuffer(GL_TEXTURE_BUFFER, formats[i], this->buffers[i]);
+	}
+
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	Shader::InvalidateTextureCache();
+}
+
+void SparseVolume::setUniforms(Shader* shader, int first_slot)
+{
+	const UniformID names[3] = { "u_sparse_root", "u_sparse_internal", "u_sparse_leaves" };
+
+	for (int i = 0; i < 3; i++) {
+		Shader::BindTexture(first_slot + i, GL_TEXTURE_BUFFER, this->textures[i]);
+		shader->setUniform(names[i], first_slot + i);
+	}
+
+	shader->setUniform3("u_sparse_dims", this->dims.x, this->dims.y, this->dims.z);
+	shader->setUniform3("u_sparse_root_dims", this->root_dims.x, this->root_dims.y, this->root_dims.z);
+}
+
+size_t SparseVolume::getMemoryUsage() const
+{
+	return this->root.size() * sizeof(uint32_t) + this->internal_nodes.size() * sizeof(uint32_t) + this->leaves.size();
+}
+
+size_t SparseVolume::getDenseMemoryUsage() const
+{
+	return (size_t)this->dims.x * this->dims.y * this->dims.z;
+}
+
+void SparseVolume::renderInMenu()
+{
+	ImGui::Text("Voxels: %d x %d x %d", this->dims.x, this->dims.y, this->dims.z);
+	ImGui::Text("Internal nodes: %d / %d", this->num_internal, (int)this->root.size());
+	ImGui::Text("Leaves: %d", this->num_leaves);
+	ImGui::Text("Memory: %.2f MB (dense: %.2f MB)", getMemoryUsage() / (1024.f * 1024.f), getDenseMemoryUsage() / (1024.f * 1024.f));
+	ImGui::Text("Build time: %.1f ms", this->build_time);
+}
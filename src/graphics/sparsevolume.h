@@ -0,0 +1,61 @@
+#pragma once
+
+#include "../framework/includes.h"
+#include <vector>
+#include <cstdint>
+
+#include <glm/vec3.hpp>
+
+#include "../libraries/easyVDB/src/grid.h"
+
+class Shader;
+
+// Pointer-free copy of a VDB grid that the volume shaders can traverse directly (NanoVDB style).
+// Three linear tables uploaded as buffer textures:
+//  - root: dense grid of internal node indices (EMPTY when the whole node is empty)
+//  - internal: per node a 64 bit child mask (2 uints) followed by the 64 leaf indices
+//  - leaves: 8^3 voxels (R8) per active leaf
+// Only active leaves are stored, so memory grows with the active voxels and not with the bbox.
+class SparseVolume
+{
+public:
+	static const int LEAF_DIM = 8; // voxels per leaf side
+	static const int INTERNAL_DIM = 4; // leaves per internal node side
+	static const int NODE_DIM = LEAF_DIM * INTERNAL_DIM; // voxels per internal node side
+	static const int LEAF_SIZE = LEAF_DIM * LEAF_DIM * LEAF_DIM;
+	static const int INTERNAL_CHILDREN = INTERNAL_DIM * INTERNAL_DIM * INTERNAL_DIM;
+	static const int INTERNAL_SIZE = 2 + INTERNAL_CHILDREN; // mask + children
+	static const uint32_t EMPTY = 0xFFFFFFFF;
+
+	glm::ivec3 dims; // voxels covered by the box
+	glm::ivec3 root_dims; // internal nodes per side
+
+	std::vector<uint32_t> root;
+	std::vector<uint32_t> internal_nodes;
+	std::vector<uint8_t> leaves;
+
+	int num_internal = 0;
+	int num_leaves = 0;
+	float build_time = 0.f; // ms
+
+	SparseVolume();
+	~SparseVolume();
+
+	// Samples the grid leaf by leaf in index space, resolution caps the voxels on the longest side
+	bool build(easyVDB::Grid& grid, int max_resolution = 256);
+	void upload();
+
+	// Density to the value of a leaf voxel, the same the dense R8 texture gets
+	static uint8_t quantize(float value);
+
+	// Binds the three tables to consecutive texture units starting at first_slot
+	void setUniforms(Shader* shader, int first_slot);
+
+	size_t getMemoryUsage() const;
+	size_t getDenseMemoryUsage() const; // same grid as a R8 3D texture, for comparison
+	void renderInMenu();
+
+private:
+	GLuint buffers[3] = { 0, 0, 0 };
+	GLuint textures[3] = { 0, 0, 0 };
+};
@@ -5,9 +5,12 @@
 #include <iostream> //to output
 #include <cmath>
 #include <algorithm>
+#include <vector>
 
 #include "mesh.h"
 #include "shader.h"
+#include "textureupload.h"
+#include "textureloader.h"
 #include <cassert>
 
 //bilinear interpolation
@@ -78,8 +81,10 @@ Texture::~Texture()
 
 void Texture::clear()
 {
+	TextureUploadQueue::Get()->cancel(this);
 	glDeleteTextures(1, &texture_id);
 	glBindTexture(this->texture_type, 0);
+	Shader::InvalidateTextureCache();
 	texture_id = 0;
 }
 
@@ -165,6 +170,7 @@ void Texture::upload3D(float* data, unsigned int mag_filter, unsigned int min_fi
 	assert(this->texture_type == GL_TEXTURE_3D && "Texture type does not match.");
 
 	glBindTexture(this->texture_type, this->texture_id); //we activate this id to tell opengl we are going to use this texture
+	Shader::InvalidateTextureCache();
 
 	// specify parameters
 	glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, min_filter);	//set the min filter
@@ -201,6 +207,7 @@ void Texture::createCubemap(unsigned int width, unsigned int height, uint8_t** d
 		glGenTextures(1, &texture_id); //we need to create an unique ID for the texture
 
 	glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+	Shader::InvalidateTextureCache();
 	uploadCubemap(format, type, mipmaps, data, internal_format);
 }
 
@@ -213,6 +220,10 @@ Texture* Texture::Get(const char* filename, bool mipmaps, bool wrap)
 	if (it != sTexturesLoaded.end())
 		return it->second;
 
+	//still decoding in a batch, wait for this one only
+	if (TextureLoader::Get()->isLoading(filename))
+		return TextureLoader::Get()->finish(filename);
+
 	//load it
 	Texture* texture = new Texture();
 	if (!texture->load(filename, mipmaps, wrap))
@@ -285,6 +296,7 @@ void Texture::upload(unsigned int format, unsigned int type, bool mipmaps, uint8
 	assert(texture_type == GL_TEXTURE_2D && "Texture type does not match.");
 
 	glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+	Shader::InvalidateTextureCache();
 
 	glTexImage2D(this->texture_type, 0, internal_format == 0 ? format : internal_format, width, height, 0, format, type, data);
 
@@ -306,6 +318,7 @@ void Texture::upload3D(unsigned int format, unsigned int type, bool mipmaps, uin
 	assert(texture_type == GL_TEXTURE_3D && "Texture type does not match.");
 
 	glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+	Shader::InvalidateTextureCache();
 
 	glTexImage3D(this->texture_type, 0, internal_format == 0 ? format : internal_format, width, height, depth, 0, format, type, data);
 
@@ -328,6 +341,7 @@ void Texture::uploadCubemap(unsigned int format, unsigned int type, bool mipmaps
 	assert(texture_type == GL_TEXTURE_CUBE_MAP && "Texture type does not match.");
 
 	glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+	Shader::InvalidateTextureCache();
 
 	for (int i = 0; i < 6; i++)
 		glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, internal_format == 0 ? format : internal_format, width, height, 0, format, type, data ? data[i] : NULL);
@@ -398,6 +412,7 @@ void Texture::uploadAsArray(unsigned int texture_size, bool mipmaps)
 	if (texture_id == 0)
 		glGenTextures(1, &texture_id); //we need to create an unique ID for the texture
 	glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+	Shader::InvalidateTextureCache();
 	glTexImage3D(this->texture_type, 0, format, width, height, num_textures, 0, dataFormat, type, data);
 	assert(glGetError() == GL_NO_ERROR);
 
@@ -419,12 +434,14 @@ void Texture::bind()
 {
 	//glEnable(this->texture_type); //enable the textures 
 	glBindTexture(this->texture_type, texture_id);	//enable the id of the texture we are going to use
+	Shader::InvalidateTextureCache();
 }
 
 void Texture::unbind()
 {
 	//glDisable(this->texture_type); //disable the textures 
 	glBindTexture(this->texture_type, 0);	//disable the id of the texture we are going to use
+	Shader::InvalidateTextureCache();
 }
 
 void Texture::UnbindAll()
@@ -433,6 +450,7 @@ void Texture::UnbindAll()
 	glDisable(GL_TEXTURE_2D);
 	glDisable(GL_TEXTURE_3D);
 	glBindTexture(GL_TEXTURE_2D, 0);
+	Shader::InvalidateTextureCache();
 	glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
 	glBindTexture(GL_TEXTURE_3D, 0);
 }
@@ -443,6 +461,7 @@ void Texture::generateMipmaps()
 		return;
 
 	glBindTexture(this->texture_type, texture_id);	//enable the id of the texture we are going to use
+	Shader::InvalidateTextureCache();
 	glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, Texture::default_min_filter); //set the mag filter
 	glGenerateMipmapEXT(this->texture_type);
 }
@@ -479,6 +498,92 @@ Texture* Texture::getWhiteTexture()
 	return white;
 }
 
+// Void-and-cluster (Ulichney 1993): ranks every pixel so that any threshold of the texture is evenly spread
+static void generateBlueNoise(int size, std::vector<uint8_t>& result)
+{
+	int count = size * size;
+	const float sigma = 1.5f;
+
+	// Toroidal gaussian, energy[p] is the sum of kernel(p - q) over the set pixels q
+	std::vector<float> kernel(count);
+	for (int y = 0; y < size; y++)
+		for (int x = 0; x < size; x++) {
+			int dx = std::min(x, size - x);
+			int dy = std::min(y, size - y);
+			kernel[y * size + x] = expf(-(dx * dx + dy * dy) / (2.f * sigma * sigma));
+		}
+
+	std::vector<uint8_t> pattern(count, 0);
+	std::vector<float> energy(count, 0.f);
+	auto splat = [&](int p, float sign) {
+		int px = p % size, py = p / size;
+		for (int y = 0; y < size; y++)
+			for (int x = 0; x < size; x++)
+				energy[y * size + x] += sign * kernel[((y - py + size) % size) * size + (x - px + size) % size];
+	};
+	// Tightest cluster: set pixel with the highest energy. Largest void: empty pixel with the lowest one
+	auto find = [&](uint8_t value, bool highest) {
+		int best = -1;
+		for (int p = 0; p < count; p++)
+			if (pattern[p] == value && (best == -1 || (highest ? energy[p] > energy[best] : energy[p] < energy[best])))
+				best = p;
+		return best;
+	};
+
+	// Initial pattern: 10% random pixels, relaxed until moving the tightest cluster to the largest void changes nothing
+	unsigned int seed = 1234567u;
+	int initial = count / 10;
+	for (int i = 0; i < initial; ) {
+		seed = seed * 1664525u + 1013904223u;
+		int p = (seed >> 8) % count;
+		if (pattern[p]) continue;
+		pattern[p] = 1; splat(p, 1.f); i++;
+	}
+	while (true) {
+		int cluster = find(1, true);
+		pattern[cluster] = 0; splat(cluster, -1.f);
+		int hole = find(0, false);
+		pattern[hole] = 1; splat(hole, 1.f);
+		if (hole == cluster)
+			break;
+	}
+
+	std::vector<int> rank(count);
+	std::vector<uint8_t> initial_pattern = pattern;
+	std::vector<float> initial_energy = energy;
+
+	// Ranks below the initial pattern: remove clusters one by one
+	for (int r = initial - 1; r >= 0; r--) {
+		int cluster = find(1, true);
+		pattern[cluster] = 0; splat(cluster, -1.f);
+		rank[cluster] = r;
+	}
+
+	// Ranks above: fill the voids
+	pattern = initial_pattern;
+	energy = initial_energy;
+	for (int r = initial; r < count; r++) {
+		int hole = find(0, false);
+		pattern[hole] = 1; splat(hole, 1.f);
+		rank[hole] = r;
+	}
+
+	result.resize(count);
+	for (int p = 0; p < count; p++)
+		result[p] = (uint8_t)((rank[p] * 256) / count);
+}
+
+Texture* Texture::getBlueNoiseTexture()
+{
+	static Texture* blue_noise = NULL;
+	if (blue_noise)
+		return blue_noise;
+	std::vector<uint8_t> data;
+	generateBlueNoise(64, data);
+	blue_noise = new Texture(64, 64, GL_RED, GL_UNSIGNED_BYTE, false, data.data(), GL_R8);
+	return blue_noise;
+}
+
 void Image::fromScreen(int width, int height)
 {
 	if (data && (width != this->width || height != this->height))
@@ -617,6 +722,9 @@ bool Image::loadPNG(const char* filename, bool flip_y)
 	//if (decodePNG(out_image, width, height, buffer.empty() ? 0 : &buffer[0], (unsigned long)buffer.size(), true) != 0)
 	//	return false;
 
+	if (out_image.empty()) //no decoder linked
+		return false;
+
 	data = new uint8_t[out_image.size()];
 	memcpy(data, &out_image[0], out_image.size());
 	bytes_per_pixel = 4;
@@ -127,6 +127,7 @@ public:
 
 	static Texture* getBlackTexture();
 	static Texture* getWhiteTexture();
+	static Texture* getBlueNoiseTexture(); // 64x64 R8, sample it with texelFetch
 };
 
 bool isPowerOfTwo(int n);
\ No newline at end of file
@@ -0,0 +1,238 @@
+#include "textureloader.h"
+
+#include "texture.h"
+#include "../framework/threadpool.h"
+
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <thread>
+
+TextureLoader* TextureLoader::Get()
+{
+	static TextureLoader* loader = new TextureLoader();
+	return loader;
+}
+
+void TextureLoader::load(const std::vector<std::string>& filenames, bool mipmaps, bool wrap)
+{
+	if (this->jobs.empty()) {
+		this->batch_start = std::chrono::steady_clock::now();
+		this->total = this->loaded = this->failed = 0;
+		this->decode_ms = this->batch_ms = 0.f;
+	}
+
+	for (const std::string& filename : filenames) {
+		if (Texture::sTexturesLoaded.count(filename) || isLoading(filename))
+			continue;
+
+		this->jobs.emplace_back();
+		sJob* job = &this->jobs.back();
+		job->filename = filename;
+		job->mipmaps = mipmaps;
+		job->wrap = wrap;
+		this->total++;
+
+		ThreadPool::Get()->enqueue([this, job]() { decode(*job); });
+	}
+}
+
+// 24/32 bits TGA, uncompressed (type 2) or RLE (type 10), same pixels as Image::loadTGA
+bool TextureLoader::decodeTGA(const std::vector<uint8_t>& file, sJob& job)
+{
+	if (file.size() < 18 || file[1] != 0 || (file[2] != 2 && file[2] != 10))
+		return false;
+
+	job.width = file[12] | (file[13] << 8);
+	job.height = file[14] | (file[15] << 8);
+	job.bytes_per_pixel = file[16] / 8;
+	if (job.width <= 0 || job.height <= 0 || (job.bytes_per_pixel != 3 && job.bytes_per_pixel != 4))
+		return false;
+
+	int bpp = job.bytes_per_pixel;
+	size_t size = (size_t)job.width * job.height * bpp;
+	size_t pos = 18 + file[0]; // after the image id
+	job.pixels.resize(size);
+	uint8_t* out = job.pixels.data();
+
+	if (file[2] == 2) {
+		if (file.size() < pos + size)
+			return false;
+		memcpy(out, &file[pos], size);
+	}
+	else {
+		size_t written = 0;
+		while (written < size) {
+			if (pos >= file.size())
+				return false;
+			uint8_t packet = file[pos++];
+			size_t count = (size_t)(packet & 0x7F) + 1;
+			size_t bytes = (packet & 0x80) ? bpp : count * bpp;
+			if (pos + bytes > file.size() || written + count * bpp > size)
+				return false;
+
+			if (packet & 0x80)
+				for (size_t i = 0; i < count; i++)
+					memcpy(out + written + i * bpp, &file[pos], bpp);
+			else
+				memcpy(out + written, &file[pos], bytes);
+			pos += bytes;
+			written += count * bpp;
+		}
+	}
+
+	// BGR to RGB
+	for (size_t i = 0; i < size; i += bpp)
+		std::swap(out[i], out[i + 2]);
+	return true;
+}
+
+// Runs in a worker thread
+void TextureLoader::decode(sJob& job)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	// Largest pooled buffer, most textures of a scene have the same size
+	{
+		std::lock_guard<std::mutex> lock(this->pool_mutex);
+		if (!this->pool.empty()) {
+			job.pixels.swap(this->pool.back());
+			this->pool.pop_back();
+		}
+	}
+
+	std::string ext = job.filename.size() >= 4 ? job.filename.substr(job.filename.size() - 4) : "";
+	std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+
+	bool ok = false;
+	if (ext == ".tga") {
+		// Read buffer of this worker, it only grows
+		thread_local std::vector<uint8_t> file;
+		FILE* f = fopen(job.filename.c_str(), "rb");
+		if (f) {
+			fseek(f, 0, SEEK_END);
+			long size = ftell(f);
+			fseek(f, 0, SEEK_SET);
+			file.resize(size > 0 ? size : 0);
+			ok = size > 0 && fread(file.data(), 1, size, f) == (size_t)size && decodeTGA(file, job);
+			fclose(f);
+		}
+	}
+	else if (ext == ".png") {
+		Image image;
+		ok = image.loadPNG(job.filename.c_str());
+		if (ok) {
+			job.width = image.width;
+			job.height = image.height;
+			job.bytes_per_pixel = image.bytes_per_pixel;
+			job.pixels.assign(image.data, image.data + (size_t)image.width * image.height * image.bytes_per_pixel);
+		}
+	}
+
+	job.decode_ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+	job.state.store(ok ? JOB_DECODED : JOB_FAILED);
+}
+
+void TextureLoader::createTexture(sJob& job, const uint8_t* data)
+{
+	// As Texture::load does
+	Texture* texture = new Texture();
+	texture->create(job.width, job.height, job.bytes_per_pixel == 3 ? GL_RGB : GL_RGBA, GL_UNSIGNED_BYTE, job.mipmaps, (uint8_t*)data);
+	glBindTexture(GL_TEXTURE_2D, texture->texture_id);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, texture->mipmaps && job.wrap ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, texture->mipmaps && job.wrap ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	texture->filename = job.filename;
+	texture->setName(job.filename.c_str());
+	job.texture = texture;
+	this->loaded++;
+	this->decode_ms += job.decode_ms;
+}
+
+void TextureLoader::release(sJob& job)
+{
+	std::lock_guard<std::mutex> lock(this->pool_mutex);
+	this->pool.push_back(std::move(job.pixels));
+	std::sort(this->pool.begin(), this->pool.end(), [](const std::vector<uint8_t>& a, const std::vector<uint8_t>& b) { return a.capacity() < b.capacity(); });
+	if (this->pool.size() > 4)
+		this->pool.erase(this->pool.begin());
+}
+
+void TextureLoader::update()
+{
+	if (this->jobs.empty())
+		return;
+
+	TextureUploadQueue* queue = TextureUploadQueue::Get();
+	for (auto it = this->jobs.begin(); it != this->jobs.end();) {
+		sJob& job = *it;
+		int state = job.state.load();
+
+		if (state == JOB_DECODED) {
+			// Storage now, the pixels follow through the unpack buffers
+			createTexture(job, NULL);
+			job.upload = queue->enqueue(job.texture, job.pixels.data());
+			job.state.store(JOB_UPLOADING);
+		}
+		else if (state == JOB_FAILED) {
+			std::cout << "[ERROR]: Texture could not be decoded: " << job.filename << std::endl;
+			this->failed++;
+			release(job);
+			it = this->jobs.erase(it);
+			continue;
+		}
+		else if (state == JOB_UPLOADING && queue->isComplete(job.upload)) {
+			release(job);
+			it = this->jobs.erase(it);
+			continue;
+		}
+		it++;
+	}
+
+	if (this->jobs.empty()) {
+		this->batch_ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - this->batch_start).count();
+		std::cout << " + Texture batch: " << this->loaded << " textures in " << this->batch_ms << " ms (" << this->decode_ms
+			<< " ms decoding on " << ThreadPool::Get()->getNumThreads() << " workers, " << this->failed << " failed)" << std::endl;
+	}
+}
+
+bool TextureLoader::isLoading(const std::string& filename) const
+{
+	for (const sJob& job : this->jobs)
+		if (job.filename == filename)
+			return true;
+	return false;
+}
+
+Texture* TextureLoader::finish(const std::string& filename)
+{
+	auto it = std::find_if(this->jobs.begin(), this->jobs.end(), [&](const sJob& job) { return job.filename == filename; });
+	if (it == this->jobs.end())
+		return NULL;
+	sJob& job = *it;
+
+	while (job.state.load() == JOB_DECODING)
+		std::this_thread::yield();
+
+	int state = job.state.load();
+	if (state == JOB_DECODED)
+		createTexture(job, job.pixels.data()); // straight from memory, it is needed now
+	else if (state == JOB_UPLOADING)
+		TextureUploadQueue::Get()->finish(job.upload);
+	else {
+		std::cout << "[ERROR]: Texture could not be decoded: " << job.filename << std::endl;
+		this->failed++;
+	}
+
+	Texture* texture = job.texture;
+	release(job);
+	this->jobs.erase(it);
+	return texture;
+}
+
+void TextureLoader::renderInMenu()
+{
+	ImGui::Text("Textures: %d / %d loaded, %d failed", this->loaded, this->total, this->failed);
+	ImGui::Text("Decode: %.1f ms (all workers), batch: %.1f ms", this->decode_ms, this->batch_ms);
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "textureupload.h"
+#include <string>
+#include <vector>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+class Texture;
+
+// Loads a batch of PNG/TGA textures: the files are read and decoded in the ThreadPool (each worker keeps its
+// file buffer, the pixel buffers are pooled), the render thread creates the textures and their pixels go
+// through the TextureUploadQueue. Textures are registered by filename when created, so Texture::Get finds
+// them; Get on a file that is still decoding waits for that file only.
+class TextureLoader
+{
+public:
+	// Stats of the last batch
+	int total = 0;
+	int loaded = 0;
+	int failed = 0;
+	float decode_ms = 0.f; // summed over the workers
+	float batch_ms = 0.f; // from load to the last texture created
+
+	static TextureLoader* Get();
+
+	// Files already loaded or in the batch are skipped
+	void load(const std::vector<std::string>& filenames, bool mipmaps = true, bool wrap = true);
+
+	// Render thread, once per frame: creates the textures of the decoded images
+	void update();
+
+	bool isLoading(const std::string& filename) const;
+	bool isDone() const { return this->jobs.empty(); }
+	// Blocks until the file is a texture with its pixels, NULL if it could not be decoded
+	Texture* finish(const std::string& filename);
+
+	void renderInMenu();
+
+private:
+	enum eJobState { JOB_DECODING, JOB_DECODED, JOB_FAILED, JOB_UPLOADING };
+
+	struct sJob {
+		std::string filename;
+		bool mipmaps = true;
+		bool wrap = true;
+		std::atomic<int> state{ JOB_DECODING };
+		int width = 0;
+		int height = 0;
+		int bytes_per_pixel = 0;
+		std::vector<uint8_t> pixels;
+		float decode_ms = 0.f;
+		Texture* texture = NULL;
+		TextureUploadQueue::Ticket upload = 0; // pixels are read until it is complete
+	};
+
+	std::list<sJob> jobs;
+	std::chrono::steady_clock::time_point batch_start;
+
+	std::vector<std::vector<uint8_t>> pool; // pixel buffers of uploaded textures
+	std::mutex pool_mutex;
+
+	void decode(sJob& job); // in a worker
+	void createTexture(sJob& job, const uint8_t* data);
+	void release(sJob& job);
+
+	static bool decodeTGA(const std::vector<uint8_t>& file, sJob& job);
+};
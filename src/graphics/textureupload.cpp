@@ -0,0 +1,344 @@
+#include "textureupload.h"
+
+#include "texture.h"
+#include "shader.h"
+#include "../framework/utils.h"
+#include "../framework/threadpool.h"
+
+#include <algorithm>
+#include <cstring>
+#include <thread>
+
+TextureUploadQueue::TextureUploadQueue(size_t slot_size)
+{
+	this->slot_size = slot_size;
+}
+
+TextureUploadQueue::~TextureUploadQueue()
+{
+	// Workers write into the mapped slots
+	while (this->filling.load() > 0)
+		std::this_thread::yield();
+
+	for (int i = 0; i < NUM_SLOTS; i++) {
+		sSlot& slot = this->slots[i];
+		if (slot.fence)
+			glDeleteSync(slot.fence);
+		if (!slot.pbo)
+			continue;
+		if (slot.mapped) {
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.pbo);
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		}
+		glDeleteBuffers(1, &slot.pbo);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+TextureUploadQueue* TextureUploadQueue::Get()
+{
+	static TextureUploadQueue* queue = new TextureUploadQueue();
+	return queue;
+}
+
+void TextureUploadQueue::create()
+{
+	// glBufferStorage is core in 4.4 only, the context is 3.3
+	this->persistent = hasGLExtension("GL_ARB_buffer_storage");
+
+	for (int i = 0; i < NUM_SLOTS; i++) {
+		sSlot& slot = this->slots[i];
+		glGenBuffers(1, &slot.pbo);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.pbo);
+
+		if (this->persistent) {
+			GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			glBufferStorage(GL_PIXEL_UNPACK_BUFFER, this->slot_size, NULL, flags);
+			slot.mapped = (uint8_t*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, this->slot_size, flags);
+		}
+		else {
+			glBufferData(GL_PIXEL_UNPACK_BUFFER, this->slot_size, NULL, GL_STREAM_DRAW);
+		}
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	std::cout << " + Texture uploads: " << NUM_SLOTS << " x " << this->slot_size / (1024 * 1024) << " MB unpack buffers, "
+		<< (this->persistent ? "persistent mapping" : "mapped per chunk") << std::endl;
+}
+
+size_t TextureUploadQueue::getTexelSize(unsigned int format, unsigned int type)
+{
+	size_t components = 4;
+	switch (format) {
+	case GL_RED: case GL_RED_INTEGER: case GL_DEPTH_COMPONENT: components = 1; break;
+	case GL_RG: case GL_RG_INTEGER: components = 2; break;
+	case GL_RGB: case GL_BGR: case GL_RGB_INTEGER: components = 3; break;
+	}
+
+	switch (type) {
+	case GL_UNSIGNED_BYTE: case GL_BYTE: return components;
+	case GL_UNSIGNED_SHORT: case GL_SHORT: case GL_HALF_FLOAT: return components * 2;
+	default: return components * 4; // GL_FLOAT, GL_INT, GL_UNSIGNED_INT
+	}
+}
+
+TextureUploadQueue::Ticket TextureUploadQueue::enqueue(Texture* texture, const glm::ivec3& offset, const glm::ivec3& size, const void* data)
+{
+	assert(texture && texture->texture_id && "Must create texture before uploading data.");
+	assert(texture->texture_type != GL_TEXTURE_CUBE_MAP && "Cubemaps are not supported");
+
+	Ticket ticket = this->next_ticket++;
+
+	sJob job;
+	job.ticket = ticket;
+	job.texture = texture;
+	job.offset = offset;
+	job.size = glm::max(size, glm::ivec3(1));
+	job.data = (const uint8_t*)data;
+	job.row_bytes = job.size.x * getTexelSize(texture->format, texture->type);
+	job.start = std::chrono::steady_clock::now();
+
+	// Whole slices when they fit a slot, rows of a single slice otherwise
+	size_t slice_bytes = job.row_bytes * job.size.y;
+	if (slice_bytes <= this->slot_size)
+		job.slices_per_chunk = (int)(this->slot_size / slice_bytes);
+	else
+		job.rows_per_chunk = (int)(this->slot_size / job.row_bytes);
+
+	// A single row bigger than a slot, upload it from client memory
+	if (!job.slices_per_chunk && !job.rows_per_chunk) {
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glBindTexture(texture->texture_type, texture->texture_id);
+		if (texture->texture_type == GL_TEXTURE_2D)
+			glTexSubImage2D(GL_TEXTURE_2D, 0, offset.x, offset.y, job.size.x, job.size.y, texture->format, texture->type, data);
+		else
+			glTexSubImage3D(texture->texture_type, 0, offset.x, offset.y, offset.z, job.size.x, job.size.y, job.size.z, texture->format, texture->type, data);
+		glBindTexture(texture->texture_type, 0);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		Shader::InvalidateTextureCache();
+		return ticket;
+	}
+
+	this->jobs.push_back(job);
+	this->pending_jobs = (int)this->jobs.size();
+	return ticket;
+}
+
+TextureUploadQueue::Ticket TextureUploadQueue::enqueue(Texture* texture, const void* data)
+{
+	glm::ivec3 size((int)texture->width, (int)texture->height, std::max((int)texture->depth, 1));
+	return enqueue(texture, glm::ivec3(0), size, data);
+}
+
+bool TextureUploadQueue::isComplete(Ticket ticket) const
+{
+	if (ticket == 0 || ticket >= this->next_ticket)
+		return false;
+
+	for (const sJob& job : this->jobs)
+		if (job.ticket == ticket)
+			return false;
+	return true;
+}
+
+void TextureUploadQueue::finish(Ticket ticket)
+{
+	while (ticket && ticket < this->next_ticket && !isComplete(ticket)) {
+		update();
+
+		// Nothing else to do until the GPU or a worker is done
+		for (int i = 0; i < NUM_SLOTS; i++) {
+			if (this->slots[i].state.load() == SLOT_IN_FLIGHT) {
+				glClientWaitSync(this->slots[i].fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+				break;
+			}
+		}
+		std::this_thread::yield();
+	}
+}
+
+void TextureUploadQueue::cancel(Texture* texture)
+{
+	for (auto it = this->jobs.begin(); it != this->jobs.end();) {
+		if (it->texture != texture) {
+			it++;
+			continue;
+		}
+
+		// Chunks already in a slot finish without touching the texture, but the workers still copying from
+		// the data of the job are waited for, the caller can free it once this returns
+		it->texture = NULL;
+		it->next_row = it->size.y * it->size.z;
+		for (sSlot& slot : this->slots)
+			while (slot.job == &*it && slot.state.load() == SLOT_FILLING)
+				std::this_thread::yield();
+		if (it->chunks_in_flight == 0)
+			it = this->jobs.erase(it);
+		else
+			it++;
+	}
+	this->pending_jobs = (int)this->jobs.size();
+}
+
+void TextureUploadQueue::fill(sSlot& slot, sJob& job)
+{
+	glm::ivec3 offset = job.offset;
+	glm::ivec3 size = job.size;
+	int rows = 0;
+
+	if (job.slices_per_chunk) {
+		int z = job.next_row / job.size.y;
+		size.z = std::min(job.slices_per_chunk, job.size.z - z);
+		offset.z += z;
+		rows = size.z * job.size.y;
+	}
+	else {
+		int z = job.next_row / job.size.y;
+		int y = job.next_row % job.size.y;
+		size.y = std::min(job.rows_per_chunk, job.size.y - y);
+		size.z = 1;
+		offset.y += y;
+		offset.z += z;
+		rows = size.y;
+	}
+
+	const uint8_t* source = job.data + job.next_row * job.row_bytes;
+	job.next_row += rows;
+	job.chunks_in_flight++;
+
+	slot.job = &job;
+	slot.offset = offset;
+	slot.size = size;
+	slot.bytes = rows * job.row_bytes;
+
+	// The slot fence has already signaled, nothing reads it
+	if (!this->persistent) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.pbo);
+		slot.mapped = (uint8_t*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, slot.bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	}
+
+	slot.state.store(SLOT_FILLING);
+	if (!slot.mapped) {
+		std::cout << "[ERROR]: Cannot map texture upload buffer" << std::endl;
+		slot.state.store(SLOT_FILLED);
+		return;
+	}
+
+	sSlot* target = &slot;
+	size_t bytes = slot.bytes;
+	this->filling++;
+	ThreadPool::Get()->enqueue([this, target, source, bytes]() {
+		memcpy(target->mapped, source, bytes);
+		target->state.store(SLOT_FILLED);
+		this->filling--;
+	});
+}
+
+void TextureUploadQueue::issue(sSlot& slot)
+{
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.pbo);
+
+	bool valid = slot.mapped != NULL;
+	if (!this->persistent && slot.mapped) {
+		valid = glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER) == GL_TRUE; // the contents can be lost
+		slot.mapped = NULL;
+	}
+
+	// Copied by the driver from the buffer, the call returns without waiting for it
+	Texture* texture = slot.job->texture;
+	if (texture && valid) {
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glBindTexture(texture->texture_type, texture->texture_id);
+		if (texture->texture_type == GL_TEXTURE_2D)
+			glTexSubImage2D(GL_TEXTURE_2D, 0, slot.offset.x, slot.offset.y, slot.size.x, slot.size.y, texture->format, texture->type, 0);
+		else
+			glTexSubImage3D(texture->texture_type, 0, slot.offset.x, slot.offset.y, slot.offset.z, slot.size.x, slot.size.y, slot.size.z, texture->format, texture->type, 0);
+		glBindTexture(texture->texture_type, 0);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		Shader::InvalidateTextureCache();
+		this->frame_bytes += slot.bytes;
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	slot.state.store(SLOT_IN_FLIGHT);
+}
+
+void TextureUploadQueue::retire(sSlot& slot)
+{
+	glDeleteSync(slot.fence);
+	slot.fence = 0;
+
+	sJob* job = slot.job;
+	slot.job = NULL;
+	slot.state.store(SLOT_FREE);
+
+	job->chunks_in_flight--;
+	if (job->chunks_in_flight > 0 || job->next_row < job->size.y * job->size.z)
+		return;
+
+	// Last chunk of the upload
+	Texture* texture = job->texture;
+	if (texture && texture->mipmaps) {
+		glBindTexture(texture->texture_type, texture->texture_id);
+		glGenerateMipmap(texture->texture_type);
+		glBindTexture(texture->texture_type, 0);
+		Shader::InvalidateTextureCache();
+	}
+
+	float latency = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - job->start).count();
+	this->avg_latency = this->avg_latency == 0.f ? latency : this->avg_latency * 0.9f + latency * 0.1f;
+
+	this->jobs.remove_if([job](const sJob& other) { return &other == job; });
+}
+
+void TextureUploadQueue::update()
+{
+	this->frame_bytes = 0;
+	if (!this->slots[0].pbo) {
+		if (this->jobs.empty())
+			return;
+		create();
+	}
+
+	for (int i = 0; i < NUM_SLOTS; i++) {
+		sSlot& slot = this->slots[i];
+		if (slot.state.load() != SLOT_IN_FLIGHT)
+			continue;
+		GLenum result = glClientWaitSync(slot.fence, 0, 0);
+		if (result == GL_ALREADY_SIGNALED || result == GL_CONDITION_SATISFIED)
+			retire(slot);
+	}
+
+	for (int i = 0; i < NUM_SLOTS; i++)
+		if (this->slots[i].state.load() == SLOT_FILLED)
+			issue(this->slots[i]);
+
+	// Hand the next chunks to the workers, oldest upload first
+	size_t budget = 0;
+	for (int i = 0; i < NUM_SLOTS && budget < this->frame_budget; i++) {
+		sSlot& slot = this->slots[i];
+		if (slot.state.load() != SLOT_FREE)
+			continue;
+
+		auto job = std::find_if(this->jobs.begin(), this->jobs.end(), [](const sJob& j) { return j.next_row < j.size.y * j.size.z; });
+		if (job == this->jobs.end())
+			break;
+
+		fill(slot, *job);
+		budget += slot.bytes;
+	}
+
+	this->pending_jobs = (int)this->jobs.size();
+}
+
+void TextureUploadQueue::renderInMenu()
+{
+	int busy = 0;
+	for (int i = 0; i < NUM_SLOTS; i++)
+		busy += this->slots[i].state.load() != SLOT_FREE;
+
+	ImGui::Text("Pending uploads: %d, slots in use: %d / %d (%s)", this->pending_jobs, busy, NUM_SLOTS, this->persistent ? "persistent" : "mapped per chunk");
+	ImGui::Text("Copied this frame: %.2f MB, latency: %.1f ms", this->frame_bytes / (1024.f * 1024.f), this->avg_latency);
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "../framework/includes.h"
+#include <list>
+#include <atomic>
+#include <cstdint>
+#include <chrono>
+
+#include <glm/vec3.hpp>
+
+class Texture;
+
+// Asynchronous texture uploads through a ring of pixel unpack buffers. Uploads are split in chunks of whole
+// slices (or rows, when a slice does not fit a slot), a worker copies each chunk into a mapped slot and the
+// render thread turns it into a glTexSubImage from the buffer, so the driver copies to the texture without
+// stalling the frame. A fence per slot tells when it can be reused and when the upload is complete.
+// Persistently mapped when the driver has ARB_buffer_storage, mapped per chunk otherwise.
+class TextureUploadQueue
+{
+public:
+	static const int NUM_SLOTS = 4;
+
+	typedef uint64_t Ticket; // 0 is never used, it can mean "no upload"
+
+	size_t frame_budget = 16 * 1024 * 1024; // bytes handed to the workers per frame
+
+	// Stats
+	int pending_jobs = 0;
+	size_t frame_bytes = 0; // copied to textures this frame
+	float avg_latency = 0.f; // ms from enqueue to complete
+	bool persistent = false;
+
+	TextureUploadQueue(size_t slot_size = 4 * 1024 * 1024);
+	~TextureUploadQueue();
+
+	static TextureUploadQueue* Get();
+
+	// Copies the region (offset and size in texels) from data, tightly packed in the format and type of the texture.
+	// data must stay valid and unchanged until the ticket is complete
+	Ticket enqueue(Texture* texture, const glm::ivec3& offset, const glm::ivec3& size, const void* data);
+	Ticket enqueue(Texture* texture, const void* data); // the whole texture
+
+	bool isComplete(Ticket ticket) const;
+	// Blocks until the upload is in the texture
+	void finish(Ticket ticket);
+	// Drops the uploads to a texture that is being destroyed. Waits for the chunks being copied from
+	// their data, which can be freed after it returns
+	void cancel(Texture* texture);
+
+	// Render thread, once per frame: retires signaled slots, issues the filled ones and fills the free ones
+	void update();
+	void renderInMenu();
+
+private:
+	enum eSlotState { SLOT_FREE, SLOT_FILLING, SLOT_FILLED, SLOT_IN_FLIGHT };
+
+	struct sJob {
+		Ticket ticket = 0;
+		Texture* texture = NULL;
+		glm::ivec3 offset;
+		glm::ivec3 size;
+		const uint8_t* data = NULL;
+		size_t row_bytes = 0;
+		int rows_per_chunk = 0; // when a slice does not fit a slot
+		int slices_per_chunk = 0;
+		int next_row = 0; // over size.y * size.z
+		int chunks_in_flight = 0;
+		std::chrono::steady_clock::time_point start;
+	};
+
+	struct sSlot {
+		GLuint pbo = 0;
+		uint8_t* mapped = NULL;
+		GLsync fence = 0;
+		std::atomic<int> state{ SLOT_FREE };
+		sJob* job = NULL;
+		glm::ivec3 offset;
+		glm::ivec3 size;
+		size_t bytes = 0;
+	};
+
+	sSlot slots[NUM_SLOTS];
+	size_t slot_size;
+	std::list<sJob> jobs;
+	Ticket next_ticket = 1;
+	std::atomic<int> filling{ 0 };
+
+	void create();
+	void fill(sSlot& slot, sJob& job);
+	void issue(sSlot& slot);
+	void retire(sSlot& slot);
+	static size_t getTexelSize(unsigned int format, unsigned int type);
+};
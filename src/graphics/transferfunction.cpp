@@ -0,0 +1,231 @@
+#include "transferfunction.h"
+
+#include "texture.h"
+#include "shader.h"
+#include "../framework/threadpool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+
+TransferFunction::TransferFunction()
+{
+	this->lut.resize(LUT_SIZE);
+	this->table.resize(LUT_SIZE * LUT_SIZE);
+	setDefault();
+}
+
+TransferFunction::~TransferFunction()
+{
+	if (this->lut_texture)
+		delete this->lut_texture;
+	if (this->preintegrated_texture)
+		delete this->preintegrated_texture;
+}
+
+void TransferFunction::setDefault()
+{
+	// Opacity follows the density, color ramps to red and jumps to white at 0.6
+	this->points.clear();
+	this->points.push_back({ 0.f, glm::vec3(0.f), 0.f });
+	this->points.push_back({ 0.25f, glm::vec3(0.f), 0.25f });
+	this->points.push_back({ 0.6f, glm::vec3(1.f, 0.25f, 0.25f), 0.6f });
+	this->points.push_back({ 0.605f, glm::vec3(1.f), 0.605f });
+	this->points.push_back({ 1.f, glm::vec3(1.f), 1.f });
+
+	markDirty(0.f, 1.f);
+}
+
+void TransferFunction::markDirty(float density_min, float density_max)
+{
+	int begin = std::clamp((int)std::floor(density_min * (LUT_SIZE - 1)), 0, LUT_SIZE - 1);
+	int end = std::clamp((int)std::ceil(density_max * (LUT_SIZE - 1)), 0, LUT_SIZE - 1);
+
+	if (this->lut_dirty || this->table_dirty) {
+		begin = std::min(begin, this->dirty_min);
+		end = std::max(end, this->dirty_max);
+	}
+
+	this->dirty_min = begin;
+	this->dirty_max = end;
+	this->lut_dirty = true;
+	this->table_dirty = true;
+}
+
+// Piecewise linear between control points, returns rgb + extinction per unit length
+glm::vec4 TransferFunction::evaluate(float density)
+{
+	if (this->points.empty())
+		return glm::vec4(0.f);
+
+	sControlPoint point = this->points.back();
+	if (density <= this->points.front().density) {
+		point = this->points.front();
+	}
+	else {
+		for (size_t i = 1; i < this->points.size(); i++) {
+			const sControlPoint& a = this->points[i - 1];
+			const sControlPoint& b = this->points[i];
+			if (density <= b.density) {
+				float f = b.density > a.density ? (density - a.density) / (b.density - a.density) : 1.f;
+				point.color = glm::mix(a.color, b.color, f);
+				point.opacity = a.opacity + (b.opacity - a.opacity) * f;
+				break;
+			}
+		}
+	}
+
+	// Opacity of one reference step to extinction
+	float opacity = std::min(point.opacity, 0.999f);
+	float extinction = -std::log(1.f - opacity) / this->reference_step;
+	return glm::vec4(point.color, extinction);
+}
+
+void TransferFunction::update(float step_length, bool preintegrated)
+{
+	bool rebuild_table = preintegrated && (this->table_dirty || step_length != this->table_step);
+	if (!this->lut_dirty && !rebuild_table)
+		return;
+
+	auto start = std::chrono::steady_clock::now();
+	this->rebuilt_entries = 0;
+
+	if (this->lut_dirty) {
+		for (int i = this->dirty_min; i <= this->dirty_max; i++)
+			this->lut[i] = evaluate(i / (float)(LUT_SIZE - 1));
+		this->rebuilt_entries += this->dirty_max - this->dirty_min + 1;
+
+		if (!this->lut_texture)
+			this->lut_texture = new Texture(LUT_SIZE, 1, GL_RGBA, GL_FLOAT, false, (uint8_t*)this->lut.data(), GL_RGBA32F);
+		else
+			this->lut_texture->upload(GL_RGBA, GL_FLOAT, false, (uint8_t*)this->lut.data(), GL_RGBA32F);
+		this->lut_dirty = false;
+	}
+
+	if (rebuild_table) {
+		// A new step length changes every entry, otherwise only the pairs whose range touches the edit
+		int dirty_min = this->dirty_min;
+		int dirty_max = this->dirty_max;
+		if (step_length != this->table_step) {
+			dirty_min = 0;
+			dirty_max = LUT_SIZE - 1;
+		}
+
+		std::atomic<int> rebuilt{ 0 };
+		ThreadPool::Get()->parallelFor(0, LUT_SIZE, [&](int begin, int end) {
+			int count = 0;
+			for (int back = begin; back < end; back++) {
+				for (int front = 0; front < LUT_SIZE; front++) {
+					if (std::max(front, back) < dirty_min || std::min(front, back) > dirty_max)
+						continue;
+
+					// Integrate the segment with the density going linearly from front to back,
+					// one sub-step per lookup entry crossed
+					int sub_steps = std::abs(back - front) + 1;
+					float h = step_length / sub_steps;
+					glm::vec3 color(0.f);
+					float transmittance = 1.f;
+					for (int k = 0; k < sub_steps; k++) {
+						float f = (k + 0.5f) / sub_steps;
+						const glm::vec4& s = this->lut[(int)std::round(front + (back - front) * f)];
+						float alpha = 1.f - std::exp(-s.w * h);
+						color += transmittance * alpha * glm::vec3(s.x, s.y, s.z);
+						transmittance *= 1.f - alpha;
+					}
+
+					this->table[back * LUT_SIZE + front] = glm::vec4(color, 1.f - transmittance);
+					count++;
+				}
+			}
+			rebuilt += count;
+		});
+		this->rebuilt_entries += rebuilt.load();
+
+		if (!this->preintegrated_texture)
+			this->preintegrated_texture = new Texture(LUT_SIZE, LUT_SIZE, GL_RGBA, GL_FLOAT, false, (uint8_t*)this->table.data(), GL_RGBA32F);
+		else
+			this->preintegrated_texture->upload(GL_RGBA, GL_FLOAT, false, (uint8_t*)this->table.data(), GL_RGBA32F);
+
+		this->table_step = step_length;
+		this->table_dirty = false;
+	}
+
+	this->build_time = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void TransferFunction::setUniforms(Shader* shader, int first_slot)
+{
+	if (this->lut_texture)
+		shader->setUniform("u_transfer_function", this->lut_texture, first_slot);
+	if (this->preintegrated_texture)
+		shader->setUniform("u_preintegrated", this->preintegrated_texture, first_slot + 1);
+}
+
+bool TransferFunction::renderInMenu()
+{
+	bool changed = false;
+
+	// Opacity curve
+	float opacities[LUT_SIZE];
+	for (int i = 0; i < LUT_SIZE; i++)
+		opacities[i] = 1.f - std::exp(-this->lut[i].w * this->reference_step);
+	ImGui::PlotLines("Opacity", opacities, LUT_SIZE, 0, NULL, 0.f, 1.f, ImVec2(0, 60));
+
+	int remove = -1;
+	for (int i = 0; i < (int)this->points.size(); i++) {
+		sControlPoint& point = this->points[i];
+		float old_density = point.density;
+		float range_min = i > 0 ? this->points[i - 1].density : 0.f;
+		float range_max = i + 1 < (int)this->points.size() ? this->points[i + 1].density : 1.f;
+
+		ImGui::PushID(i);
+		bool edited = ImGui::DragFloat("Density", &point.density, 0.005f, 0.f, 1.f);
+		edited |= ImGui::ColorEdit3("Color", (float*)&point.color);
+		edited |= ImGui::SliderFloat("Opacity", &point.opacity, 0.f, 1.f);
+		if (this->points.size() > 2 && ImGui::Button("Remove"))
+			remove = i;
+		ImGui::PopID();
+
+		if (edited) {
+			// The point affects the lookup between its neighbors, before and after moving
+			markDirty(std::min(range_min, point.density), std::max(range_max, point.density));
+			if (point.density != old_density) {
+				std::sort(this->points.begin(), this->points.end(), [](const sControlPoint& a, const sControlPoint& b) { return a.density < b.density; });
+				markDirty(std::min(old_density, point.density), std::max(old_density, point.density));
+			}
+			changed = true;
+			break; // the list may have been reordered
+		}
+	}
+
+	if (remove >= 0) {
+		float range_min = remove > 0 ? this->points[remove - 1].density : 0.f;
+		float range_max = remove + 1 < (int)this->points.size() ? this->points[remove + 1].density : 1.f;
+		this->points.erase(this->points.begin() + remove);
+		markDirty(range_min, range_max);
+		changed = true;
+	}
+
+	if (ImGui::Button("Add Point")) {
+		// Splits the widest interval
+		size_t widest = 1;
+		for (size_t i = 1; i < this->points.size(); i++) {
+			if (this->points[i].density - this->points[i - 1].density > this->points[widest].density - this->points[widest - 1].density)
+				widest = i;
+		}
+		float density = (this->points[widest - 1].density + this->points[widest].density) * 0.5f;
+		glm::vec4 value = evaluate(density);
+		sControlPoint point = { density, glm::vec3(value.x, value.y, value.z), 1.f - std::exp(-value.w * this->reference_step) };
+		this->points.insert(this->points.begin() + widest, point);
+		changed = true;
+	}
+	ImGui::SameLine();
+	if (ImGui::Button("Reset")) {
+		setDefault();
+		changed = true;
+	}
+
+	ImGui::Text("Last rebuild: %d entries, %.2f ms", this->rebuilt_entries, this->build_time);
+	return changed;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "../framework/includes.h"
+#include <vector>
+
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+
+class Texture;
+class Shader;
+
+// Editable transfer function for normalized densities [0..1].
+// Baked into a 1D lookup (rgb + extinction) and a 2D pre-integrated table that stores, for every
+// (front, back) density pair, the color and opacity of a whole ray segment of one step length.
+// Editing a control point only rebuilds the entries whose density range touches it.
+class TransferFunction
+{
+public:
+	static const int LUT_SIZE = 256;
+
+	struct sControlPoint {
+		float density;
+		glm::vec3 color;
+		float opacity; // for a step of reference_step, converted to extinction in the lookup
+	};
+
+	std::vector<sControlPoint> points; // sorted by density
+	float reference_step = 0.04f;
+
+	Texture* lut_texture = NULL;
+	Texture* preintegrated_texture = NULL;
+
+	// Stats
+	float build_time = 0.f; // ms
+	int rebuilt_entries = 0;
+
+	TransferFunction();
+	~TransferFunction();
+
+	// Same look as the old hard-coded ramp of medical_volume.fs
+	void setDefault();
+
+	void markDirty(float density_min, float density_max);
+
+	// Rebuilds whatever is out of date and uploads it
+	void update(float step_length, bool preintegrated);
+	void setUniforms(Shader* shader, int first_slot);
+
+	// Returns true if a control point changed
+	bool renderInMenu();
+
+private:
+	std::vector<glm::vec4> lut; // rgb + extinction
+	std::vector<glm::vec4> table; // premultiplied rgb + opacity
+
+	int dirty_min = 0; // lookup entries, inclusive
+	int dirty_max = LUT_SIZE - 1;
+	bool lut_dirty = true;
+	bool table_dirty = true; // dirty range pending for the table
+	float table_step = -1.f;
+
+	glm::vec4 evaluate(float density);
+};
@@ -0,0 +1,124 @@
+#include "uniformring.h"
+
+#include "../framework/utils.h"
+
+#include <cstring>
+
+UniformRing::UniformRing(size_t region_size)
+{
+	this->region_size = region_size;
+}
+
+UniformRing::~UniformRing()
+{
+	for (int i = 0; i < NUM_REGIONS; i++)
+		if (this->fences[i])
+			glDeleteSync(this->fences[i]);
+
+	if (this->ubo) {
+		if (this->mapped) {
+			glBindBuffer(GL_UNIFORM_BUFFER, this->ubo);
+			glUnmapBuffer(GL_UNIFORM_BUFFER);
+		}
+		glDeleteBuffers(1, &this->ubo);
+	}
+}
+
+UniformRing* UniformRing::Get()
+{
+	static UniformRing* ring = new UniformRing();
+	return ring;
+}
+
+void UniformRing::create()
+{
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &this->alignment);
+	this->region_size = (this->region_size + this->alignment - 1) / this->alignment * this->alignment;
+	GLsizeiptr total = this->region_size * NUM_REGIONS;
+
+	glGenBuffers(1, &this->ubo);
+	glBindBuffer(GL_UNIFORM_BUFFER, this->ubo);
+
+	// glBufferStorage is core in 4.4 only, the context is 3.3
+	if (hasGLExtension("GL_ARB_buffer_storage")) {
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_UNIFORM_BUFFER, total, NULL, flags);
+		this->mapped = (uint8_t*)glMapBufferRange(GL_UNIFORM_BUFFER, 0, total, flags);
+	}
+	else {
+		glBufferData(GL_UNIFORM_BUFFER, total, NULL, GL_DYNAMIC_DRAW);
+	}
+
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	this->persistent = this->mapped != NULL;
+
+	std::cout << " + Uniform ring: " << NUM_REGIONS << " x " << this->region_size / 1024 << " KB, "
+		<< (this->persistent ? "persistent mapping" : "glBufferSubData") << std::endl;
+}
+
+void UniformRing::beginFrame()
+{
+	if (!this->ubo)
+		create();
+
+	this->frame++;
+	int region = this->frame % NUM_REGIONS;
+
+	// Normally signaled long ago, it only blocks when the CPU is NUM_REGIONS frames ahead
+	if (this->fences[region]) {
+		glClientWaitSync(this->fences[region], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+		glDeleteSync(this->fences[region]);
+		this->fences[region] = 0;
+	}
+
+	this->head = 0;
+	this->uploads = 0;
+	this->bytes = 0;
+}
+
+void UniformRing::endFrame()
+{
+	int region = this->frame % NUM_REGIONS;
+	this->fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+UniformRing::sAllocation UniformRing::upload(const void* data, size_t size)
+{
+	sAllocation allocation;
+
+	size_t aligned = (size + this->alignment - 1) / this->alignment * this->alignment;
+	if (this->head + aligned > this->region_size) {
+		static bool warned = false;
+		if (!warned) std::cout << "[ERROR]: Uniform ring region full (" << this->region_size / 1024 << " KB), blocks are overwritten" << std::endl;
+		warned = true;
+		this->head = 0;
+	}
+
+	allocation.offset = (this->frame % NUM_REGIONS) * this->region_size + this->head;
+	allocation.size = size;
+	allocation.frame = this->frame;
+	this->head += aligned;
+
+	if (this->mapped) {
+		memcpy(this->mapped + allocation.offset, data, size);
+	}
+	else {
+		glBindBuffer(GL_UNIFORM_BUFFER, this->ubo);
+		glBufferSubData(GL_UNIFORM_BUFFER, allocation.offset, size, data);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	}
+
+	this->uploads++;
+	this->bytes += (int)size;
+	return allocation;
+}
+
+bool UniformRing::isValid(const sAllocation& allocation) const
+{
+	return allocation.size > 0 && this->frame - allocation.frame < NUM_REGIONS;
+}
+
+void UniformRing::bind(const sAllocation& allocation, int binding)
+{
+	glBindBufferRange(GL_UNIFORM_BUFFER, binding, this->ubo, allocation.offset, allocation.size);
+}
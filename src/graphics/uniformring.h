@@ -0,0 +1,50 @@
+#pragma once
+
+#include "../framework/includes.h"
+#include <cstdint>
+
+// Per frame storage for the std140 uniform blocks: one GL_UNIFORM_BUFFER split in NUM_REGIONS regions,
+// one per frame in flight. Blocks are appended to the region of the current frame and bound with
+// glBindBufferRange, a fence per region keeps the CPU from writing what the GPU may still be reading.
+// Persistently mapped when the driver has ARB_buffer_storage (the context is 3.3), glBufferSubData otherwise.
+class UniformRing
+{
+public:
+	static const int NUM_REGIONS = 3;
+
+	struct sAllocation {
+		GLintptr offset = 0;
+		GLsizeiptr size = 0;
+		int frame = -NUM_REGIONS; // written in this frame
+	};
+
+	int uploads = 0; // this frame
+	int bytes = 0;
+	bool persistent = false;
+
+	UniformRing(size_t region_size = 256 * 1024);
+	~UniformRing();
+
+	// Shared by the frame and material blocks
+	static UniformRing* Get();
+
+	// Waits for the region written NUM_REGIONS frames ago and starts filling it
+	void beginFrame();
+	void endFrame();
+
+	sAllocation upload(const void* data, size_t size);
+	// The data of an older allocation is still there until its region comes around again
+	bool isValid(const sAllocation& allocation) const;
+	void bind(const sAllocation& allocation, int binding);
+
+private:
+	GLuint ubo = 0;
+	uint8_t* mapped = NULL;
+	GLsync fences[NUM_REGIONS] = { 0, 0, 0 };
+	size_t region_size = 0;
+	size_t head = 0; // within the current region
+	GLint alignment = 256;
+	int frame = 0;
+
+	void create();
+};
@@ -0,0 +1,262 @@
+#include "volumesequence.h"
+
+#include "texture.h"
+#include "material.h"
+#include "../framework/threadpool.h"
+
+#include <filesystem>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+static double nowMs()
+{
+	using namespace std::chrono;
+	return duration<double, std::milli>(steady_clock::now().time_since_epoch()).count();
+}
+
+static void accumulate(float& avg, float value)
+{
+	avg = avg == 0.f ? value : avg * 0.9f + value * 0.1f;
+}
+
+VolumeSequence::VolumeSequence(int resolution, int ring_size)
+{
+	this->resolution = resolution;
+	this->ring_size = std::max(2, ring_size);
+	this->slots = new sFrameSlot[this->ring_size];
+}
+
+VolumeSequence::~VolumeSequence()
+{
+	// Workers write into the slots, wait for them before releasing anything
+	while (this->pending_jobs.load() > 0)
+		std::this_thread::yield();
+	for (int i = 0; i < this->ring_size; i++)
+		if (this->slots[i].state.load() == SLOT_UPLOADING)
+			TextureUploadQueue::Get()->finish(this->slots[i].upload);
+
+	delete[] this->slots;
+
+	if (this->texture)
+		delete this->texture;
+}
+
+bool VolumeSequence::load(const std::string& folder)
+{
+	this->frame_files.clear();
+
+	std::error_code error;
+	for (const auto& entry : std::filesystem::directory_iterator(folder, error)) {
+		if (entry.is_regular_file() && entry.path().extension() == ".vdb")
+			this->frame_files.push_back(entry.path().string());
+	}
+	std::sort(this->frame_files.begin(), this->frame_files.end());
+
+	if (this->frame_files.empty()) {
+		std::cout << "[ERROR]: No .vdb frames found in " << folder << std::endl;
+		return false;
+	}
+
+	std::cout << " + VDB sequence: " << folder << " (" << this->frame_files.size() << " frames)" << std::endl;
+
+	this->texture = new Texture();
+	this->texture->create3D(this->resolution, this->resolution, this->resolution, GL_RED, GL_UNSIGNED_BYTE, false, (uint8_t*)NULL, GL_R8);
+
+	this->current_frame = -1;
+	this->uploading_frame = -1;
+	this->start_time = -1.0;
+
+	return true;
+}
+
+int VolumeSequence::getTargetFrame(double time)
+{
+	int num_frames = (int)this->frame_files.size();
+	int frame = this->start_frame + (int)floor((time - this->start_time) * this->fps);
+
+	if (this->loop)
+		return frame % num_frames;
+
+	return std::min(frame, num_frames - 1);
+}
+
+VolumeSequence::sFrameSlot* VolumeSequence::findSlot(int frame)
+{
+	for (int i = 0; i < this->ring_size; i++) {
+		if (this->slots[i].frame == frame && this->slots[i].state.load() != SLOT_FREE)
+			return &this->slots[i];
+	}
+	return NULL;
+}
+
+void VolumeSequence::requestFrame(int frame)
+{
+	sFrameSlot* slot = NULL;
+	for (int i = 0; i < this->ring_size && !slot; i++) {
+		if (this->slots[i].state.load() == SLOT_FREE)
+			slot = &this->slots[i];
+	}
+
+	// Ring is full, the frame will be requested again once a slot is free
+	if (!slot)
+		return;
+
+	slot->frame = frame;
+	slot->request_time = nowMs();
+	slot->state.store(SLOT_LOADING);
+
+	std::string filename = this->frame_files[frame];
+	this->pending_jobs++;
+	ThreadPool::Get()->enqueue([this, slot, filename]() {
+		loadFrame(slot, filename);
+		this->pending_jobs--;
+	});
+}
+
+// Runs in a worker thread
+void VolumeSequence::loadFrame(sFrameSlot* slot, std::string filename)
+{
+	int size = this->resolution * this->resolution * this->resolution;
+
+	double start = nowMs();
+	easyVDB::OpenVDBReader reader;
+	reader.read(filename);
+	double loaded = nowMs();
+
+	slot->voxels.resize(size);
+
+	if (reader.gridsSize > 0) {
+		slot->scratch.resize(size);
+		VolumeMaterial::voxelizeGrid(reader.grids[0], this->resolution, slot->scratch.data());
+
+		// loadVDB uploads these floats to a GL_R8 texture, which clamps them to [0, 1]. Keep the same look
+		for (int i = 0; i < size; i++)
+			slot->voxels[i] = (uint8_t)(std::min(slot->scratch[i], 1.f) * 255.f);
+	}
+	else {
+		memset(slot->voxels.data(), 0, size);
+	}
+
+	slot->load_time = (float)(loaded - start);
+	slot->voxelize_time = (float)(nowMs() - loaded);
+	slot->state.store(SLOT_READY);
+}
+
+void VolumeSequence::uploadFrame(sFrameSlot* slot)
+{
+	// A worker copies the voxels to an unpack buffer and the driver copies that to the texture, the slot
+	// is kept until then
+	slot->upload_time = nowMs();
+	slot->upload = TextureUploadQueue::Get()->enqueue(this->texture, slot->voxels.data());
+	slot->state.store(SLOT_UPLOADING);
+
+	accumulate(this->avg_load_time, slot->load_time);
+	accumulate(this->avg_voxelize_time, slot->voxelize_time);
+}
+
+void VolumeSequence::finishUploads()
+{
+	TextureUploadQueue* queue = TextureUploadQueue::Get();
+	for (int i = 0; i < this->ring_size; i++) {
+		sFrameSlot& slot = this->slots[i];
+		if (slot.state.load() != SLOT_UPLOADING || !queue->isComplete(slot.upload))
+			continue;
+
+		double end = nowMs();
+		accumulate(this->avg_upload_time, (float)(end - slot.upload_time));
+		accumulate(this->avg_latency, (float)(end - slot.request_time));
+		slot.upload = 0;
+		slot.state.store(SLOT_FREE);
+
+		// The texture holds the frame only from now on, the caches keyed on current_frame rebuild from it
+		if (slot.frame != this->uploading_frame)
+			continue;
+
+		if (this->current_frame >= 0 && this->playing) {
+			int num_frames = (int)this->frame_files.size();
+			int skipped = this->loop ? (slot.frame - this->current_frame + num_frames) % num_frames : slot.frame - this->current_frame;
+			this->dropped_frames += std::max(0, skipped - 1);
+		}
+
+		this->current_frame = slot.frame;
+		this->uploading_frame = -1;
+		this->shown_frames++;
+	}
+}
+
+void VolumeSequence::restart(double time, int frame)
+{
+	this->start_time = time;
+	this->start_frame = frame;
+}
+
+void VolumeSequence::update(double time)
+{
+	if (this->frame_files.empty() || !this->texture)
+		return;
+
+	int num_frames = (int)this->frame_files.size();
+	finishUploads();
+
+	if (this->start_time < 0.0)
+		restart(time, 0);
+	this->last_time = time;
+
+	int target = this->playing ? getTargetFrame(time) : std::max(this->current_frame, 0);
+
+	// Distance from the target in playback order (negative means already behind)
+	auto ahead = [&](int frame) {
+		return this->loop ? (frame - target + num_frames) % num_frames : frame - target;
+	};
+
+	// Ready frames that fell out of the prefetch window will never be shown
+	for (int i = 0; i < this->ring_size; i++) {
+		sFrameSlot& slot = this->slots[i];
+		if (slot.state.load() == SLOT_READY && slot.frame != target) {
+			int distance = ahead(slot.frame);
+			if (distance < 0 || distance >= this->ring_size)
+				slot.state.store(SLOT_FREE);
+		}
+	}
+
+	// Prefetch the next frames
+	for (int i = 0; i < this->ring_size; i++) {
+		int frame = target + i;
+		if (this->loop)
+			frame %= num_frames;
+		else if (frame >= num_frames)
+			break;
+
+		if (!findSlot(frame))
+			requestFrame(frame);
+	}
+
+	// One upload to the texture at a time, the next target goes once it is complete
+	if (target == this->current_frame || this->uploading_frame >= 0)
+		return;
+
+	sFrameSlot* slot = findSlot(target);
+	if (!slot || slot->state.load() != SLOT_READY)
+		return; // late, keep showing the previous frame
+
+	uploadFrame(slot);
+	this->uploading_frame = target;
+}
+
+void VolumeSequence::renderInMenu()
+{
+	ImGui::Text("Frame: %d / %d", this->current_frame, (int)this->frame_files.size());
+
+	if (ImGui::Checkbox("Playing", &this->playing) && this->playing)
+		restart(this->last_time, std::max(this->current_frame, 0));
+	ImGui::Checkbox("Loop", &this->loop);
+	if (ImGui::SliderFloat("FPS", &this->fps, 1.f, 60.f))
+		restart(this->last_time, std::max(this->current_frame, 0));
+
+	ImGui::Text("Shown: %d  Dropped: %d", this->shown_frames, this->dropped_frames);
+	ImGui::Text("Load: %.2f ms  Voxelize: %.2f ms  Upload: %.2f ms", this->avg_load_time, this->avg_voxelize_time, this->avg_upload_time);
+	ImGui::Text("Latency (request to screen): %.2f ms", this->avg_latency);
+	ImGui::Text("Frames in flight: %d", this->pending_jobs.load());
+}
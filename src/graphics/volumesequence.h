@@ -0,0 +1,75 @@
+#pragma once
+
+#include "../framework/includes.h"
+#include "textureupload.h"
+#include <string>
+#include <vector>
+#include <atomic>
+
+class Texture;
+
+// Plays a folder of .vdb files (one file per frame) as an animated density volume.
+// Upcoming frames are read and voxelized in the ThreadPool into a ring of host buffers,
+// the render thread hands the ready ones to the TextureUploadQueue, which copies them to the 3D texture.
+class VolumeSequence
+{
+public:
+	enum eSlotState { SLOT_FREE, SLOT_LOADING, SLOT_READY, SLOT_UPLOADING };
+
+	struct sFrameSlot {
+		int frame = -1;
+		std::atomic<int> state{ SLOT_FREE };
+		std::vector<uint8_t> voxels;
+		std::vector<float> scratch; // float output of the voxelizer
+		double request_time = 0.0;
+		double upload_time = 0.0;
+		TextureUploadQueue::Ticket upload = 0; // voxels are read until it is complete
+		float load_time = 0.f; // ms
+		float voxelize_time = 0.f; // ms
+	};
+
+	std::vector<std::string> frame_files;
+	Texture* texture = NULL;
+
+	int resolution;
+	float fps = 24.f;
+	bool playing = true;
+	bool loop = true;
+
+	// Stats (times in ms, exponential moving averages)
+	int current_frame = -1; // in the texture, set once its upload is complete
+	int shown_frames = 0;
+	int dropped_frames = 0;
+	float avg_load_time = 0.f;
+	float avg_voxelize_time = 0.f;
+	float avg_upload_time = 0.f; // from handing the frame to the queue to being in the texture
+	float avg_latency = 0.f; // from the prefetch request to the frame being on screen
+
+	VolumeSequence(int resolution = 128, int ring_size = 6);
+	~VolumeSequence();
+
+	// Collects all the .vdb files in the folder, sorted by name
+	bool load(const std::string& folder);
+
+	// Must be called from the render thread, time in seconds
+	void update(double time);
+	void renderInMenu();
+
+private:
+	sFrameSlot* slots = NULL;
+	int ring_size;
+	std::atomic<int> pending_jobs{ 0 };
+
+	double start_time = -1.0;
+	double last_time = 0.0;
+	int start_frame = 0;
+	int uploading_frame = -1; // queued to the texture, not complete yet
+
+	int getTargetFrame(double time);
+	sFrameSlot* findSlot(int frame);
+	void requestFrame(int frame);
+	void loadFrame(sFrameSlot* slot, std::string filename);
+	void uploadFrame(sFrameSlot* slot);
+	void finishUploads();
+	void restart(double time, int frame);
+};